@@ -0,0 +1,255 @@
+#include "fake_px4.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+static constexpr int kPollTimeoutMs = 100;
+
+const char *BenchTransportName(BenchTransport transport) {
+  switch (transport) {
+  case BenchTransport::udp:
+    return "udp";
+  case BenchTransport::tcp_server:
+    return "tcp-server";
+  case BenchTransport::tcp_client:
+    return "tcp-client";
+  case BenchTransport::shm:
+    return "shm";
+  default:
+    return "unknown";
+  }
+}
+
+bool ParseBenchTransport(const std::string &name, BenchTransport *transport) {
+  for (auto t : {BenchTransport::udp, BenchTransport::tcp_server, BenchTransport::tcp_client,
+                 BenchTransport::shm}) {
+    if (name == BenchTransportName(t)) {
+      *transport = t;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string BenchShmName(int port) {
+  return "mavlink_bench_" + std::to_string(port);
+}
+
+static struct sockaddr_in LoopbackAddr(int port) {
+  struct sockaddr_in addr {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  return addr;
+}
+
+FakePx4::FakePx4(BenchTransport transport, int port) :
+  transport_(transport),
+  port_(port)
+{
+}
+
+FakePx4::~FakePx4() {
+  Stop();
+}
+
+void FakePx4::Start() {
+  if (transport_ == BenchTransport::shm) {
+    if (!shm_.Attach(BenchShmName(port_))) {
+      std::cerr << "FakePx4: cannot attach to the shared-memory link, aborting" << std::endl;
+      abort();
+    }
+    thread_ = std::thread([this] () {
+      RunShm();
+    });
+    return;
+  }
+
+  const struct sockaddr_in addr = LoopbackAddr(port_);
+
+  if (transport_ == BenchTransport::udp) {
+    socket_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  } else if (transport_ == BenchTransport::tcp_client) {
+    socket_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  }
+
+  if (transport_ != BenchTransport::tcp_server) {
+    if (socket_fd_ < 0) {
+      std::cerr << "FakePx4: socket failed: " << strerror(errno) << ", aborting" << std::endl;
+      abort();
+    }
+    int yes = 1;
+    setsockopt(socket_fd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (bind(socket_fd_, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      std::cerr << "FakePx4: bind to port " << port_ << " failed: " << strerror(errno) << ", aborting" << std::endl;
+      abort();
+    }
+    // Listening before the plugin starts connecting
+    if (transport_ == BenchTransport::tcp_client && listen(socket_fd_, 1) < 0) {
+      std::cerr << "FakePx4: listen failed: " << strerror(errno) << ", aborting" << std::endl;
+      abort();
+    }
+  }
+
+  thread_ = std::thread([this] () {
+    Run();
+  });
+}
+
+void FakePx4::Stop() {
+  stop_ = true;
+  shm_.Wake();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  shm_.Close();
+  if (conn_fd_ >= 0 && conn_fd_ != socket_fd_) {
+    ::close(conn_fd_);
+  }
+  if (socket_fd_ >= 0) {
+    ::close(socket_fd_);
+  }
+  conn_fd_ = socket_fd_ = -1;
+}
+
+double FakePx4::CpuSeconds() const {
+  if (!thread_.joinable()) {
+    return 0.0;
+  }
+  clockid_t clock;
+  struct timespec ts {};
+  if (pthread_getcpuclockid(const_cast<std::thread &>(thread_).native_handle(), &clock) != 0 ||
+      clock_gettime(clock, &ts) != 0) {
+    return 0.0;
+  }
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool FakePx4::Connect() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  const struct sockaddr_in addr = LoopbackAddr(port_);
+  if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ::close(fd);
+    return false;
+  }
+  conn_fd_ = fd;
+  return true;
+}
+
+void FakePx4::Run() {
+  pthread_setname_np(pthread_self(), "FakePX4");
+
+  // Establish the connection, polling so that Stop() is never blocked
+  if (transport_ == BenchTransport::udp) {
+    conn_fd_ = socket_fd_;
+  } else if (transport_ == BenchTransport::tcp_server) {
+    while (!stop_ && !Connect()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+  } else {
+    struct pollfd pfd {socket_fd_, POLLIN, 0};
+    while (!stop_ && conn_fd_ < 0) {
+      if (poll(&pfd, 1, kPollTimeoutMs) > 0) {
+        conn_fd_ = accept(socket_fd_, nullptr, nullptr);
+      }
+    }
+  }
+
+  if (transport_ != BenchTransport::udp && conn_fd_ >= 0) {
+    int yes = 1;
+    setsockopt(conn_fd_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  }
+
+  uint8_t buf[65535];
+  struct pollfd pfd {conn_fd_, POLLIN, 0};
+  while (!stop_ && conn_fd_ >= 0) {
+    if (poll(&pfd, 1, kPollTimeoutMs) <= 0) {
+      continue;
+    }
+    peer_len_ = sizeof(peer_);
+    const ssize_t ret = recvfrom(conn_fd_, buf, sizeof(buf), 0, (struct sockaddr *)&peer_, &peer_len_);
+    if (ret < 0) {
+      if (errno != EINTR && errno != EAGAIN) {
+        break;
+      }
+      continue;
+    }
+    if (ret == 0 && transport_ != BenchTransport::udp) {
+      break;
+    }
+    HandleBytes(buf, ret);
+  }
+}
+
+void FakePx4::RunShm() {
+  pthread_setname_np(pthread_self(), "FakePX4");
+
+  uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+  while (!stop_) {
+    const size_t len = shm_.Receive(buf, sizeof(buf), std::chrono::milliseconds(kPollTimeoutMs));
+    if (len > 0) {
+      HandleBytes(buf, len);
+    }
+  }
+}
+
+void FakePx4::HandleBytes(const uint8_t *data, size_t len) {
+  mavlink_message_t msg;
+  mavlink_status_t status;
+  for (size_t i = 0; i < len; i++) {
+    if (mavlink_frame_char_buffer(&rx_buffer_, &rx_status_, data[i], &msg, &status) != MAVLINK_FRAMING_OK) {
+      continue;
+    }
+    if (msg.msgid == MAVLINK_MSG_ID_HIL_SENSOR) {
+      mavlink_hil_sensor_t sensor;
+      mavlink_msg_hil_sensor_decode(&msg, &sensor);
+      Reply(sensor);
+    }
+  }
+}
+
+void FakePx4::Reply(const mavlink_hil_sensor_t &sensor) {
+  mavlink_hil_actuator_controls_t controls {};
+  controls.time_usec = sensor.time_usec;
+  controls.mode = MAV_MODE_FLAG_SAFETY_ARMED;
+  controls.flags = 0x0f;  // four motors
+  for (int i = 0; i < 4; i++) {
+    controls.controls[i] = 0.5f;
+  }
+
+  // Own status rather than a global MAVLINK_COMM_* channel, several fakes run at once
+  mavlink_message_t msg;
+  msg.msgid = MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS;
+  memcpy(_MAV_PAYLOAD_NON_CONST(&msg), &controls, sizeof(controls));
+  mavlink_finalize_message_buffer(&msg, 1, 1, &tx_status_,
+    MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS_MIN_LEN,
+    MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS_LEN,
+    MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS_CRC);
+
+  uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+  const uint16_t len = mavlink_msg_to_send_buffer(buf, &msg);
+
+  ssize_t ret;
+  if (transport_ == BenchTransport::shm) {
+    ret = shm_.Send(buf, len) ? len : -1;
+  } else if (transport_ == BenchTransport::udp) {
+    ret = sendto(conn_fd_, buf, len, 0, (const struct sockaddr *)&peer_, peer_len_);
+  } else {
+    ret = send(conn_fd_, buf, len, MSG_NOSIGNAL);
+  }
+  if (ret == len) {
+    replies_++;
+  }
+}
@@ -0,0 +1,92 @@
+/**
+ * @brief Minimal in-process PX4 stand-in that answers HIL_SENSOR with
+ * HIL_ACTUATOR_CONTROLS
+ * @file fake_px4.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+
+#include <development/mavlink.h>
+#include "shm_link.h"
+
+//! How the plugin side of the link is configured
+enum class BenchTransport {
+  udp,         ///< plugin sends to the fake's UDP port, the fake replies to the sender
+  tcp_server,  ///< plugin listens, the fake connects
+  tcp_client,  ///< the fake listens, plugin connects
+  shm,         ///< plugin creates the shared-memory link, the fake attaches
+};
+
+//! Shared-memory link name used for the vehicle on @p port
+std::string BenchShmName(int port);
+
+const char *BenchTransportName(BenchTransport transport);
+bool ParseBenchTransport(const std::string &name, BenchTransport *transport);
+
+/**
+ * @brief One simulated flight controller on its own thread.
+ *
+ * Every HIL_SENSOR is answered immediately with an armed
+ * HIL_ACTUATOR_CONTROLS carrying the same time_usec, so the measured round
+ * trip is the plugin plus the loopback network and nothing else.
+ */
+class FakePx4 {
+public:
+  FakePx4(BenchTransport transport, int port);
+  ~FakePx4();
+
+  FakePx4(const FakePx4 &) = delete;
+  FakePx4 &operator=(const FakePx4 &) = delete;
+
+  //! Create the socket (listening already for tcp_client) and start the thread;
+  //! for shm the plugin has to be loaded first
+  void Start();
+  void Stop();
+
+  uint64_t Replies() const { return replies_; }
+
+  //! CPU time consumed by the fake's thread, to be excluded from the plugin's
+  double CpuSeconds() const;
+
+private:
+  void Run();
+  void RunShm();
+  bool Connect();
+  void HandleBytes(const uint8_t *data, size_t len);
+  void Reply(const mavlink_hil_sensor_t &sensor);
+
+  BenchTransport transport_;
+  int port_;
+  int socket_fd_{-1};
+  int conn_fd_{-1};
+  struct sockaddr_storage peer_{};  ///< UDP: where the last HIL_SENSOR came from
+  socklen_t peer_len_{0};
+  ShmLink shm_;
+
+  std::atomic<bool> stop_{false};
+  std::atomic<uint64_t> replies_{0};
+  std::thread thread_;
+
+  mavlink_message_t rx_buffer_{};
+  mavlink_status_t rx_status_{};
+  mavlink_status_t tx_status_{};
+};
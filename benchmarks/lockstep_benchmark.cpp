@@ -0,0 +1,357 @@
+/**
+ * @brief Closed-loop lockstep benchmark of MavlinkInterface against FakePx4
+ * @file lockstep_benchmark.cpp
+ *
+ * Drives MavlinkInterface exactly like GazeboMavlinkInterface::PreUpdate()
+ * does (ReadMAVLinkMessages(), then SendSensorMessages()), without Gazebo,
+ * for every combination of the selected transports, lockstep modes, vehicle
+ * counts and reactor pool sizes. Example:
+ *
+ *   mavlink_lockstep_benchmark --transports udp,tcp-server --vehicles 1,8,32 --steps 5000
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include "fake_px4.h"
+#include "latency_tracer.h"
+#include "mavlink_interface.h"
+
+static constexpr uint64_t kStepUsec = 4000;  // 250 Hz, as the plugin
+static constexpr auto kWarmupTimeout = std::chrono::seconds(10);
+static constexpr unsigned kMaxVehicles = 256;
+
+struct BenchConfig {
+  BenchTransport transport;
+  bool lockstep;
+  unsigned vehicles;
+  size_t io_threads;
+  size_t steps;
+  int base_port;
+};
+
+struct BenchResult {
+  bool ok{false};
+  double wall{0.0};           ///< [s]
+  double steps_per_sec{0.0};  ///< all vehicles together
+  double cpu_per_step{0.0};   ///< [s] plugin side only, the fake PX4 threads are excluded
+  uint64_t timeouts{0};
+  LatencyHistogram round_trip;
+};
+
+//! Swallows the plugin's std::cout chatter unless --verbose is given
+class NullBuffer : public std::streambuf {
+protected:
+  int overflow(int c) override { return c; }
+};
+
+static double ProcessCpuSeconds() {
+  struct timespec ts {};
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double FakeCpuSeconds(const std::vector<std::unique_ptr<FakePx4>> &fakes) {
+  double cpu = 0.0;
+  for (const auto &fake : fakes) {
+    cpu += fake->CpuSeconds();
+  }
+  return cpu;
+}
+
+struct VehicleState {
+  bool warmed_up{false};
+  uint64_t timeouts_before{0};
+  uint64_t timeouts_after{0};
+};
+
+static void VehicleLoop(MavlinkInterface *link, size_t steps, VehicleState *state,
+    std::atomic<unsigned> *ready, const std::atomic<bool> *go) {
+  SensorData::Imu imu;
+  imu.accel_b = Eigen::Vector3d(0.0, 0.0, -9.81);
+  imu.gyro_b = Eigen::Vector3d::Zero();
+  uint64_t time_usec = 0;
+
+  // Lockstep only starts blocking once the first actuator message arrived
+  const auto deadline = std::chrono::steady_clock::now() + kWarmupTimeout;
+  while (!link->GetReceivedFirstActuator() && std::chrono::steady_clock::now() < deadline) {
+    link->UpdateIMU(imu);
+    link->SendSensorMessages(time_usec += kStepUsec);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    link->ReadMAVLinkMessages();
+  }
+  state->warmed_up = link->GetReceivedFirstActuator();
+  state->timeouts_before = link->GetLockstepWaitStats().timeouts;
+
+  ready->fetch_add(1);
+  while (!go->load()) {
+    std::this_thread::yield();
+  }
+  if (!state->warmed_up) {
+    return;
+  }
+
+  for (size_t i = 0; i < steps; i++) {
+    link->ReadMAVLinkMessages();
+    link->UpdateIMU(imu);
+    link->SendSensorMessages(time_usec += kStepUsec);
+  }
+  // Collect the answer to the last HIL_SENSOR
+  link->ReadMAVLinkMessages();
+
+  state->timeouts_after = link->GetLockstepWaitStats().timeouts;
+}
+
+static void RunConfig(const BenchConfig &config, BenchResult *result) {
+  std::vector<std::unique_ptr<FakePx4>> fakes;
+  std::vector<std::unique_ptr<MavlinkInterface>> links;
+  for (unsigned i = 0; i < config.vehicles; i++) {
+    const int port = config.base_port + i;
+    fakes.emplace_back(new FakePx4(config.transport, port));
+
+    std::unique_ptr<MavlinkInterface> link(new MavlinkInterface());
+    link->SetMavlinkAddr("127.0.0.1");
+    switch (config.transport) {
+    case BenchTransport::udp:
+      link->SetMavlinkUdpRemotePort(port);
+      link->SetMavlinkUdpLocalPort(0);
+      break;
+    case BenchTransport::tcp_server:
+      link->SetUseTcp(true);
+      link->SetMavlinkTcpPort(port);
+      break;
+    case BenchTransport::tcp_client:
+      link->SetUseTcp(true);
+      link->SetUseTcpClientMode(true);
+      link->SetMavlinkTcpPort(port);
+      break;
+    case BenchTransport::shm:
+      link->SetUseShm(true);
+      link->SetShmName(BenchShmName(port));
+      break;
+    }
+    link->SetEnableLockstep(config.lockstep);
+    link->SetLatencyTracing(true);
+    link->SetIoThreads(config.io_threads);
+    links.push_back(std::move(link));
+  }
+
+  // Whoever listens, or creates the shared-memory file, has to be up before the other side connects
+  if (config.transport == BenchTransport::tcp_server || config.transport == BenchTransport::shm) {
+    for (auto &link : links) {
+      link->Load();
+    }
+    for (auto &fake : fakes) {
+      fake->Start();
+    }
+  } else {
+    for (auto &fake : fakes) {
+      fake->Start();
+    }
+    for (auto &link : links) {
+      link->Load();
+    }
+  }
+
+  std::vector<VehicleState> states(config.vehicles);
+  std::vector<std::thread> threads;
+  std::atomic<unsigned> ready{0};
+  std::atomic<bool> go{false};
+  for (unsigned i = 0; i < config.vehicles; i++) {
+    threads.emplace_back(VehicleLoop, links[i].get(), config.steps, &states[i], &ready, &go);
+  }
+
+  while (ready.load() < config.vehicles) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  // Warm-up samples (connection setup) are not part of the measurement
+  for (auto &link : links) {
+    link->GetLatencyTracer()->Reset();
+  }
+
+  const double cpu_start = ProcessCpuSeconds() - FakeCpuSeconds(fakes);
+  const auto wall_start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  const auto wall_end = std::chrono::steady_clock::now();
+  const double cpu_end = ProcessCpuSeconds() - FakeCpuSeconds(fakes);
+
+  result->ok = true;
+  for (unsigned i = 0; i < config.vehicles; i++) {
+    result->ok = result->ok && states[i].warmed_up;
+    result->timeouts += states[i].timeouts_after - states[i].timeouts_before;
+    result->round_trip.Add(links[i]->GetLatencyTracer()->Stage(LatencyStage::step_total));
+  }
+
+  const double total_steps = static_cast<double>(config.steps) * config.vehicles;
+  result->wall = std::chrono::duration<double>(wall_end - wall_start).count();
+  result->steps_per_sec = total_steps / result->wall;
+  result->cpu_per_step = (cpu_end - cpu_start) / total_steps;
+
+  // Same shutdown path as the plugin, it also unblocks the UDP receiver
+  for (auto &link : links) {
+    link->onSigInt();
+  }
+  for (auto &fake : fakes) {
+    fake->Stop();
+  }
+}
+
+template <typename T>
+static bool ParseList(const std::string &arg, std::vector<T> *out, bool (*parse)(const std::string &, T *)) {
+  out->clear();
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    T value;
+    if (!parse(item, &value)) {
+      return false;
+    }
+    out->push_back(value);
+  }
+  return !out->empty();
+}
+
+static bool ParseUnsigned(const std::string &s, unsigned *value) {
+  char *end = nullptr;
+  const unsigned long v = strtoul(s.c_str(), &end, 10);
+  *value = static_cast<unsigned>(v);
+  return end && *end == '\0' && !s.empty();
+}
+
+static bool ParseLockstep(const std::string &s, bool *value) {
+  if (s == "on") {
+    *value = true;
+  } else if (s == "off") {
+    *value = false;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void Usage(const char *name) {
+  std::cerr << "Usage: " << name << " [options]\n"
+            << "  --transports LIST   udp,tcp-server,tcp-client,shm (default: all)\n"
+            << "  --lockstep LIST     on,off (default: on,off)\n"
+            << "  --vehicles LIST     vehicle counts (default: 1,4,16)\n"
+            << "  --io-threads LIST   shared reactor threads, 0 = dedicated threads (default: 0)\n"
+            << "  --steps N           measured steps per vehicle (default: 2000)\n"
+            << "  --base-port N       first port, each run uses a fresh range (default: 24560)\n"
+            << "  --verbose           keep the plugin's console output\n";
+}
+
+int main(int argc, char **argv) {
+  std::vector<BenchTransport> transports{BenchTransport::udp, BenchTransport::tcp_server, BenchTransport::tcp_client,
+                                         BenchTransport::shm};
+  std::vector<bool> lockstep_modes{true, false};
+  std::vector<unsigned> vehicle_counts{1, 4, 16};
+  std::vector<unsigned> io_threads{0};
+  unsigned steps = 2000;
+  unsigned base_port = 24560;
+  bool verbose = false;
+
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    bool ok = true;
+    if (arg == "--transports" && has_value) {
+      ok = ParseList<BenchTransport>(argv[++i], &transports, ParseBenchTransport);
+    } else if (arg == "--lockstep" && has_value) {
+      ok = ParseList<bool>(argv[++i], &lockstep_modes, ParseLockstep);
+    } else if (arg == "--vehicles" && has_value) {
+      ok = ParseList<unsigned>(argv[++i], &vehicle_counts, ParseUnsigned);
+    } else if (arg == "--io-threads" && has_value) {
+      ok = ParseList<unsigned>(argv[++i], &io_threads, ParseUnsigned);
+    } else if (arg == "--steps" && has_value) {
+      ok = ParseUnsigned(argv[++i], &steps);
+    } else if (arg == "--base-port" && has_value) {
+      ok = ParseUnsigned(argv[++i], &base_port);
+    } else if (arg == "--verbose") {
+      verbose = true;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+
+  for (unsigned vehicles : vehicle_counts) {
+    if (vehicles == 0 || vehicles > kMaxVehicles) {
+      std::cerr << "Vehicle counts must be between 1 and " << kMaxVehicles << std::endl;
+      return 1;
+    }
+  }
+
+  NullBuffer null_buffer;
+  std::streambuf *cout_buffer = std::cout.rdbuf();
+  if (!verbose) {
+    std::cout.rdbuf(&null_buffer);
+  }
+
+  printf("%-11s %-8s %8s %6s %12s %12s %10s %10s %10s %12s %8s\n",
+         "transport", "lockstep", "vehicles", "io_thr", "steps/s", "steps/s/veh",
+         "p50_us", "p99_us", "p999_us", "cpu_us/step", "timeouts");
+
+  int exit_code = 0;
+  unsigned run = 0;
+  for (BenchTransport transport : transports) {
+    for (bool lockstep : lockstep_modes) {
+      for (unsigned vehicles : vehicle_counts) {
+        for (unsigned threads : io_threads) {
+          // Fresh ports per run, TCP sockets of the previous run may linger in TIME_WAIT
+          const BenchConfig config{transport, lockstep, vehicles, threads, steps,
+                                   static_cast<int>(base_port + run++ * kMaxVehicles)};
+          BenchResult result;
+          RunConfig(config, &result);
+
+          printf("%-11s %-8s %8u %6u ", BenchTransportName(transport), lockstep ? "on" : "off", vehicles, threads);
+          if (!result.ok) {
+            printf("%12s\n", "FAILED (no answer from fake PX4)");
+            exit_code = 2;
+            continue;
+          }
+          printf("%12.0f %12.0f %10.1f %10.1f %10.1f %12.2f %8llu\n",
+                 result.steps_per_sec, result.steps_per_sec / vehicles,
+                 result.round_trip.Percentile(0.50) * 1e-3,
+                 result.round_trip.Percentile(0.99) * 1e-3,
+                 result.round_trip.Percentile(0.999) * 1e-3,
+                 result.cpu_per_step * 1e6,
+                 static_cast<unsigned long long>(result.timeouts));
+          fflush(stdout);
+        }
+      }
+    }
+  }
+
+  std::cout.rdbuf(cout_buffer);
+  return exit_code;
+}
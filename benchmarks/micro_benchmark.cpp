@@ -0,0 +1,422 @@
+/**
+ * @brief Microbenchmarks of the per-message hot paths of the plugin
+ * @file micro_benchmark.cpp
+ *
+ * Each case runs one operation in a loop until --min-time has passed and
+ * reports ns/op and heap allocations/op, so a change to a parser, encoder or
+ * callback can be judged in isolation. Example:
+ *
+ *   mavlink_micro_benchmark --filter pose/ --poses 64,1024
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gz/msgs/imu.pb.h>
+
+#include "barometer_model.h"
+#include "mavlink_frame_scanner.h"
+#include "mavlink_interface.h"
+#include "pose_lookup.h"
+#include "seqlock.h"
+
+/*******************************************************
+ * Allocation counting
+ */
+
+static std::atomic<uint64_t> g_allocations{0};
+
+void *operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+/*******************************************************
+ * Harness
+ */
+
+//! Keeps the compiler from discarding a result that is otherwise unused
+template <typename T>
+static inline void DoNotOptimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct CaseResult {
+  double ns_per_op;
+  double allocs_per_op;
+  uint64_t ops;
+};
+
+/**
+ * @brief Run @p body(n) with a growing n until it takes at least @p min_time.
+ * @p body must perform exactly n operations.
+ */
+template <typename Body>
+static CaseResult Measure(Body &&body, double min_time) {
+  uint64_t n = 1;
+  for (;;) {
+    const uint64_t allocs_before = g_allocations.load(std::memory_order_relaxed);
+    const auto start = std::chrono::steady_clock::now();
+    body(n);
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const uint64_t allocs = g_allocations.load(std::memory_order_relaxed) - allocs_before;
+
+    if (elapsed >= min_time || n >= (uint64_t(1) << 40)) {
+      return {elapsed * 1e9 / n, static_cast<double>(allocs) / n, n};
+    }
+    // Aim a bit past min_time, but never grow by more than 100x per round
+    const uint64_t estimate = elapsed > 0.0 ? static_cast<uint64_t>(n * min_time * 1.2 / elapsed) : n * 100;
+    n = std::min(n * 100, std::max(n * 2, estimate));
+  }
+}
+
+struct BenchOptions {
+  std::string filter;
+  double min_time{0.2};
+  std::vector<unsigned> pose_counts{16, 256, 4096};
+};
+
+template <typename Body>
+static void RunCase(const BenchOptions &options, const std::string &name, Body &&body) {
+  if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+    return;
+  }
+  const CaseResult result = Measure(body, options.min_time);
+  printf("%-40s %12.1f %12.2f %14llu\n", name.c_str(), result.ns_per_op, result.allocs_per_op,
+         static_cast<unsigned long long>(result.ops));
+}
+
+/*******************************************************
+ * Inputs
+ */
+
+static mavlink_hil_sensor_t MakeHilSensor() {
+  mavlink_hil_sensor_t sensor {};
+  sensor.time_usec = 123456789;
+  sensor.xacc = 0.1f;
+  sensor.yacc = -0.2f;
+  sensor.zacc = -9.81f;
+  sensor.xgyro = 0.01f;
+  sensor.ygyro = 0.02f;
+  sensor.zgyro = -0.03f;
+  sensor.xmag = 0.21f;
+  sensor.ymag = 0.01f;
+  sensor.zmag = 0.42f;
+  sensor.abs_pressure = 1013.25f;
+  sensor.pressure_alt = 488.0f;
+  sensor.temperature = 15.0f;
+  sensor.fields_updated = 0x1fff;
+  return sensor;
+}
+
+//! One serialized HIL_ACTUATOR_CONTROLS frame per entry, as PX4 sends them
+static std::vector<std::vector<uint8_t>> MakeActuatorFrames(size_t count) {
+  mavlink_status_t status {};
+  std::vector<std::vector<uint8_t>> frames;
+  for (size_t i = 0; i < count; i++) {
+    mavlink_hil_actuator_controls_t controls {};
+    controls.time_usec = 4000 * i;
+    controls.mode = MAV_MODE_FLAG_SAFETY_ARMED;
+    controls.flags = 0x0f;
+    for (int c = 0; c < 4; c++) {
+      controls.controls[c] = 0.1f * c + 0.001f * i;
+    }
+
+    mavlink_message_t msg;
+    msg.msgid = MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS;
+    memcpy(_MAV_PAYLOAD_NON_CONST(&msg), &controls, sizeof(controls));
+    mavlink_finalize_message_buffer(&msg, 1, 1, &status,
+      MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS_MIN_LEN,
+      MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS_LEN,
+      MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS_CRC);
+
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    const uint16_t len = mavlink_msg_to_send_buffer(buf, &msg);
+    frames.emplace_back(buf, buf + len);
+  }
+  return frames;
+}
+
+//! World pose vector with @p count entries, the vehicle being the last one
+static gz::msgs::Pose_V MakePoseVector(unsigned count, const std::string &model_name) {
+  gz::msgs::Pose_V poses;
+  for (unsigned i = 0; i < count; i++) {
+    gz::msgs::Pose *pose = poses.add_pose();
+    pose->set_name(i + 1 == count ? model_name : "static_object_" + std::to_string(i));
+    pose->set_id(i + 1);
+    pose->mutable_position()->set_x(i);
+    pose->mutable_position()->set_y(-1.0 * i);
+    pose->mutable_position()->set_z(0.5);
+    pose->mutable_orientation()->set_w(1.0);
+  }
+  return poses;
+}
+
+/*******************************************************
+ * Cases
+ */
+
+static constexpr size_t kFrames = 64;
+
+static void ParseCases(const BenchOptions &options) {
+  const auto frames = MakeActuatorFrames(kFrames);
+
+  // What ReceiveWorker() does for stream transports: every byte through the parser
+  RunCase(options, "parse/frame_char_buffer", [&](uint64_t n) {
+    mavlink_message_t buffer {};
+    mavlink_status_t parse_status {};
+    mavlink_message_t msg;
+    mavlink_status_t status;
+    for (uint64_t i = 0; i < n; i++) {
+      const auto &frame = frames[i % kFrames];
+      for (uint8_t c : frame) {
+        if (mavlink_frame_char_buffer(&buffer, &parse_status, c, &msg, &status) == MAVLINK_FRAMING_OK) {
+          DoNotOptimize(msg.checksum);
+        }
+      }
+    }
+  });
+
+  // Datagram path: one whole-frame scan per frame
+  RunCase(options, "parse/scan_frame", [&](uint64_t n) {
+    mavlink_status_t status {};
+    mavlink_message_t msg;
+    for (uint64_t i = 0; i < n; i++) {
+      const auto &frame = frames[i % kFrames];
+      uint8_t framing;
+      ScanMavlinkFrame(frame.data(), frame.data() + frame.size(), &msg, &status, &framing);
+      DoNotOptimize(framing);
+      DoNotOptimize(msg.checksum);
+    }
+  });
+}
+
+static void EncodeCases(const BenchOptions &options) {
+  const mavlink_hil_sensor_t sensor = MakeHilSensor();
+
+  // The former three stages: generated encoder, re-finalized with the link's
+  // sequence number, then serialized
+  RunCase(options, "encode/hil_sensor_encode_chan", [&](uint64_t n) {
+    mavlink_status_t status {};
+    mavlink_message_t msg;
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    for (uint64_t i = 0; i < n; i++) {
+      mavlink_msg_hil_sensor_encode_chan(kSimSystemId, kSimComponentId, MAVLINK_COMM_0, &msg, &sensor);
+      mavlink_finalize_message_buffer(&msg, kSimSystemId, kSimComponentId, &status,
+        MAVLINK_MSG_ID_HIL_SENSOR_MIN_LEN,
+        MAVLINK_MSG_ID_HIL_SENSOR_LEN,
+        MAVLINK_MSG_ID_HIL_SENSOR_CRC);
+      DoNotOptimize(mavlink_msg_to_send_buffer(buf, &msg));
+      DoNotOptimize(buf);
+    }
+  });
+
+  // What SendSensorMessages() does now: wire bytes in one pass
+  RunCase(options, "encode/hil_sensor_encoder", [&](uint64_t n) {
+    MavlinkEncoder encoder;
+    uint8_t buf[MavlinkEncoder::kMaxFrameLen<MAVLINK_MSG_ID_HIL_SENSOR>];
+    for (uint64_t i = 0; i < n; i++) {
+      DoNotOptimize(encoder.Encode<MAVLINK_MSG_ID_HIL_SENSOR>(sensor, buf));
+      DoNotOptimize(buf);
+    }
+  });
+
+  // Encoded and queued on the link's send scheduler
+  RunCase(options, "encode/push_send_message", [&](uint64_t n) {
+    MavlinkInterface link;
+    for (uint64_t i = 0; i < n; i++) {
+      DoNotOptimize(link.PushSendMessage<MAVLINK_MSG_ID_HIL_SENSOR>(sensor));
+    }
+  });
+}
+
+static void PoseCases(const BenchOptions &options) {
+  const std::string model_name = "x500_0";
+
+  for (unsigned count : options.pose_counts) {
+    const gz::msgs::Pose_V poses = MakePoseVector(count, model_name);
+    const uint64_t id = count;
+    const std::string suffix = "/" + std::to_string(count);
+
+    // Steady state of PoseCallback(): the cached slot still matches
+    RunCase(options, "pose/find_cached" + suffix, [&](uint64_t n) {
+      PoseLookup lookup;
+      for (uint64_t i = 0; i < n; i++) {
+        DoNotOptimize(lookup.Find(poses, model_name, id));
+      }
+    });
+
+    // Layout changed on every message: full scan by name
+    RunCase(options, "pose/find_rescan" + suffix, [&](uint64_t n) {
+      PoseLookup lookup;
+      for (uint64_t i = 0; i < n; i++) {
+        lookup.Reset();
+        DoNotOptimize(lookup.Find(poses, model_name, id));
+      }
+    });
+
+    // What a subscriber pays per message: gz-transport hands over a freshly parsed Pose_V
+    std::string wire;
+    poses.SerializeToString(&wire);
+    RunCase(options, "pose/parse_find" + suffix, [&](uint64_t n) {
+      PoseLookup lookup;
+      for (uint64_t i = 0; i < n; i++) {
+        gz::msgs::Pose_V msg;
+        msg.ParseFromString(wire);
+        DoNotOptimize(lookup.Find(msg, model_name, id));
+      }
+    });
+  }
+}
+
+static void BarometerCases(const BenchOptions &options) {
+  RunCase(options, "baro/pressure_to_altitude", [&](uint64_t n) {
+    float pressure = 95000.0f;
+    for (uint64_t i = 0; i < n; i++) {
+      const SensorData::Barometer baro = BarometerFromPressure(pressure);
+      DoNotOptimize(baro);
+      pressure += 0.01f;
+    }
+  });
+}
+
+static void SensorSnapshotCases(const BenchOptions &options) {
+  struct ImuSample {
+    double accel[3];
+    double gyro[3];
+  };
+
+  // What a transport callback pays to publish a sample
+  RunCase(options, "sensor/seqlock_store", [&](uint64_t n) {
+    Seqlock<ImuSample> slot;
+    ImuSample sample {{0.0, 0.0, -9.81}, {0.0, 0.0, 0.0}};
+    for (uint64_t i = 0; i < n; i++) {
+      sample.gyro[2] += 1e-6;
+      slot.Store(sample);
+    }
+    DoNotOptimize(slot.Version());
+  });
+
+  // What the simulation thread pays to take a snapshot
+  RunCase(options, "sensor/seqlock_load", [&](uint64_t n) {
+    Seqlock<ImuSample> slot;
+    slot.Store(ImuSample {{0.0, 0.0, -9.81}, {0.0, 0.0, 0.0}});
+    for (uint64_t i = 0; i < n; i++) {
+      const ImuSample sample = slot.Load();
+      DoNotOptimize(sample);
+    }
+  });
+
+  // The same snapshot taken by copying the protobuf under a mutex, as before
+  RunCase(options, "sensor/mutex_imu_msg_copy", [&](uint64_t n) {
+    std::mutex mutex;
+    gz::msgs::IMU last;
+    last.mutable_linear_acceleration()->set_z(-9.81);
+    for (uint64_t i = 0; i < n; i++) {
+      const std::lock_guard<std::mutex> lock(mutex);
+      const gz::msgs::IMU copy = last;
+      DoNotOptimize(copy.angular_velocity().z());
+    }
+  });
+}
+
+/*******************************************************
+ * main
+ */
+
+static void Usage(const char *name) {
+  std::cerr << "Usage: " << name << " [options]\n"
+            << "  --filter TEXT       only run cases whose name contains TEXT\n"
+            << "  --min-time SEC      minimum measuring time per case (default: 0.2)\n"
+            << "  --poses LIST        Pose_V sizes for the pose cases (default: 16,256,4096)\n";
+}
+
+static bool ParsePoseCounts(const std::string &arg, std::vector<unsigned> *out) {
+  out->clear();
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    char *end = nullptr;
+    const unsigned long v = strtoul(item.c_str(), &end, 10);
+    if (item.empty() || *end != '\0' || v == 0) {
+      return false;
+    }
+    out->push_back(static_cast<unsigned>(v));
+  }
+  return !out->empty();
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options;
+
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    bool ok = true;
+    if (arg == "--filter" && has_value) {
+      options.filter = argv[++i];
+    } else if (arg == "--min-time" && has_value) {
+      options.min_time = atof(argv[++i]);
+      ok = options.min_time > 0.0;
+    } else if (arg == "--poses" && has_value) {
+      ok = ParsePoseCounts(argv[++i], &options.pose_counts);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+
+  printf("%-40s %12s %12s %14s\n", "case", "ns/op", "allocs/op", "ops");
+  ParseCases(options);
+  EncodeCases(options);
+  PoseCases(options);
+  BarometerCases(options);
+  SensorSnapshotCases(options);
+  return 0;
+}
@@ -0,0 +1,52 @@
+/**
+ * @brief Standard atmosphere conversion of a pressure reading
+ * @file barometer_model.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <math.h>
+#include "mavlink_interface.h"
+
+/**
+ * @brief Temperature, pressure [hPa] and altitude for an absolute pressure
+ * @param absolute_pressure pressure in Pa, noise already applied
+ */
+inline SensorData::Barometer BarometerFromPressure(float absolute_pressure) {
+  const float lapse_rate = 0.0065f; // reduction in temperature with altitude (Kelvin/m)
+  const float pressure_msl = 101325.0f; // pressure at MSL
+  const float temperature_msl = 288.0f; // temperature at MSL (Kelvin)
+
+  // Calculate local temperature:
+  // absolute_pressure = pressure_msl / pressure_ratio
+  // =>
+  const float pressure_ratio = pressure_msl / absolute_pressure;
+  // pressure_ratio = powf(temperature_msl / temperature_local, 5.256f)
+  // =>
+  // temperature_local = temperature_msl / powf(pressure_ratio, 1/5.256f)
+  const float temperature_local = temperature_msl / powf(pressure_ratio, 0.19025875);
+
+  // Calculate altitude from pressure:
+  // temperature_local = temperature_msl - lapse_rate * alt_msl;
+  // =>
+  const float alt_msl = (temperature_msl - temperature_local) / lapse_rate;
+
+  SensorData::Barometer baro_data;
+  baro_data.temperature = temperature_local - 273.15f;
+  baro_data.abs_pressure = absolute_pressure / 100.0f;
+  baro_data.pressure_alt = alt_msl;
+  return baro_data;
+}
@@ -51,8 +51,10 @@
 #include <gz/sim/System.hh>
 #include <gz/sim/Events.hh>
 #include <gz/sim/EventManager.hh>
+#include <gz/sim/Link.hh>
 #include <gz/sim/Model.hh>
 #include <gz/sim/Util.hh>
+#include <gz/sim/World.hh>
 #include "gz/sim/components/Actuators.hh"
 #include <gz/sim/components/AngularVelocity.hh>
 #include <gz/sim/components/Imu.hh>
@@ -70,8 +72,14 @@
 
 #include <common.h>
 
+#include "barometer_model.h"
 #include "mavlink_interface.h"
 #include "msgbuffer.h"
+#include "pose_lookup.h"
+#include "rtf_pacer.h"
+#include "sensor_noise.h"
+#include "sensor_scheduler.h"
+#include "seqlock.h"
 
 
 using lock_guard = std::lock_guard<std::recursive_mutex>;
@@ -97,6 +105,18 @@ static const std::string kDefaultMagTopic = "/magnetometer";
 static const std::string kDefaultBarometerTopic = "/air_pressure";
 static const std::string kDefaultCmdVelTopic = "/cmd_vel";
 
+// Default sensor noise, IMU noise is off unless set in the SDF
+// (0.006/0.006/0.030 m/s^2 and 0.001 rad/s are typical values)
+static constexpr double kDefaultBaroNoiseStddev = 1.5;     // Pa
+static constexpr double kDefaultMagNoiseStddev = 0.0001;   // T
+
+// HIL_GPS rate when the vehicle state is read from the ECM [Hz]
+static constexpr double kDefaultEcmGpsRate = 10.0;
+
+// mavlink_hostname resolution retries, doubling up to the maximum
+static constexpr std::chrono::milliseconds kResolveRetryMin{50};
+static constexpr std::chrono::milliseconds kResolveRetryMax{1000};
+
 namespace mavlink_interface
 {
   class GZ_SIM_VISIBLE GazeboMavlinkInterface:
@@ -142,24 +162,31 @@ namespace mavlink_interface
       bool use_right_elevon_pid_{false};
 
       void PoseCallback(const gz::msgs::Pose_V &_msg);
+      void ModelPoseCallback(const gz::msgs::Pose &_msg);
+      void SendPoseMessage(const gz::math::Pose3d &_pose);
+      void SendGpsMessage(uint64_t _time_usec, double _lat_deg, double _lon_deg,
+          double _alt, const gz::math::Vector3d &_velocity_enu);
       void ImuCallback(const gz::msgs::IMU &_msg);
       void BarometerCallback(const gz::msgs::FluidPressure &_msg);
       void MagnetometerCallback(const gz::msgs::Magnetometer &_msg);
       void GpsCallback(const gz::msgs::NavSat &_msg);
       void SendSensorMessages(const gz::sim::UpdateInfo &_info);
+      void UpdateBuiltinImu(const gz::sim::UpdateInfo &_info, const gz::sim::EntityComponentManager &_ecm);
       void PublishMotorVelocities(gz::sim::EntityComponentManager &_ecm,
           const Eigen::VectorXd &_vels);
-      void PublishServoVelocities(const Eigen::VectorXd &_vels);
+      void PublishServoVelocities(const gz::sim::UpdateInfo &_info,
+          const Eigen::VectorXd &_vels);
       void PublishCmdVelocities(const float _thrust, const float _torque);
+      void PublishLatencyStats(const gz::sim::UpdateInfo &_info);
+      void PublishLinkStats(const gz::sim::UpdateInfo &_info);
       void handle_actuator_controls(const gz::sim::UpdateInfo &_info);
       void onSigInt();
       bool IsRunning();
       bool resolveHostName();
       void ResolveWorker();
-      float AddSimpleNoise(float value, float mean, float stddev);
       void RotateQuaternion(gz::math::Quaterniond &q_FRD_to_NED,
         const gz::math::Quaterniond q_FLU_to_ENU);
-      void ParseMulticopterMotorModelPlugins(const std::string &sdfFilePath);
+      void LoadMotorVelocityScalings(const gz::sim::EntityComponentManager &_ecm);
 
       static const unsigned n_out_max = 16;
       static const unsigned n_motors = 4;
@@ -172,13 +199,18 @@ namespace mavlink_interface
       int motor_input_index_[n_out_max];
       double motor_vel_scalings_[n_out_max] {1.0};
       int servo_input_index_[n_out_max];
+      unsigned n_servos_{0};
+      double servo_last_published_[n_out_max] {};
       bool input_is_cmd_vel_{false};
 
       /// \brief gz communication node and publishers.
       gz::transport::Node node;
       gz::transport::Node::Publisher servo_control_pub_[n_out_max];
+      gz::transport::Node::Publisher servo_batch_pub_;
       gz::transport::Node::Publisher motor_velocity_pub_;
       gz::transport::Node::Publisher cmd_vel_pub_;
+      gz::transport::Node::Publisher latency_pub_;
+      gz::transport::Node::Publisher link_stats_pub_;
 
       std::string pose_sub_topic_{kDefaultPoseTopic};
       std::string imu_sub_topic_{kDefaultImuTopic};
@@ -190,20 +222,42 @@ namespace mavlink_interface
       std::string baro_sub_topic_{kDefaultBarometerTopic};
       std::string cmd_vel_sub_topic_{kDefaultCmdVelTopic};
 
-      std::mutex last_imu_message_mutex_ {};
+      /// \brief Cached index of our model in the world Pose_V
+      PoseLookup pose_lookup_;
+
+      /// \brief Latest IMU reading (FLU, noise free), written by ImuCallback()
+      /// or, with builtin_imu, by UpdateBuiltinImu()
+      struct ImuSample {
+        double accel[3];
+        double gyro[3];
+      };
+      Seqlock<ImuSample> imu_sample_;
 
-      gz::msgs::IMU last_imu_message_;
       gz::msgs::Actuators motor_velocity_message_;
+      gz::msgs::Actuators servo_position_message_;
 
       std::chrono::steady_clock::duration last_imu_time_{0};
       std::chrono::steady_clock::duration lastControllerUpdateTime{0};
       std::chrono::steady_clock::duration last_actuator_time_{0};
+      std::chrono::steady_clock::duration last_servo_pub_time_{0};
+      std::chrono::steady_clock::duration servo_keepalive_period_{std::chrono::seconds(1)};
+      std::chrono::steady_clock::duration last_latency_pub_time_{0};
+      std::chrono::steady_clock::duration latency_pub_period_{std::chrono::seconds(1)};
+      std::chrono::steady_clock::duration last_link_stats_pub_time_{0};
+      std::chrono::steady_clock::duration link_stats_pub_period_{std::chrono::seconds(1)};
+
+      /// \brief Read pose and GPS from the ECM in PostUpdate instead of gz-transport
+      bool read_state_from_ecm_{false};
+      gz::sim::Link state_link_{gz::sim::kNullEntity};
 
       bool mag_updated_{false};
       bool baro_updated_;
       bool diff_press_updated_;
 
-      double imu_update_interval_ = 0.004; ///< Used for non-lockstep
+      /// \brief IMU computed from the kinematics of imu_link_ instead of a gz-sensors IMU
+      bool builtin_imu_{false};
+      gz::sim::Link imu_link_{gz::sim::kNullEntity};
+      bool imu_prev_valid_{false};  ///< velocity_prev_W_ and last_imu_time_ hold the last step
 
       gz::math::Vector3d gravity_W_{gz::math::Vector3d(0.0, 0.0, -9.8)};
       gz::math::Vector3d velocity_prev_W_;
@@ -220,17 +274,28 @@ namespace mavlink_interface
 
       bool enable_lockstep_ = false;
       double speed_factor_ = 1.0;
-      uint8_t previous_imu_seq_ = 0;
-      uint8_t update_skip_factor_ = 1;
+      /// \brief Holds lockstep at speed_factor_ when one is given
+      RtfPacer rtf_pacer_;
+
+      /// \brief Sim time rates of the sensors, HIL_SENSOR goes out on IMU ticks
+      SensorScheduler sensor_scheduler_;
+      uint32_t sensor_pending_mask_{0};  ///< slow sensors due but not sent yet
 
       std::string mavlink_hostname_str_;
-      struct hostent *hostptr_{nullptr};
-      bool mavlink_loaded_{false};
+      std::atomic<bool> mavlink_loaded_{false};  ///< stored once Load() returned (on the resolver thread with a host name), the receive ring is reset until then
+      std::atomic<bool> stop_resolver_{false};
       std::thread hostname_resolver_thread_;
 
       std::atomic<bool> gotSigInt_ {false};
 
-      std::default_random_engine rnd_gen_;
+      /// \brief Sensor noise standard deviations and generators
+      double baro_noise_stddev_{kDefaultBaroNoiseStddev};
+      double mag_noise_stddev_{kDefaultMagNoiseStddev};
+      gz::math::Vector3d accel_noise_stddev_{gz::math::Vector3d::Zero};
+      gz::math::Vector3d gyro_noise_stddev_{gz::math::Vector3d::Zero};
+      GaussianNoise baro_noise_;
+      GaussianNoise mag_noise_;
+      GaussianNoise imu_noise_;
   };
 }
 
@@ -0,0 +1,119 @@
+/**
+ * @brief Process-wide epoll reactor shared by all MAVLink links
+ * @file io_reactor.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+
+#include "thread_placement.h"
+
+/**
+ * @brief A small pool of threads serving the file descriptors of every
+ * vehicle in the process through one epoll instance.
+ *
+ * Descriptors are armed with EPOLLONESHOT, so a handler never runs on two
+ * pool threads at once and successive invocations are ordered by the
+ * registration mutex. Code that was written for a single receiver or sender
+ * thread (e.g. the SPSC receive ring) therefore keeps working unchanged.
+ *
+ * Handlers must not block for long, they share the pool with all other
+ * vehicles. A handler returns false to unregister itself, it must not call
+ * Unregister() on its own registration.
+ */
+class IoReactor {
+public:
+  using Handler = std::function<bool(uint32_t events)>;
+
+  static constexpr size_t kDefaultThreads = 2;
+
+  /**
+   * @brief Shared reactor instance, created on first use and destroyed with
+   * the last reference. The pool size and the placement of its threads are
+   * fixed by the first caller.
+   */
+  static std::shared_ptr<IoReactor> Acquire(size_t num_threads = kDefaultThreads,
+                                            const ThreadPlacement &placement = ThreadPlacement());
+
+  ~IoReactor();
+
+  IoReactor(const IoReactor &) = delete;
+  IoReactor &operator=(const IoReactor &) = delete;
+
+  /**
+   * @brief Watch @p fd for @p events (EPOLLIN, EPOLLOUT, ...).
+   * @return registration id, never 0
+   */
+  uint64_t Register(int fd, uint32_t events, Handler handler);
+
+  /**
+   * @brief Stop watching a registration. On return its handler is not
+   * running and will not be called again. Unknown ids are ignored.
+   */
+  void Unregister(uint64_t id);
+
+  /**
+   * @brief Arm a registration once for @p events on top of its own, e.g.
+   * EPOLLOUT while a send waits for room. Its handler sees which of them
+   * fired and it is re-armed for its own events only. Waits for a running
+   * handler, so it must not be called from that registration's handler.
+   * Unknown ids are ignored.
+   */
+  void Arm(uint64_t id, uint32_t events);
+
+  size_t NumThreads() const { return threads_.size(); }
+
+private:
+  struct Registration {
+    int fd;
+    uint32_t events;
+    Handler handler;
+    std::mutex mtx;       ///< held while the handler runs
+    bool active{true};
+  };
+
+  static constexpr int kMaxEvents = 8;
+  static constexpr uint64_t kWakeId = 0;
+
+  IoReactor(size_t num_threads, const ThreadPlacement &placement);
+
+  void Worker(size_t index);
+  void Dispatch(uint64_t id, uint32_t events);
+
+  int epoll_fd_{-1};
+  int wake_fd_{-1};  ///< eventfd signalled once on shutdown, never drained
+  std::atomic<bool> stop_{false};
+
+  std::mutex regs_mtx_;
+  std::unordered_map<uint64_t, std::shared_ptr<Registration>> regs_;
+  uint64_t next_id_{1};
+
+  std::vector<std::thread> threads_;
+  ThreadPlacement placement_;
+
+  static std::mutex instance_mtx_;
+  static std::weak_ptr<IoReactor> instance_;
+};
@@ -0,0 +1,143 @@
+/**
+ * @brief Per-stage latency histograms of the sensor/actuator lockstep cycle
+ * @file latency_tracer.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include "msgbuffer.h"
+#include "spsc_ring.h"
+
+/**
+ * @brief Lock-free log-linear histogram of nanosecond durations.
+ *
+ * Each power of two is split into kSubBuckets linear buckets (HDR histogram
+ * layout), giving ~6% relative resolution from 1 ns up to ~18 minutes in a
+ * fixed 4.7 kB table. Record() is a few relaxed atomic adds and may be called
+ * from any thread; readers see an approximate but consistent-enough snapshot.
+ */
+class LatencyHistogram {
+public:
+  static constexpr unsigned kSubBucketBits = 4;
+  static constexpr unsigned kSubBuckets = 1u << kSubBucketBits;
+  static constexpr unsigned kMaxMagnitude = 40;  ///< values are clamped to 2^40 ns
+  static constexpr unsigned kBuckets = kSubBuckets + (kMaxMagnitude - kSubBucketBits) * kSubBuckets;
+
+  void Record(int64_t ns);
+
+  uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+  int64_t Max() const { return max_.load(std::memory_order_relaxed); }
+  double Mean() const;
+
+  //! Upper bound of the bucket holding the @p q quantile (0..1), in ns
+  int64_t Percentile(double q) const;
+
+  //! Accumulate the samples of @p other, e.g. to combine several vehicles
+  void Add(const LatencyHistogram &other);
+
+  void Reset();
+
+private:
+  static unsigned BucketIndex(uint64_t value);
+  static int64_t BucketUpperBound(unsigned index);
+
+  std::array<std::atomic<uint64_t>, kBuckets> counts_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<int64_t> max_{0};
+};
+
+//! Stages of one lockstep cycle, in the order they happen
+enum class LatencyStage : unsigned {
+  sensor_queue,     ///< HIL_SENSOR built in SendSensorMessages() -> dequeued by the sender
+  sensor_send,      ///< dequeued -> send()/sendmmsg()/write returned
+  px4_round_trip,   ///< HIL_SENSOR sent -> next HIL_ACTUATOR_CONTROLS received (network + PX4)
+  rx_wakeup,        ///< kernel receive stamp -> data read by the receiver, with kernel timestamps only
+  actuator_queue,   ///< HIL_ACTUATOR_CONTROLS received -> dequeued by ReadMAVLinkMessages()
+  actuator_apply,   ///< dequeued -> applied in handle_actuator_controls()
+  step_total,       ///< HIL_SENSOR built -> the answering actuator controls applied
+  count
+};
+
+/**
+ * @brief Timestamps the sensor and actuator path and feeds one histogram per
+ * stage.
+ *
+ * HIL_SENSOR frames are matched across threads by their MAVLink sequence
+ * number, so nothing has to travel with the frame through the send queue.
+ * Actuator receive stamps travel through a small SPSC ring that mirrors the
+ * order of actuator frames in the receive ring.
+ */
+class LatencyTracer {
+public:
+  static constexpr size_t kNumStages = static_cast<size_t>(LatencyStage::count);
+
+  explicit LatencyTracer(size_t recv_capacity) : actuator_rx_stamps_(recv_capacity) {}
+
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  //! Sequence number of a serialized HIL_SENSOR frame, false for other messages
+  static bool SensorSeq(const MsgBuffer &buffer, uint8_t *seq);
+
+  static const char *StageName(LatencyStage stage);
+
+  // Sensor path: producer thread, then sender thread
+  void SensorEmitted(uint8_t seq, int64_t now);
+  void SensorDequeued(uint8_t seq, int64_t now);
+  void SensorSent(uint8_t seq, int64_t now);
+
+  // Actuator path: receiver thread, then simulation thread
+  //! @p rx_stamp is the kernel receive time where available, see RxWakeup()
+  void ActuatorReceived(int64_t rx_stamp);
+  //! Delay between the kernel receiving data and the receiver thread reading it
+  void RxWakeup(int64_t delay) { Hist(LatencyStage::rx_wakeup).Record(delay); }
+  void ActuatorDequeued(int64_t now);
+  void ActuatorApplied(int64_t now);
+
+  const LatencyHistogram &Stage(LatencyStage stage) const {
+    return stages_[static_cast<size_t>(stage)];
+  }
+
+  //! True when no stage has samples
+  bool Empty() const;
+
+  //! Human readable summary of every stage that has samples
+  void Dump(std::ostream &os) const;
+
+  void Reset();
+
+private:
+  LatencyHistogram &Hist(LatencyStage stage) { return stages_[static_cast<size_t>(stage)]; }
+
+  std::array<LatencyHistogram, kNumStages> stages_;
+
+  std::array<std::atomic<int64_t>, 256> sensor_emit_ns_{};
+  std::array<std::atomic<int64_t>, 256> sensor_dequeue_ns_{};
+  std::atomic<int64_t> last_sent_ns_{0};       ///< when the latest HIL_SENSOR left
+  std::atomic<int64_t> last_sent_emit_ns_{0};  ///< when that HIL_SENSOR was built
+
+  SpscRing<int64_t> actuator_rx_stamps_;
+  int64_t actuator_dequeue_ns_{0};  ///< simulation thread only
+};
@@ -0,0 +1,142 @@
+/**
+ * @brief Memory-mapped recording and replay of the MAVLink link
+ * @file link_recorder.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+//! Which way a recorded frame travelled, seen from the simulator
+enum class LinkDirection : uint8_t {
+  sent = 0,       ///< simulator -> PX4
+  received = 1,   ///< PX4 -> simulator, stamped with the step that handled it
+  unhandled = 2,  ///< PX4 -> simulator, never handed to the simulation (no handler, receive buffer full)
+};
+
+/**
+ * File layout: one LinkRecordFileHeader, then back to back entries, each a
+ * LinkRecordEntry followed by the serialized frame and padded to
+ * kLinkRecordAlign bytes. All fields are host byte order.
+ */
+static constexpr char kLinkRecordMagic[8] = {'M', 'A', 'V', 'L', 'R', 'E', 'C', '\0'};
+static constexpr uint32_t kLinkRecordVersion = 1;
+static constexpr size_t kLinkRecordAlign = 8;
+
+struct LinkRecordFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_align;
+  uint64_t data_bytes;  ///< committed entry bytes after the header, valid even after a crash
+  uint64_t reserved[5];
+};
+static_assert(sizeof(LinkRecordFileHeader) == 64, "LinkRecordFileHeader layout changed");
+
+struct LinkRecordEntry {
+  uint64_t sim_time_usec;  ///< simulation time of the step the frame belongs to
+  int64_t wall_time_ns;    ///< CLOCK_REALTIME when the frame was sent/received
+  uint16_t len;            ///< frame bytes following this entry
+  LinkDirection direction;
+  uint8_t reserved[5];
+};
+static_assert(sizeof(LinkRecordEntry) == 24, "LinkRecordEntry layout changed");
+
+/**
+ * @brief Append-only log of every frame on the link.
+ *
+ * The file is ftruncate()d ahead and written through a shared mapping, so
+ * Append() is a memcpy under a mutex that the sender and receiver sides
+ * rarely contend on. The mapping doubles (mremap) when it fills up and the
+ * file is trimmed to the recorded size by Close().
+ */
+class LinkRecorder {
+public:
+  static constexpr size_t kDefaultCapacity = 16 << 20;
+
+  LinkRecorder() = default;
+  ~LinkRecorder() { Close(); }
+
+  LinkRecorder(const LinkRecorder &) = delete;
+  LinkRecorder &operator=(const LinkRecorder &) = delete;
+
+  //! Create or truncate @p path, false (with a message on stderr) on failure
+  bool Open(const std::string &path, size_t capacity = kDefaultCapacity);
+
+  //! Thread safe; recording stops with a message if the file cannot grow
+  void Append(LinkDirection direction, uint64_t sim_time_usec, const uint8_t *frame, size_t len);
+
+  //! Trim the file to its content and unmap it, may be called repeatedly
+  void Close();
+
+  uint64_t Entries() const { return entries_; }
+  const std::string &Path() const { return path_; }
+
+private:
+  bool Grow(size_t min_capacity);
+
+  std::mutex mutex_;
+  std::string path_;
+  int fd_{-1};
+  uint8_t *map_{nullptr};
+  size_t capacity_{0};
+  size_t used_{0};
+  uint64_t entries_{0};
+  bool failed_{false};
+};
+
+/**
+ * @brief Sequential reader of a LinkRecorder file.
+ *
+ * The file is mapped read-only and entries are handed out in place, nothing
+ * is copied. A file cut short by a crash is read up to its last committed
+ * entry.
+ */
+class LinkReplayer {
+public:
+  LinkReplayer() = default;
+  ~LinkReplayer() { Close(); }
+
+  LinkReplayer(const LinkReplayer &) = delete;
+  LinkReplayer &operator=(const LinkReplayer &) = delete;
+
+  //! Map @p path and check its header, false (with a message on stderr) on failure
+  bool Open(const std::string &path);
+  void Close();
+
+  /**
+   * @brief The next entry without consuming it.
+   * @param[out] frame points into the mapping, valid until Close()
+   * @return false at the end of the recording
+   */
+  bool Peek(LinkRecordEntry *entry, const uint8_t **frame) const;
+  void Advance();
+
+  //! True once no complete entry is left
+  bool AtEnd() const;
+  uint64_t Consumed() const { return consumed_; }
+  const std::string &Path() const { return path_; }
+
+private:
+  std::string path_;
+  const uint8_t *map_{nullptr};
+  size_t map_size_{0};
+  size_t offset_{0};
+  size_t end_{0};
+  uint64_t consumed_{0};
+};
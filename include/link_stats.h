@@ -0,0 +1,150 @@
+/**
+ * @brief Link-health counters and rate-limited logging for the I/O threads
+ * @file link_stats.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <development/mavlink.h>
+
+/**
+ * @brief Lets one message through per interval and counts the rest, so an
+ * error that repeats on every frame costs a counter increment instead of
+ * synchronous console output on an I/O thread.
+ *
+ *   uint64_t suppressed;
+ *   if (log.Allow(&suppressed)) {
+ *     std::cerr << "..." << RateLimitedLog::Suppressed(suppressed) << std::endl;
+ *   }
+ */
+class RateLimitedLog {
+public:
+  static constexpr std::chrono::seconds kDefaultInterval{1};
+
+  explicit RateLimitedLog(std::chrono::steady_clock::duration interval = kDefaultInterval) :
+    interval_(interval.count())
+  {
+  }
+
+  //! True when a message may be written, @p suppressed is the number swallowed since the last one
+  bool Allow(uint64_t *suppressed) {
+    const int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+    int64_t next = next_.load(std::memory_order_relaxed);
+    if (now < next || !next_.compare_exchange_strong(next, now + interval_, std::memory_order_relaxed)) {
+      suppressed_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    *suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  //! Suffix for a message, empty when nothing was suppressed
+  static std::string Suppressed(uint64_t suppressed) {
+    return suppressed ? " (" + std::to_string(suppressed) + " more suppressed)" : std::string();
+  }
+
+private:
+  const int64_t interval_;  ///< steady_clock ticks
+  std::atomic<int64_t> next_{0};
+  std::atomic<uint64_t> suppressed_{0};
+};
+
+/**
+ * @brief Per-link traffic and error counters.
+ *
+ * Every counter is a relaxed atomic bumped by whichever thread sees the
+ * event, and read at any time for publishing. Message ids below
+ * kTrackedMsgIds get their own counters, all others share the last slot.
+ */
+class LinkStats {
+public:
+  static constexpr uint32_t kTrackedMsgIds = 256;
+  static constexpr uint32_t kOtherMsgIds = kTrackedMsgIds;  ///< slot of all msgids >= kTrackedMsgIds
+
+  struct Counters {
+    std::atomic<uint64_t> msgs{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> drops{0};
+  };
+
+  static uint32_t Slot(uint32_t msgid) { return msgid < kTrackedMsgIds ? msgid : kOtherMsgIds; }
+
+  //! Message id of a serialized frame, kOtherMsgIds if it has no complete header
+  static uint32_t FrameMsgId(const uint8_t *frame, size_t len) {
+    if (len >= MAVLINK_NUM_HEADER_BYTES && frame[0] == MAVLINK_STX) {
+      return frame[7] | (frame[8] << 8) | (frame[9] << 16);
+    }
+    if (len >= 6 && frame[0] == MAVLINK_STX_MAVLINK1) {
+      return frame[5];
+    }
+    return kOtherMsgIds;
+  }
+
+  //! Length of @p msg on the wire
+  static size_t FrameLen(const mavlink_message_t *msg) {
+    const bool v2 = (msg->magic == MAVLINK_STX);
+    return (v2 ? MAVLINK_NUM_HEADER_BYTES : MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1) + msg->len +
+           MAVLINK_NUM_CHECKSUM_BYTES +
+           ((v2 && (msg->incompat_flags & MAVLINK_IFLAG_SIGNED)) ? MAVLINK_SIGNATURE_BLOCK_LEN : 0);
+  }
+
+  void Received(uint32_t msgid, size_t bytes) { Add(&rx_[Slot(msgid)], bytes); }
+  void ReceiveDropped(uint32_t msgid) { rx_[Slot(msgid)].drops.fetch_add(1, std::memory_order_relaxed); }
+  void Sent(uint32_t msgid, size_t bytes) { Add(&tx_[Slot(msgid)], bytes); }
+  void SendDropped(uint32_t msgid) { tx_[Slot(msgid)].drops.fetch_add(1, std::memory_order_relaxed); }
+
+  void ParseErrors(uint64_t count) { parse_errors_.fetch_add(count, std::memory_order_relaxed); }
+  void CrcFailures(uint64_t count) { crc_failures_.fetch_add(count, std::memory_order_relaxed); }
+  void ReceiveErrors() { rx_errors_.fetch_add(1, std::memory_order_relaxed); }
+  void SendErrors() { tx_errors_.fetch_add(1, std::memory_order_relaxed); }
+  void Disconnected() { disconnects_.fetch_add(1, std::memory_order_relaxed); }
+
+  //! Track the high-water mark of the receive queue
+  void ReceiveQueueDepth(size_t depth) {
+    size_t high = rx_high_water_.load(std::memory_order_relaxed);
+    while (depth > high && !rx_high_water_.compare_exchange_weak(high, depth, std::memory_order_relaxed)) {
+    }
+  }
+
+  const Counters &Rx(uint32_t slot) const { return rx_[slot]; }
+  const Counters &Tx(uint32_t slot) const { return tx_[slot]; }
+  uint64_t GetParseErrors() const { return parse_errors_.load(std::memory_order_relaxed); }
+  uint64_t GetCrcFailures() const { return crc_failures_.load(std::memory_order_relaxed); }
+  uint64_t GetReceiveErrors() const { return rx_errors_.load(std::memory_order_relaxed); }
+  uint64_t GetSendErrors() const { return tx_errors_.load(std::memory_order_relaxed); }
+  uint64_t GetDisconnects() const { return disconnects_.load(std::memory_order_relaxed); }
+  size_t GetReceiveHighWater() const { return rx_high_water_.load(std::memory_order_relaxed); }
+
+private:
+  static void Add(Counters *counters, size_t bytes) {
+    counters->msgs.fetch_add(1, std::memory_order_relaxed);
+    counters->bytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  Counters rx_[kTrackedMsgIds + 1];
+  Counters tx_[kTrackedMsgIds + 1];
+  std::atomic<uint64_t> parse_errors_{0};  ///< frames rejected by the parser, CRC failures included
+  std::atomic<uint64_t> crc_failures_{0};
+  std::atomic<uint64_t> rx_errors_{0};     ///< failed recv calls
+  std::atomic<uint64_t> tx_errors_{0};     ///< failed send calls
+  std::atomic<uint64_t> disconnects_{0};
+  std::atomic<size_t> rx_high_water_{0};
+};
@@ -0,0 +1,133 @@
+/**
+ * @brief Waits for the actuator controls of all vehicles of a world at once
+ * @file lockstep_barrier.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Per-vehicle lag behind the start of the shared lockstep wait
+ */
+struct LockstepLagStats {
+  uint64_t steps{0};
+  uint64_t timeouts{0};
+  uint64_t slowest{0};     ///< steps in which this vehicle answered last
+  double last_lag{0.0};    ///< [s]
+  double total_lag{0.0};   ///< [s]
+  double max_lag{0.0};     ///< [s]
+};
+
+//! Where a barrier member stands in the current step
+enum class LockstepMemberState {
+  idle,     ///< no HIL_SENSOR awaiting an answer (not due this step, not connected, ...), not waited for
+  pending,  ///< waiting for the answer to its HIL_SENSOR
+  ready,    ///< answer queued, or the link went away
+};
+
+/**
+ * @brief Process-wide lockstep barrier shared by all vehicles in lockstep.
+ *
+ * Every plugin instance sends its HIL_SENSOR during its own PreUpdate(),
+ * so by the next step all PX4 instances are working in parallel. The first
+ * instance to arrive in a step waits for the actuator controls of all
+ * members under one deadline; the others find theirs already queued. A
+ * world step then takes as long as the slowest PX4 rather than the sum of
+ * all of them, and N unresponsive vehicles cost one timeout, not N.
+ * Members without an unanswered HIL_SENSOR, e.g. because their IMU was not
+ * due, are left out of the step and its statistics.
+ *
+ * Arrive() is called from the simulation thread only and waits on a
+ * snapshot of the members, so Join(), Leave() and Stats() never block on a
+ * wait in progress. Notify() may be called from any thread.
+ */
+class LockstepBarrier {
+public:
+  //! State of a member, called from the simulation thread only
+  using StateFn = std::function<LockstepMemberState()>;
+
+  //! Shared instance, created on first use and destroyed with the last reference
+  static std::shared_ptr<LockstepBarrier> Acquire();
+
+  LockstepBarrier(const LockstepBarrier &) = delete;
+  LockstepBarrier &operator=(const LockstepBarrier &) = delete;
+
+  /**
+   * @brief Add a vehicle. @p timeout of zero waits forever, the barrier
+   * uses the longest timeout of its members.
+   * @return member id, never 0
+   */
+  uint64_t Join(const std::string &name, StateFn state, std::chrono::microseconds timeout);
+
+  //! Remove a member and print its lag statistics, its StateFn is not called after this returns
+  void Leave(uint64_t id);
+
+  /**
+   * @brief Wait for all members, once per step. @p step identifies the
+   * step (the sim time), later calls with the same value return at once.
+   * @return deadline of the shared wait, for the caller's own wait
+   */
+  std::chrono::steady_clock::time_point Arrive(uint64_t step);
+
+  //! Wake up a wait in progress, e.g. when a member received actuator controls
+  void Notify();
+
+  //! Lag statistics of member @p id, empty for unknown ids
+  LockstepLagStats Stats(uint64_t id);
+
+private:
+  struct Member {
+    uint64_t id;
+    std::string name;
+    std::chrono::microseconds timeout;
+    LockstepLagStats stats;     ///< guarded by members_mtx_
+
+    std::mutex state_mtx;       ///< held around state(), so that Leave() can reset it
+    StateFn state;
+
+    //! idle once the member has left
+    LockstepMemberState State();
+  };
+
+  LockstepBarrier() = default;
+
+  std::mutex members_mtx_;   ///< held by Join(), Leave(), Stats() and briefly by Arrive()
+  std::vector<std::shared_ptr<Member>> members_;
+  uint64_t next_id_{1};
+
+  // Arrive() only
+  bool stepped_{false};
+  uint64_t step_{0};
+  std::chrono::steady_clock::time_point deadline_;
+  std::vector<std::shared_ptr<Member>> step_members_;  ///< snapshot waited on, kept to reuse its storage
+  std::vector<double> step_lag_;
+
+  std::mutex wait_mtx_;
+  std::condition_variable wait_cv_;
+  std::atomic<bool> waiting_{false};
+
+  static std::mutex instance_mtx_;
+  static std::weak_ptr<LockstepBarrier> instance_;
+};
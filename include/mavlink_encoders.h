@@ -0,0 +1,143 @@
+/**
+ * @brief Compile-time specialized MAVLink encoders for the messages the simulator sends
+ * @file mavlink_encoders.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <development/mavlink.h>
+
+//! System and component id of every frame the simulator sends
+static constexpr uint8_t kSimSystemId = 254;
+static constexpr uint8_t kSimComponentId = 25;
+
+/**
+ * @brief Payload type and the constants mavlink_finalize_message_buffer()
+ * would otherwise look up at run time, one specialization per message id.
+ */
+template <uint32_t MsgId>
+struct MavlinkMessageTraits;
+
+#define MAVLINK_MESSAGE_TRAITS(NAME, name)                                                  \
+  template <>                                                                               \
+  struct MavlinkMessageTraits<MAVLINK_MSG_ID_##NAME> {                                      \
+    using Payload = mavlink_##name##_t;                                                     \
+    static constexpr uint8_t kMinLen = MAVLINK_MSG_ID_##NAME##_MIN_LEN;                     \
+    static constexpr uint8_t kLen = MAVLINK_MSG_ID_##NAME##_LEN;                            \
+    static constexpr uint8_t kCrcExtra = MAVLINK_MSG_ID_##NAME##_CRC;                       \
+    static_assert(sizeof(Payload) == kLen, "payload struct does not match the wire length"); \
+  }
+
+MAVLINK_MESSAGE_TRAITS(HIL_SENSOR, hil_sensor);
+MAVLINK_MESSAGE_TRAITS(HIL_GPS, hil_gps);
+MAVLINK_MESSAGE_TRAITS(HIL_STATE_QUATERNION, hil_state_quaternion);
+MAVLINK_MESSAGE_TRAITS(HIL_ACTUATOR_CONTROLS, hil_actuator_controls);
+
+#undef MAVLINK_MESSAGE_TRAITS
+
+/**
+ * @brief Writes complete, unsigned MAVLink frames straight into a caller's
+ * buffer: header, (trimmed) payload and checksum in one pass, with no
+ * mavlink_message_t in between.
+ *
+ * The sequence number is per encoder and atomic, so Encode() may be called
+ * from several threads without a lock.
+ */
+class MavlinkEncoder {
+public:
+  //! Longest frame Encode<MsgId>() writes
+  template <uint32_t MsgId>
+  static constexpr size_t kMaxFrameLen =
+    MAVLINK_NUM_HEADER_BYTES + MavlinkMessageTraits<MsgId>::kLen + MAVLINK_NUM_CHECKSUM_BYTES;
+
+  explicit MavlinkEncoder(uint8_t system_id = kSimSystemId, uint8_t component_id = kSimComponentId) :
+    system_id_(system_id),
+    component_id_(component_id)
+  {
+  }
+
+  //! Restart at sequence 0, with MAVLink 1 or 2 framing
+  void Reset(bool mavlink1) {
+    mavlink1_ = mavlink1;
+    seq_.store(0, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Encode @p payload into @p buf, which holds at least kMaxFrameLen<MsgId> bytes.
+   * @param[out] seq sequence number of the frame, if not null
+   * @return frame length
+   */
+  template <uint32_t MsgId>
+  size_t Encode(const typename MavlinkMessageTraits<MsgId>::Payload &payload, uint8_t *buf,
+                uint8_t *seq = nullptr) {
+    using Traits = MavlinkMessageTraits<MsgId>;
+    const uint8_t seqno = seq_.fetch_add(1, std::memory_order_relaxed);
+    if (seq) {
+      *seq = seqno;
+    }
+
+    size_t header_len;
+    uint8_t len;
+    if (mavlink1_ && MsgId <= 0xff) {
+      // No extension fields in MAVLink 1
+      header_len = MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1;
+      len = Traits::kMinLen;
+      buf[0] = MAVLINK_STX_MAVLINK1;
+      buf[1] = len;
+      buf[2] = seqno;
+      buf[3] = system_id_;
+      buf[4] = component_id_;
+      buf[5] = static_cast<uint8_t>(MsgId);
+      memcpy(buf + header_len, &payload, len);
+    } else {
+      header_len = MAVLINK_NUM_HEADER_BYTES;
+      memcpy(buf + header_len, &payload, Traits::kLen);
+      // Trailing zero bytes are not sent, as in mavlink_finalize_message_buffer()
+      len = Traits::kLen;
+      while (len > 1 && buf[header_len + len - 1] == 0) {
+        len--;
+      }
+      buf[0] = MAVLINK_STX;
+      buf[1] = len;
+      buf[2] = 0;  // incompat_flags, never signed
+      buf[3] = 0;  // compat_flags
+      buf[4] = seqno;
+      buf[5] = system_id_;
+      buf[6] = component_id_;
+      buf[7] = static_cast<uint8_t>(MsgId & 0xff);
+      buf[8] = static_cast<uint8_t>((MsgId >> 8) & 0xff);
+      buf[9] = static_cast<uint8_t>((MsgId >> 16) & 0xff);
+    }
+
+    uint16_t crc;
+    crc_init(&crc);
+    crc_accumulate_buffer(&crc, reinterpret_cast<const char *>(buf + 1), header_len - 1 + len);
+    crc_accumulate(Traits::kCrcExtra, &crc);
+    buf[header_len + len] = static_cast<uint8_t>(crc & 0xff);
+    buf[header_len + len + 1] = static_cast<uint8_t>(crc >> 8);
+    return header_len + len + MAVLINK_NUM_CHECKSUM_BYTES;
+  }
+
+private:
+  const uint8_t system_id_;
+  const uint8_t component_id_;
+  bool mavlink1_{false};
+  std::atomic<uint8_t> seq_{0};
+};
@@ -0,0 +1,153 @@
+/**
+ * @brief Whole-frame MAVLink scanner for datagram transports
+ * @file mavlink_frame_scanner.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <development/mavlink.h>
+
+static constexpr size_t kMavlinkV1HeaderLen = MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1;
+
+//! Default ScanMavlinkFrame() filter, decodes every message id
+struct AcceptAllMessages {
+  bool operator()(uint32_t) const { return true; }
+};
+
+/**
+ * @brief Find and decode the next complete frame in [@p data, @p end).
+ *
+ * Instead of running mavlink_frame_char_buffer() on every byte, this jumps to
+ * the next start-of-frame marker, takes the frame length from the header and
+ * checksums the whole frame in one pass. A frame must be fully contained in
+ * the buffer, which holds for UDP datagrams but not for stream transports.
+ * Candidates with a bad checksum, truncated length or unknown msgid count as
+ * parse errors in @p status and scanning resumes one byte after their marker.
+ *
+ * Frames whose msgid @p accept rejects are checksummed and skipped without
+ * copying their payload into @p msg; the checksum keeps a corrupt length
+ * from swallowing the frames behind it.
+ *
+ * @param[out] msg decoded frame, only written when @p framing is ok
+ * @param[out] framing MAVLINK_FRAMING_OK if a frame was decoded,
+ *   MAVLINK_FRAMING_INCOMPLETE if the buffer holds no further frame
+ * @return position right after the decoded frame, or @p end
+ */
+template <typename Accept = AcceptAllMessages>
+inline const uint8_t *ScanMavlinkFrame(const uint8_t *data, const uint8_t *end,
+    mavlink_message_t *msg, mavlink_status_t *status, uint8_t *framing, Accept accept = Accept())
+{
+  *framing = MAVLINK_FRAMING_INCOMPLETE;
+
+  for (const uint8_t *p = data; p < end; p++) {
+    const uint8_t magic = *p;
+    if (magic != MAVLINK_STX && magic != MAVLINK_STX_MAVLINK1) {
+      continue;
+    }
+
+    const bool v2 = (magic == MAVLINK_STX);
+    const size_t header_len = v2 ? MAVLINK_NUM_HEADER_BYTES : kMavlinkV1HeaderLen;
+    const size_t avail = end - p;
+    if (avail < header_len + MAVLINK_NUM_CHECKSUM_BYTES) {
+      break;
+    }
+
+    const uint8_t len = p[1];
+    uint8_t incompat_flags = 0;
+    uint8_t compat_flags = 0;
+    uint8_t seq, sysid, compid;
+    uint32_t msgid;
+    if (v2) {
+      incompat_flags = p[2];
+      compat_flags = p[3];
+      seq = p[4];
+      sysid = p[5];
+      compid = p[6];
+      msgid = p[7] | (p[8] << 8) | (p[9] << 16);
+      if (incompat_flags & ~MAVLINK_IFLAG_SIGNED) {
+        _mav_parse_error(status);
+        continue;
+      }
+    } else {
+      seq = p[2];
+      sysid = p[3];
+      compid = p[4];
+      msgid = p[5];
+    }
+
+    const size_t signature_len = (incompat_flags & MAVLINK_IFLAG_SIGNED) ? MAVLINK_SIGNATURE_BLOCK_LEN : 0;
+    const size_t frame_len = header_len + len + MAVLINK_NUM_CHECKSUM_BYTES + signature_len;
+    const mavlink_msg_entry_t *entry = mavlink_get_msg_entry(msgid);
+    if (avail < frame_len || entry == nullptr) {
+      _mav_parse_error(status);
+      continue;
+    }
+
+    uint16_t checksum = crc_calculate(p + 1, header_len - 1);
+    crc_accumulate_buffer(&checksum, reinterpret_cast<const char *>(p + header_len), len);
+    crc_accumulate(entry->crc_extra, &checksum);
+    const uint8_t *ck = p + header_len + len;
+    if (ck[0] != (checksum & 0xFF) || ck[1] != (checksum >> 8)) {
+      status->packet_rx_drop_count++;
+      _mav_parse_error(status);
+      continue;
+    }
+
+    if (!accept(msgid)) {
+      status->current_rx_seq = seq;
+      status->packet_rx_success_count++;
+      p += frame_len - 1;
+      continue;
+    }
+
+    msg->magic = magic;
+    msg->len = len;
+    msg->incompat_flags = incompat_flags;
+    msg->compat_flags = compat_flags;
+    msg->seq = seq;
+    msg->sysid = sysid;
+    msg->compid = compid;
+    msg->msgid = msgid;
+    msg->checksum = checksum;
+    msg->ck[0] = ck[0];
+    msg->ck[1] = ck[1];
+    char *payload = _MAV_PAYLOAD_NON_CONST(msg);
+    memcpy(payload, p + header_len, len);
+    // zero-fill trimmed payloads, same as the mavlink parser does
+    if (len < entry->max_msg_len) {
+      memset(payload + len, 0, entry->max_msg_len - len);
+    }
+    if (signature_len) {
+      memcpy(msg->signature, ck + MAVLINK_NUM_CHECKSUM_BYTES, MAVLINK_SIGNATURE_BLOCK_LEN);
+    }
+
+    if (v2) {
+      status->flags &= ~MAVLINK_STATUS_FLAG_IN_MAVLINK1;
+    } else {
+      status->flags |= MAVLINK_STATUS_FLAG_IN_MAVLINK1;
+    }
+    status->current_rx_seq = seq;
+    status->packet_rx_success_count++;
+    status->msg_received = MAVLINK_FRAMING_OK;
+
+    *framing = MAVLINK_FRAMING_OK;
+    return p + frame_len;
+  }
+
+  return end;
+}
@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <queue>
 #include <regex>
@@ -28,6 +29,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <deque>
+#include <functional>
 #include <atomic>
 #include <chrono>
 #include <memory>
@@ -47,6 +49,7 @@
 #include <cstdlib>
 #include <string>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include <Eigen/Eigen>
@@ -54,13 +57,39 @@
 
 #include <development/mavlink.h>
 #include "msgbuffer.h"
+#include "io_reactor.h"
+#include "latency_tracer.h"
+#include "link_recorder.h"
+#include "link_stats.h"
+#include "lockstep_barrier.h"
+#include "mavlink_encoders.h"
+#include "mavlink_frame_scanner.h"
+#include "send_scheduler.h"
+#include "seqlock.h"
+#include "sensor_scheduler.h"
+#include "shm_link.h"
+#include "spin_pause.h"
+#include "spsc_ring.h"
+#include "thread_placement.h"
 
 static const uint32_t kDefaultMavlinkUdpRemotePort = 14560;
 static const uint32_t kDefaultMavlinkUdpLocalPort = 0;
 static const uint32_t kDefaultMavlinkTcpPort = 4560;
 
-static const size_t kMaxRecvBufferSize = 30;
-static const size_t kMaxSendBufferSize = 30;
+static const size_t kDefaultRecvBufferSize = 32;
+
+//! Receive wait of the shared-memory link, bounds the close() latency
+static constexpr std::chrono::milliseconds kShmReceiveTimeout{100};
+
+//! Lockstep waits for PX4 without a timeout unless lockstep_timeout_ms sets one
+static constexpr std::chrono::milliseconds kDefaultLockstepTimeout{0};
+
+//! SO_BUSY_POLL of the busy-polled receiver, how long the kernel polls the NIC queue per read
+static constexpr std::chrono::microseconds kDefaultBusyPoll{50};
+
+//! TCP client reconnect backoff, doubled after every failed attempt
+static constexpr std::chrono::milliseconds kConnectRetryMin{10};
+static constexpr std::chrono::milliseconds kConnectRetryMax{200};
 
 using lock_guard = std::lock_guard<std::recursive_mutex>;
 static constexpr auto kDefaultDevice = "/dev/ttyACM0";
@@ -110,6 +139,28 @@ namespace SensorData {
     };
 }
 
+//! Latest HIL_ACTUATOR_CONTROLS, fixed size so that publishing one never allocates
+struct ActuatorFrame {
+    static constexpr unsigned kOutputs = 16;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Eigen::Matrix<double, kOutputs, 1> controls{Eigen::Matrix<double, kOutputs, 1>::Zero()};
+    uint64_t time_usec{0};
+    uint16_t motor_flags{0};  ///< bit i set: output i drives a motor
+    bool armed{false};
+    bool valid{false};        ///< false until the first frame from PX4
+
+    bool IsMotor(unsigned index) const { return motor_flags & (1u << index); }
+};
+
+//! Time ReadMAVLinkMessages() spent waiting for PX4 in lockstep
+struct LockstepWaitStats {
+    uint64_t steps{0};
+    uint64_t timeouts{0};
+    double last_wait{0.0};  ///< [s] wait of the most recent step
+    double total_wait{0.0}; ///< [s]
+    double max_wait{0.0};   ///< [s]
+};
+
 /*
 struct HILData {
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -134,28 +185,61 @@ public:
     MavlinkInterface();
     ~MavlinkInterface();
     void ReadMAVLinkMessages();
-    std::shared_ptr<mavlink_message_t> PopRecvMessage();
-    void PushSendMessage(std::shared_ptr<mavlink_message_t> msg);
-    void PushSendMessage(mavlink_message_t* msg);
+    mavlink_message_t *PeekRecvMessage() {return receiver_buffer_.Front();}
+    void PopRecvMessage() {receiver_buffer_.Pop();}
+    /**
+     * @brief Encode @p payload with this link's sequence number and protocol
+     * version straight into wire bytes and queue them. Thread safe.
+     * @return sequence number of the queued frame
+     */
+    template <uint32_t MsgId>
+    uint8_t PushSendMessage(const typename MavlinkMessageTraits<MsgId>::Payload &payload) {
+      uint8_t frame[MavlinkEncoder::kMaxFrameLen<MsgId>];
+      uint8_t seq;
+      const size_t len = encoder_.Encode<MsgId>(payload, frame, &seq);
+      PushSendFrame(MsgId, frame, len);
+      return seq;
+    }
+    //! Queue an already serialized frame of type @p msgid
+    void PushSendFrame(uint32_t msgid, const uint8_t *frame, size_t len);
+    void FlushSendMessages();
     void send_mavlink_message(const mavlink_message_t *message);
+    //! Frames are dropped while a reactor send waits for room, they must not cut into its frames
+    void send_mavlink_buffers(MsgBuffer *buffers, size_t count);
+    std::vector<SendScheduler::LaneStats> GetSendLaneStats();
     void forward_mavlink_message(const mavlink_message_t *message);
     void open();
     void close();
     void Load();
-    void SendSensorMessages(const uint64_t time_usec);
+    /**
+     * @brief Send HIL_SENSOR with IMU data and those of the baro, mag and
+     * airspeed that are both in @p due_mask and updated since they were last sent.
+     * @return SensorBit()s of the sensors included
+     */
+    uint32_t SendSensorMessages(const uint64_t time_usec, uint32_t due_mask = kAllSensors);
     void UpdateBarometer(const SensorData::Barometer &data);
     void UpdateAirspeed(const SensorData::Airspeed &data);
     void UpdateIMU(const SensorData::Imu &data);
     void UpdateMag(const SensorData::Magnetometer &data);
-    Eigen::VectorXd GetActuatorControls();
-    bool IsInputMotorAtIndex(int index);
-    bool GetArmedState();
+    /**
+     * @brief Latest actuator frame, without a lock or a copy. The reference
+     * stays valid until the next ReadMAVLinkMessages(), which is the only
+     * place frames are published; read it from the thread calling that.
+     */
+    const ActuatorFrame &GetActuatorFrame() const {
+        return actuator_frames_[actuator_index_.load(std::memory_order_acquire)];
+    }
+    bool IsInputMotorAtIndex(int index) const { return GetActuatorFrame().IsMotor(index); }
+    bool GetArmedState() const { return GetActuatorFrame().armed; }
     void onSigInt();
-    uint16_t FinalizeOutgoingMessage(mavlink_message_t* msg, uint8_t system_id, uint8_t component_id,
-        uint8_t min_length, uint8_t length, uint8_t crc_extra);
     bool GetReceivedFirstActuator() {return received_first_actuator_;}
     void SetBaudrate(int baudrate) {baudrate_ = baudrate;}
     void SetUseTcp(bool use_tcp) {use_tcp_ = use_tcp;}
+    void SetUseSerial(bool use_serial) {use_serial_ = use_serial;}
+    //! Talk to a PX4 on the same host through /dev/shm instead of UDP/TCP
+    void SetUseShm(bool use_shm) {use_shm_ = use_shm;}
+    //! Name of the file in /dev/shm, px4_mavlink_<mavlink_tcp_port> if empty
+    void SetShmName(const std::string &name) {shm_name_ = name;}
     void SetUseTcpClientMode(bool tcp_client_mode) {tcp_client_mode_ = tcp_client_mode;}
     void SetDevice(std::string device) {device_ = device;}
     void SetEnableLockstep(bool enable_lockstep) {enable_lockstep_ = enable_lockstep;}
@@ -163,38 +247,178 @@ public:
     void SetMavlinkTcpPort(int mavlink_tcp_port) {mavlink_tcp_port_ = mavlink_tcp_port;}
     void SetMavlinkUdpRemotePort(int mavlink_udp_port) {mavlink_udp_remote_port_ = mavlink_udp_port;}
     void SetMavlinkUdpLocalPort(int mavlink_udp_port) {mavlink_udp_local_port_ = mavlink_udp_port;}
-    bool IsRecvBuffEmpty() {return receiver_buffer_.empty();}
+    void SetRecvBufferSize(size_t recv_buffer_size) {recv_buffer_size_ = recv_buffer_size;}
+    void SetBatchedReceive(bool batched_receive) {batched_receive_ = batched_receive;}
+    /**
+     * @brief Spin on a non-blocking socket in the receiver thread instead of
+     * sleeping in recv, with SO_BUSY_POLL of @p busy_poll where the kernel
+     * has it. Costs a whole core, pin the receiver with SetReceiverPlacement().
+     */
+    void SetBusyPoll(bool enable, std::chrono::microseconds busy_poll = kDefaultBusyPoll) {
+      busy_poll_ = enable;
+      busy_poll_us_ = busy_poll;
+    }
+    //! SO_RCVBUF/SO_SNDBUF in bytes of the UDP socket and TCP connections, 0 keeps the kernel default
+    void SetSocketBuffers(int rcvbuf, int sndbuf) {socket_rcvbuf_ = rcvbuf; socket_sndbuf_ = sndbuf;}
+    //! Stamp received data with the kernel receive time (SO_TIMESTAMPING) for latency tracing
+    void SetKernelTimestamps(bool kernel_timestamps) {kernel_timestamps_ = kernel_timestamps;}
+    void SetLockstepTimeout(std::chrono::microseconds timeout) {lockstep_timeout_ = timeout;}
+    void SetLockstepSpin(std::chrono::microseconds spin) {lockstep_spin_ = spin;}
+    //! Wait for PX4 together with the other vehicles in lockstep, reported as @p name
+    void SetLockstepBarrier(bool enable, const std::string &name) {use_lockstep_barrier_ = enable; lockstep_barrier_name_ = name;}
+    void SetIoThreads(size_t io_threads) {io_threads_ = io_threads;}
+    //! CPU affinity and SCHED_FIFO priority of the receiver (also serial and shared memory) thread
+    void SetReceiverPlacement(const ThreadPlacement &placement) {receiver_placement_ = placement;}
+    void SetSenderPlacement(const ThreadPlacement &placement) {sender_placement_ = placement;}
+    //! Placement of the shared reactor threads, fixed by the first link that starts the reactor
+    void SetReactorPlacement(const ThreadPlacement &placement) {reactor_placement_ = placement;}
+    //! mlockall() the process on Load()
+    void SetLockMemory(bool lock_memory) {lock_memory_ = lock_memory;}
+    void SetProtocolVersion(int version) {use_mavlink1_ = (version == 1);}
+    void SetLatencyTracing(bool latency_tracing) {latency_tracing_ = latency_tracing;}
+    //! Append every sent and received frame to @p path, empty disables recording
+    void SetRecordFile(const std::string &path) {record_file_ = path;}
+    //! Feed the frames received in a recording instead of connecting to PX4
+    void SetReplayFile(const std::string &path) {replay_file_ = path;}
+    //! Simulation time of the current step, stamps the recorded frames
+    void SetSimTime(uint64_t time_usec) {sim_time_usec_.store(time_usec, std::memory_order_relaxed);}
+    //! nullptr unless latency tracing is enabled, valid after Load()
+    const LatencyTracer *GetLatencyTracer() const {return latency_tracer_.get();}
+    LatencyTracer *GetLatencyTracer() {return latency_tracer_.get();}
+    const LockstepWaitStats &GetLockstepWaitStats() const {return lockstep_wait_stats_;}
+    //! Lag behind the other vehicles, empty without the lockstep barrier
+    LockstepLagStats GetLockstepLagStats() const {
+      return lockstep_barrier_ ? lockstep_barrier_->Stats(lockstep_barrier_id_) : LockstepLagStats{};
+    }
+    bool IsRecvBuffEmpty() {return receiver_buffer_.Empty();}
 
     bool ReceivedHeartbeats() const { return received_heartbeats_; }
 
+    using MessageHandler = std::function<void(const mavlink_message_t *msg)>;
+
+    /**
+     * @brief Call @p handler on the simulation thread for every received
+     * @p msgid, replacing the handler registered for it so far. Must be
+     * called before Load(). Messages without a handler are dropped by the
+     * receiver as soon as their header is decoded, they never take a slot
+     * in the receive buffer.
+     */
+    void RegisterMessageHandler(uint32_t msgid, MessageHandler handler);
+    bool HasMessageHandler(uint32_t msgid) const {
+      return msgid < message_handlers_.size() && message_handlers_[msgid];
+    }
+    //! Received frames dropped for having no handler
+    uint64_t GetRecvFiltered() const { return recv_filtered_.load(std::memory_order_relaxed); }
+    //! Traffic and error counters, updated by the I/O threads as they go
+    const LinkStats &GetLinkStats() const { return link_stats_; }
+    uint32_t GetConnections() const { return connections_.load(std::memory_order_relaxed); }
+
 private:
     bool received_actuator_{false};
     bool received_first_actuator_{false};
-    bool armed_;
     bool messages_handled_{false};
-    Eigen::VectorXd input_reference_;
 
+    // Front/back actuator frames; handle_actuator_controls() fills the back
+    // one and flips the index, so readers never see a frame in progress
+    ActuatorFrame actuator_frames_[2];
+    std::atomic<unsigned> actuator_index_{0};
+
+    //! See LockstepBarrier::StateFn
+    LockstepMemberState LockstepState() const;
     void handle_message(mavlink_message_t *msg);
-    void handle_heartbeat(mavlink_message_t *msg);
-    void handle_actuator_controls(mavlink_message_t *msg);
-    void acceptConnections();
+    void handle_heartbeat(const mavlink_message_t *msg);
+    void handle_actuator_controls(const mavlink_message_t *msg);
+    void acceptConnections(const char *thrd_name);
     void RegisterNewHILSensorInstance(int id);
-    bool tryConnect();
+
+    // TCP connection state machine, see AdvanceConnection()
+    int CreateTcpSocket();
+    int AdvanceConnection(short *events, const char *thrd_name);
+    void SetConnection(int fd, const char *thrd_name);
+    void DropConnection(const char *thrd_name);
+    void ConnectionLost();
+    void WaitForConnection(const char *thrd_name);
 
     // UDP/TCP send/receive thread workers
     void ReceiveWorker();
     void SendWorker();
 
-    static const unsigned n_out_max = 16;
-
-    bool input_is_motor_[n_out_max];
-
-    struct sockaddr_in local_simulator_addr_;
+    // Receive path helpers, called from the receiver thread only
+    bool ReceiveOnce(const char *thrd_name);
+    void ConfigureSocket(int fd);
+    //! Arrival of the data received with @p hdr on the LatencyTracer clock, @p now without a kernel stamp
+    int64_t KernelRxStamp(struct msghdr *hdr, int64_t now) const;
+    int ReceiveDatagramBatch(const char *thrd_name);
+    void ParseBytes(const uint8_t *data, size_t len, const char *thrd_name);
+    void ParseDatagram(const uint8_t *data, size_t len, const char *thrd_name);
+    mavlink_message_t *CommitRecvSlot(mavlink_message_t *slot, const mavlink_message_t *message,
+        const char *thrd_name);
+    void NotifyRecvWaiter();
+    //! Move the error counts ScanMavlinkFrame() left in m_status_ into link_stats_
+    void FoldParseStatus();
+    bool WaitForRecvMessage(std::chrono::steady_clock::time_point deadline);
+
+    size_t DrainSendQueue();
+    void TraceSentBatch(const MsgBuffer *buffers, size_t count, bool sent);
+
+    // Link recording and replay
+    void RecordSent(const MsgBuffer *buffers, size_t count);
+    void RecordReceived(const mavlink_message_t *message, LinkDirection direction);
+    void ReplayRecordedMessages();
+
+    // Shared reactor mode, handlers run on the IoReactor pool
+    void StartReactorIo();
+    void StopReactorIo();
+    void WatchConnection();
+    bool OnConnectionReadable();
+    bool OnConnectTimer();
+    void ArmConnectTimer(std::chrono::nanoseconds delay);
+    bool OnSendWakeup();
+    void WakeReactorSender();
+    //! Keep the unsent frames and resume once the socket has room
+    void DeferSend(const MsgBuffer *buffers, size_t count);
+
+    /**
+     * @brief Write @p buffers to the socket, returns how many went out whole.
+     * Without @p blocked a full socket is polled for room, which only the
+     * dedicated sender thread may do. With it, the write stops there and
+     * sets it, the frame in progress keeps its MsgBuffer::pos.
+     */
+    size_t WriteBuffers(MsgBuffer *buffers, size_t count, bool *blocked);
+
+    // Shared-memory transport, frames are received on receiver_thread_ and
+    // sent straight from FlushSendMessages()
+    void ShmReceiveWorker();
+
+    // Serial transport, all handlers run on io_thread_
+    void ConfigureSerialLowLatency();
+    void do_read();
+    void parse_buffer(const boost::system::error_code& err, std::size_t bytes_t);
+    void do_write();
+
+    // IPv4 or IPv6, following the family of mavlink_addr
+    struct sockaddr_storage local_simulator_addr_;
     socklen_t local_simulator_addr_len_;
-    struct sockaddr_in remote_simulator_addr_;
+    struct sockaddr_storage remote_simulator_addr_;
     socklen_t remote_simulator_addr_len_;
 
     unsigned char buf_[65535];
+
+    // recvmmsg() state for batched UDP receive, slots are carved out of buf_
+    static constexpr unsigned kRecvBatchSize = 16;
+    bool batched_receive_{false};
+    struct mmsghdr recv_msgs_[kRecvBatchSize];
+    struct iovec recv_iovecs_[kRecvBatchSize];
+    struct sockaddr_storage recv_addrs_[kRecvBatchSize];
+
+    // Socket tuning, see SetBusyPoll(), SetSocketBuffers() and SetKernelTimestamps()
+    bool busy_poll_{false};
+    std::chrono::microseconds busy_poll_us_{kDefaultBusyPoll};
+    int socket_rcvbuf_{0};
+    int socket_sndbuf_{0};
+    bool kernel_timestamps_{false};
+    static constexpr size_t kRecvControlLen = 128;  ///< room for a struct scm_timestamping cmsg
+    alignas(struct cmsghdr) uint8_t recv_control_[kRecvBatchSize][kRecvControlLen];
     enum FD_TYPES {
         LISTEN_FD,
         CONNECTION_FD,
@@ -202,10 +426,24 @@ private:
     };
     struct pollfd fds_[N_FDS];
     bool use_tcp_{false};
+    bool use_serial_{false};
+    bool use_shm_{false};
     bool tcp_client_mode_{false};
-    std::atomic<bool> close_conn_{false};
-
-    in_addr_t mavlink_addr_;
+    std::atomic<bool> close_conn_{false};  ///< the link is shut down for good
+
+    // TCP connection, the fd is closed and replaced by the receiving side only.
+    // conn_mtx_ keeps the sender off a descriptor that is being closed.
+    std::mutex conn_mtx_;
+    std::atomic<bool> connected_{false};
+    std::atomic<bool> connection_lost_{false};  ///< set on reset/EOF/EPIPE, cleared by DropConnection()
+    std::atomic<uint32_t> connections_{0};      ///< connections made so far
+    uint32_t connections_seen_{0};              ///< by ReadMAVLinkMessages()
+    int connecting_fd_{-1};                     ///< client socket with a connect() in progress
+    std::chrono::steady_clock::time_point next_connect_time_{};
+    std::chrono::milliseconds connect_retry_{kConnectRetryMin};
+    static constexpr int kConnectPollTimeoutMs = 100;  ///< receiver thread, bounds the close() latency
+
+    int socket_family_{AF_INET};
     std::string mavlink_addr_str_{"INADDR_ANY"};
     int mavlink_udp_remote_port_{kDefaultMavlinkUdpRemotePort}; // MAVLink refers to the PX4 simulator interface here
     int mavlink_udp_local_port_{kDefaultMavlinkUdpLocalPort}; // MAVLink refers to the PX4 simulator interface here
@@ -221,26 +459,32 @@ private:
     mavlink_message_t m_buffer_{};
     std::thread io_thread_;
     std::string device_{kDefaultDevice};
+    boost::asio::io_context io_service_{};
+    boost::asio::serial_port serial_dev_{io_service_};
+    std::vector<boost::asio::const_buffer> tx_serial_buffers_{};  ///< io_thread_ only
+    std::string shm_name_;
+    std::unique_ptr<ShmLink> shm_;
 
     std::recursive_mutex mutex_;
-    std::mutex actuator_mutex_;
-    std::mutex sensor_msg_mutex_;
 
     std::array<uint8_t, MAX_SIZE> rx_buf_{};
     unsigned int baudrate_{kDefaultBaudRate};
-    std::atomic<bool> tx_in_progress_;
-    std::deque<MsgBuffer> tx_q_{};
+    std::atomic<bool> tx_in_progress_{false};
 
-    bool baro_updated_{};
-    bool diff_press_updated_{};
-    bool mag_updated_{};
+    // Slow sensors, published by their transport callbacks. A sample is
+    // new when the slot's version differs from the one last sent.
+    struct MagSample {
+        double x, y, z;
+    };
+    Seqlock<SensorData::Barometer> baro_sample_;
+    Seqlock<SensorData::Airspeed> airspeed_sample_;
+    Seqlock<MagSample> mag_sample_;
+    uint32_t baro_sent_version_{0};
+    uint32_t airspeed_sent_version_{0};
+    uint32_t mag_sent_version_{0};
+
+    // IMU, set on the simulation thread right before sending
     bool imu_updated_{};
-
-    double temperature_{};
-    double pressure_alt_{};
-    double abs_pressure_{};
-    double diff_pressure_{};
-    Eigen::Vector3d mag_b_{};
     Eigen::Vector3d accel_b_{};
     Eigen::Vector3d gyro_b_{};
 
@@ -249,15 +493,88 @@ private:
 
     bool received_heartbeats_ {false};
 
-    std::mutex receiver_buff_mtx_;
-    std::queue<std::shared_ptr<mavlink_message_t>> receiver_buffer_;
+    // Preallocated frames handed from the receiver thread to ReadMAVLinkMessages()
+    size_t recv_buffer_size_{kDefaultRecvBufferSize};
+    SpscRing<mavlink_message_t> receiver_buffer_;
+    mavlink_message_t recv_overflow_msg_{};
+    std::atomic<uint64_t> recv_dropped_{0};
+
+    // Indexed by msgid, fixed once Load() starts the receiver
+    static constexpr uint32_t kMaxHandledMsgId = 1 << 16;
+    std::vector<MessageHandler> message_handlers_;
+    std::atomic<uint64_t> recv_filtered_{0};
+
+    // Link health; errors that can repeat per frame are logged at most once a second
+    LinkStats link_stats_;
+    RateLimitedLog recv_error_log_;
+    RateLimitedLog recv_overflow_log_;
+    RateLimitedLog send_overflow_log_;
+    RateLimitedLog send_error_log_;
+    RateLimitedLog lockstep_timeout_log_;
+
+    // Optional per-stage latency histograms, no timestamps are taken when null
+    bool latency_tracing_{false};
+    std::unique_ptr<LatencyTracer> latency_tracer_;
+    int64_t rx_stamp_ns_{0};  ///< arrival of the data being parsed, receiver side only
+
+    // Optional recording of the link and PX4-free replay of a recording
+    std::string record_file_;
+    std::string replay_file_;
+    std::unique_ptr<LinkRecorder> recorder_;
+    std::unique_ptr<LinkReplayer> replayer_;
+    bool replay_finished_{false};
+    std::atomic<uint64_t> sim_time_usec_{0};
+
+    // Lockstep wait, woken by the receiver thread when a frame is queued
+    std::mutex recv_wait_mtx_;
+    std::condition_variable recv_wait_cv_;
+    std::atomic<bool> recv_waiting_{false};
+    std::chrono::microseconds lockstep_timeout_{kDefaultLockstepTimeout}; ///< zero waits forever
+    std::chrono::microseconds lockstep_spin_{0};
+    LockstepWaitStats lockstep_wait_stats_;
+    std::atomic<uint64_t> actuator_received_{0};  ///< actuator controls queued by the receiver
+    uint64_t actuator_consumed_{0};               ///< and handled by ReadMAVLinkMessages()
+    bool lockstep_armed_{false};                  ///< HIL_SENSOR sent, its lockstep wait still to come
+    bool use_lockstep_barrier_{false};
+    std::string lockstep_barrier_name_;
+    std::shared_ptr<LockstepBarrier> lockstep_barrier_;
+    uint64_t lockstep_barrier_id_{0};
     std::thread receiver_thread_;
 
+    // Serialized outgoing frames, one lane per message type
     std::mutex sender_buff_mtx_;
-    std::queue<std::shared_ptr<mavlink_message_t>> sender_buffer_;
+    SendScheduler send_scheduler_;
+    std::vector<MsgBuffer> tx_batch_{};  ///< drained frames, sender thread only
+    bool tx_flush_requested_{false};
     std::thread sender_thread_;
+
+    // sendmmsg()/sendmsg() state, used under conn_mtx_
+    static constexpr unsigned kSendBatchSize = 64;
+    struct mmsghdr send_msgs_[kSendBatchSize];
+    struct iovec send_iovecs_[kSendBatchSize];
     std::condition_variable sender_cv_;
-    std::mutex mav_status_mutex_;
-    mavlink_status_t sender_m_status_{};
+    MavlinkEncoder encoder_;
+    bool use_mavlink1_{false};
+
+    // Shared reactor instead of the receiver/sender threads when io_threads_ > 0
+    static constexpr unsigned kReactorReadBudget = 16; ///< reads per wake-up before yielding the thread
+    static constexpr int kSendPollTimeoutMs = 100;  ///< wait for room on a non-blocking socket, sender thread only
+    size_t io_threads_{0};
+    ThreadPlacement receiver_placement_;
+    ThreadPlacement sender_placement_;
+    ThreadPlacement reactor_placement_;
+    bool lock_memory_{false};
+    std::shared_ptr<IoReactor> reactor_;
+    int tx_wake_fd_{-1};          ///< eventfd, FlushSendMessages() -> reactor
+    int connect_timer_fd_{-1};    ///< timerfd running the TCP connection state machine
+    std::atomic<uint64_t> rx_reg_{0};  ///< also armed for EPOLLOUT by the send handler
+    uint64_t tx_reg_{0};
+    // Left over by a full socket, send handler only; a TCP frame that was
+    // started has to be finished before any other
+    std::vector<MsgBuffer> tx_backlog_;
+    uint32_t tx_backlog_connection_{0};  ///< connections_ when it was left over
+    std::atomic<bool> tx_blocked_{false};
+    uint64_t connect_reg_{0};     ///< connect_timer_fd_, for as long as the link is up
+    uint64_t pending_reg_{0};     ///< listen socket or connect in progress, connect_reg_ handler only
 
 };
@@ -23,6 +23,8 @@
 #pragma once
 
 #include <cassert>
+#include <cstring>
+#include <sys/types.h>
 #include <development/mavlink.h>
 
 /**
@@ -0,0 +1,63 @@
+/**
+ * @brief Locating one model in the world pose vector
+ * @file pose_lookup.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <gz/msgs/pose_v.pb.h>
+
+/**
+ * @brief Remembers where a model sits in a Pose_V between messages.
+ *
+ * The layout of the world pose vector rarely changes, so the cached slot is
+ * checked first. Poses carry the entity id, so once the slot has been found
+ * by name an integer compare is enough.
+ */
+class PoseLookup {
+public:
+  //! Index of the pose named @p name (entity @p id) in @p msg, -1 if absent
+  int Find(const gz::msgs::Pose_V &msg, const std::string &name, uint64_t id) {
+    if (index_ >= 0 && index_ < msg.pose_size()) {
+      const gz::msgs::Pose &pose = msg.pose(index_);
+      if (match_by_id_ ? pose.id() == id : pose.name() == name) {
+        return index_;
+      }
+    }
+
+    // Layout changed (or first message): rescan
+    index_ = -1;
+    for (int p = 0; p < msg.pose_size(); p++) {
+      if (msg.pose(p).name() == name) {
+        index_ = p;
+        match_by_id_ = (msg.pose(p).id() == id);
+        break;
+      }
+    }
+    return index_;
+  }
+
+  void Reset() {
+    index_ = -1;
+    match_by_id_ = false;
+  }
+
+private:
+  int index_{-1};
+  bool match_by_id_{false};
+};
@@ -0,0 +1,95 @@
+/**
+ * @brief Holds the simulation at a target real-time factor
+ * @file rtf_pacer.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief Throttles the simulation thread so that sim time advances at
+ * target times wall time.
+ *
+ * Each step's wall-clock deadline follows from an anchor (wall, sim) pair,
+ * so sleep overshoot does not accumulate. The thread sleeps until shortly
+ * before the deadline and spins the rest. When the simulation falls more
+ * than kMaxLag behind, e.g. PX4 stalled or the host is overloaded, the
+ * anchor is moved instead of bursting to catch up. A target of 0 disables
+ * pacing (as fast as possible).
+ *
+ * Not thread safe, call from the simulation thread.
+ */
+class RtfPacer {
+public:
+  using Clock = std::chrono::steady_clock;
+  using Duration = Clock::duration;
+
+  static constexpr std::chrono::milliseconds kMaxLag{100};
+  static constexpr std::chrono::microseconds kDefaultSpin{200};
+  static constexpr std::chrono::seconds kDefaultWindow{5};
+
+  //! @p rtf <= 0 runs as fast as possible
+  void SetTarget(double rtf);
+  double Target() const { return target_; }
+  bool Enabled() const { return target_ > 0.0; }
+
+  //! Time before each deadline spent spinning rather than sleeping
+  void SetSpin(std::chrono::microseconds spin) { spin_ = spin; }
+
+  //! Wall time over which Achieved() is measured
+  void SetWindow(Duration window) { window_ = window; }
+
+  /**
+   * @brief Block until the wall clock has caught up with @p sim_time.
+   * A jump back in sim time (world reset) restarts the schedule.
+   */
+  void Pace(Duration sim_time);
+
+  /**
+   * @brief True once per window, with the real-time factor achieved over
+   * it in @p achieved. Counts while pacing is disabled, too.
+   */
+  bool WindowDone(double *achieved);
+
+  //! Real-time factor of the last complete window, 0 before the first
+  double Achieved() const { return achieved_; }
+
+  //! Steps that had to wait, and the time spent waiting
+  uint64_t ThrottledSteps() const { return throttled_steps_; }
+  Duration ThrottledTime() const { return throttled_time_; }
+
+private:
+  void Anchor(Clock::time_point wall, Duration sim_time);
+
+  double target_{0.0};
+  std::chrono::microseconds spin_{kDefaultSpin};
+  Duration window_{kDefaultWindow};
+
+  bool started_{false};
+  Clock::time_point anchor_wall_;
+  Duration anchor_sim_{Duration::zero()};
+  Duration last_sim_{Duration::zero()};
+
+  Clock::time_point window_wall_;
+  Duration window_sim_{Duration::zero()};
+  bool window_done_{false};
+  double achieved_{0.0};
+
+  uint64_t throttled_steps_{0};
+  Duration throttled_time_{Duration::zero()};
+};
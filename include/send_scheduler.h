@@ -0,0 +1,108 @@
+/**
+ * @brief Priority- and type-aware queue of outgoing MAVLink frames
+ * @file send_scheduler.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <development/mavlink.h>
+#include "msgbuffer.h"
+
+/**
+ * @brief Send queue with one fixed-size lane per message id.
+ *
+ * A lane of depth 1 is a latest-value slot: a newer frame replaces the
+ * queued one (coalescing). Deeper lanes are FIFOs that drop their oldest
+ * frame when full. Drain() emits lanes in ascending priority order, so
+ * memory is bounded by the number of message types rather than by backlog.
+ *
+ * Not thread safe, the owner serializes access.
+ */
+class SendScheduler {
+public:
+  enum class PushResult {
+    queued,     ///< frame added to its lane
+    coalesced,  ///< replaced an older frame of the same type in a latest-value lane
+    dropped,    ///< lane was full, its oldest frame was discarded
+  };
+
+  struct LaneStats {
+    uint32_t msgid;
+    uint8_t priority;
+    size_t depth;
+    size_t queued;         ///< frames currently pending
+    size_t high_water;     ///< largest number of frames ever pending
+    uint64_t pushed;
+    uint64_t coalesced;
+    uint64_t dropped;
+  };
+
+  //! Lane parameters for message types without an explicit lane
+  static constexpr uint8_t kDefaultPriority = 2;
+  static constexpr size_t kDefaultDepth = 4;
+  static constexpr size_t kMaxLanes = 16;
+
+  SendScheduler();
+
+  /**
+   * @brief Register a lane, lower priority values are sent first.
+   * Registering an existing msgid reconfigures it and discards its frames.
+   */
+  void AddLane(uint32_t msgid, uint8_t priority, size_t depth);
+
+  //! Serialize @p msg into the lane of its message id
+  PushResult Push(const mavlink_message_t *msg);
+
+  //! Queue an already serialized frame, @p len at most MsgBuffer::MAX_SIZE
+  PushResult Push(uint32_t msgid, const uint8_t *frame, size_t len);
+
+  /**
+   * @brief Move up to @p max pending frames into @p out, highest priority first.
+   * @return number of frames written
+   */
+  size_t Drain(MsgBuffer *out, size_t max);
+
+  bool Empty() const { return pending_ == 0; }
+  size_t Pending() const { return pending_; }
+
+  //! Frames rejected because no lane could be created for their type
+  uint64_t UnroutedDrops() const { return unrouted_dropped_; }
+
+  std::vector<LaneStats> Stats() const;
+
+private:
+  struct Lane {
+    uint32_t msgid;
+    uint8_t priority;
+    std::vector<MsgBuffer> frames;  ///< ring of depth entries
+    size_t head{0};
+    size_t count{0};
+    size_t high_water{0};
+    uint64_t pushed{0};
+    uint64_t coalesced{0};
+    uint64_t dropped{0};
+  };
+
+  Lane *FindLane(uint32_t msgid);
+  //! Claim the next slot of @p msgid's lane, nullptr if no lane could be made
+  MsgBuffer *NextSlot(uint32_t msgid, PushResult *result);
+
+  std::vector<Lane> lanes_;  ///< sorted by priority
+  size_t pending_{0};
+  uint64_t unrouted_dropped_{0};
+};
@@ -0,0 +1,115 @@
+/**
+ * @brief Fast, reproducible Gaussian noise for simulated sensors
+ * @file sensor_noise.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief xoshiro256+ pseudo random generator (Blackman & Vigna).
+ * Plenty for noise generation and much cheaper than std::mt19937.
+ */
+class Xoshiro256Plus {
+public:
+  explicit Xoshiro256Plus(uint64_t seed = 0) { Seed(seed); }
+
+  //! Expand a 64 bit seed into the full state with splitmix64
+  void Seed(uint64_t seed) {
+    for (auto &word : s_) {
+      seed += 0x9e3779b97f4a7c15ULL;
+      uint64_t z = seed;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      word = z ^ (z >> 31);
+    }
+  }
+
+  uint64_t Next() {
+    const uint64_t result = s_[0] + s_[3];
+    const uint64_t t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = Rotl(s_[3], 45);
+    return result;
+  }
+
+  //! Uniform float in (0, 1], the upper bits are the well distributed ones
+  float NextUniform() {
+    return static_cast<float>((Next() >> 40) + 1) * (1.0f / 16777216.0f);
+  }
+
+private:
+  static uint64_t Rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  std::array<uint64_t, 4> s_;
+};
+
+/**
+ * @brief Standard normal samples, generated a block at a time.
+ *
+ * Box-Muller yields two samples per log/sqrt/sincos, the block refill keeps
+ * that loop tight and out of the per-sample path. Not thread safe, use one
+ * instance per sensor callback.
+ */
+class GaussianNoise {
+public:
+  static constexpr size_t kBlockSize = 64;
+
+  explicit GaussianNoise(uint64_t seed = 0) { Seed(seed); }
+
+  void Seed(uint64_t seed) {
+    rng_.Seed(seed);
+    next_ = kBlockSize;
+  }
+
+  float Sample() {
+    if (next_ == kBlockSize) {
+      Refill();
+    }
+    return block_[next_++];
+  }
+
+  //! @p value plus noise drawn from N(mean, stddev^2)
+  float Apply(float value, float mean, float stddev) {
+    if (stddev <= 0.0f) {
+      return value + mean;
+    }
+    return value + mean + stddev * Sample();
+  }
+
+private:
+  void Refill() {
+    for (size_t i = 0; i < kBlockSize; i += 2) {
+      const float r = std::sqrt(-2.0f * std::log(rng_.NextUniform()));
+      const float theta = 2.0f * static_cast<float>(M_PI) * rng_.NextUniform();
+      block_[i] = r * std::cos(theta);
+      block_[i + 1] = r * std::sin(theta);
+    }
+    next_ = 0;
+  }
+
+  Xoshiro256Plus rng_;
+  std::array<float, kBlockSize> block_{};
+  size_t next_{kBlockSize};
+};
@@ -0,0 +1,121 @@
+/**
+ * @brief Per-sensor update rates keyed on simulation time
+ * @file sensor_scheduler.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+//! Simulated sensors and state messages with their own rate
+enum class SimSensor : unsigned {
+  imu,               ///< HIL_SENSOR itself, and with it the lockstep cycle
+  baro,
+  mag,
+  airspeed,
+  gps,               ///< HIL_GPS
+  state_quaternion,  ///< HIL_STATE_QUATERNION
+  count
+};
+
+//! Bit of @p sensor in the masks used by SensorScheduler and SendSensorMessages()
+static constexpr uint32_t SensorBit(SimSensor sensor) {
+  return 1u << static_cast<unsigned>(sensor);
+}
+
+static constexpr uint32_t kAllSensors = (1u << static_cast<unsigned>(SimSensor::count)) - 1;
+
+/**
+ * @brief Decides which sensors are due at a given simulation time.
+ *
+ * Each sensor has a period and the sim time of its next sample. Deadlines
+ * advance by whole periods, so a rate that does not divide the physics rate
+ * still averages out right (100 Hz on 250 Hz physics alternates 8 and 12 ms).
+ * A rate of zero, the default, makes the sensor due on every call. A jump
+ * back in time (world reset) restarts the schedule.
+ *
+ * Not thread safe, but sensors are independent: each one may be polled from
+ * its own thread.
+ */
+class SensorScheduler {
+public:
+  using Duration = std::chrono::steady_clock::duration;
+
+  static constexpr size_t kNumSensors = static_cast<size_t>(SimSensor::count);
+
+  //! @p rate_hz <= 0 runs @p sensor at the caller's rate
+  void SetRate(SimSensor sensor, double rate_hz) {
+    Slot &slot = slots_[Index(sensor)];
+    slot.period = rate_hz > 0.0
+      ? std::chrono::duration_cast<Duration>(std::chrono::duration<double>(1.0 / rate_hz))
+      : Duration::zero();
+    slot.started = false;
+  }
+
+  double Rate(SimSensor sensor) const {
+    const Duration period = slots_[Index(sensor)].period;
+    return period > Duration::zero() ? 1.0 / std::chrono::duration<double>(period).count() : 0.0;
+  }
+
+  //! True if @p sensor should sample at @p sim_time, which then counts as taken
+  bool Due(SimSensor sensor, Duration sim_time) {
+    Slot &slot = slots_[Index(sensor)];
+    if (slot.period == Duration::zero()) {
+      return true;
+    }
+    if (!slot.started || slot.next_due > sim_time + slot.period) {
+      // First sample, or sim time went backwards
+      slot.started = true;
+      slot.next_due = sim_time + slot.period;
+      return true;
+    }
+    if (sim_time < slot.next_due) {
+      return false;
+    }
+    slot.next_due += slot.period;
+    if (slot.next_due <= sim_time) {
+      // Fell more than a period behind (rate above the caller's, or a pause)
+      slot.next_due = sim_time + slot.period;
+    }
+    return true;
+  }
+
+  //! SensorBit()s of the sensors in @p sensors that are due at @p sim_time
+  uint32_t DueMask(Duration sim_time, uint32_t sensors = kAllSensors) {
+    uint32_t due = 0;
+    for (size_t i = 0; i < kNumSensors; i++) {
+      const SimSensor sensor = static_cast<SimSensor>(i);
+      if ((sensors & SensorBit(sensor)) && Due(sensor, sim_time)) {
+        due |= SensorBit(sensor);
+      }
+    }
+    return due;
+  }
+
+private:
+  struct Slot {
+    Duration period{Duration::zero()};
+    Duration next_due{Duration::zero()};
+    bool started{false};
+  };
+
+  static size_t Index(SimSensor sensor) { return static_cast<size_t>(sensor); }
+
+  std::array<Slot, kNumSensors> slots_{};
+};
@@ -0,0 +1,103 @@
+/**
+ * @brief Sequence lock publishing small trivially copyable values
+ * @file seqlock.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "spin_pause.h"
+
+/**
+ * @brief Latest value of a sensor, written by its transport callback and
+ * read by the simulation thread without either of them blocking the other.
+ *
+ * The value is kept as relaxed atomic words bracketed by a sequence counter
+ * that is odd while a store is in progress. Readers retry until they copied
+ * the value between two identical even counts; they never stall a writer.
+ * Concurrent writers are serialized on the counter, which is cheap since a
+ * store is a handful of word copies.
+ *
+ * Version() changes with every Store(), which lets a reader tell whether a
+ * sample arrived since it last looked.
+ */
+template <typename T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value, "Seqlock values are copied word by word");
+
+public:
+  Seqlock() { Store(T{}); seq_.store(0, std::memory_order_relaxed); }
+
+  Seqlock(const Seqlock &) = delete;
+  Seqlock &operator=(const Seqlock &) = delete;
+
+  void Store(const T &value) {
+    uint64_t words[kWords] {};
+    memcpy(words, &value, sizeof(T));
+
+    uint32_t seq = seq_.load(std::memory_order_relaxed);
+    while ((seq & 1) || !seq_.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire)) {
+      SpinPause();
+      seq = seq_.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; i++) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  //! Consistent copy of the latest value, and optionally its Version()
+  T Load(uint32_t *version = nullptr) const {
+    uint64_t words[kWords];
+    uint32_t seq;
+    while (true) {
+      seq = seq_.load(std::memory_order_acquire);
+      if (seq & 1) {
+        SpinPause();
+        continue;
+      }
+      for (size_t i = 0; i < kWords; i++) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq_.load(std::memory_order_relaxed) == seq) {
+        break;
+      }
+    }
+
+    if (version) {
+      *version = seq;
+    }
+    T value;
+    memcpy(&value, words, sizeof(T));
+    return value;
+  }
+
+  //! Number of completed stores times two, 0 until the first one
+  uint32_t Version() const { return seq_.load(std::memory_order_acquire) & ~1u; }
+
+private:
+  static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  std::atomic<uint32_t> seq_{0};
+  std::atomic<uint64_t> words_[kWords];
+};
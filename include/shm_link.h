@@ -0,0 +1,129 @@
+/**
+ * @brief Shared-memory MAVLink transport between the simulator and a PX4 on the same host
+ * @file shm_link.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * Wire layout of /dev/shm/<name>, all fields host byte order, so that the
+ * PX4 side can implement the peer without this header:
+ *
+ *   offset 0      ShmLinkHeader                       64 bytes
+ *   offset 64     ShmRing  simulator -> PX4           192 bytes + ring_bytes
+ *   following     ShmRing  PX4 -> simulator           192 bytes + ring_bytes
+ *
+ * Each ring is single producer, single consumer. head and tail are byte
+ * counts that only grow; the data offset is the count modulo ring_bytes (a
+ * power of two). A record is a uint32_t frame length followed by the
+ * serialized MAVLink frame, padded to 4 bytes. Records may wrap around the
+ * end of the data area, their length word never does.
+ *
+ * The producer copies the record in, then stores tail (release), increments
+ * futex and, if waiting is set, calls FUTEX_WAKE on futex. The consumer
+ * sets waiting, reads futex, and sleeps in FUTEX_WAIT on that value only if
+ * the ring is still empty, then clears waiting. The futex is process shared,
+ * i.e. without FUTEX_PRIVATE_FLAG.
+ *
+ * The simulator creates the file and removes it on close; PX4 attaches to
+ * it and sets peer_pid.
+ */
+static constexpr char kShmLinkMagic[8] = {'M', 'A', 'V', 'L', 'S', 'H', 'M', '\0'};
+static constexpr uint32_t kShmLinkVersion = 1;
+
+struct ShmLinkHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t ring_bytes;
+  uint32_t creator_pid;
+  std::atomic<uint32_t> peer_pid;
+  uint8_t reserved[40];
+};
+static_assert(sizeof(ShmLinkHeader) == 64, "ShmLinkHeader layout changed");
+
+struct alignas(64) ShmRing {
+  alignas(64) std::atomic<uint64_t> head;    ///< consumer position [bytes]
+  alignas(64) std::atomic<uint64_t> tail;    ///< producer position [bytes]
+  alignas(64) std::atomic<uint32_t> futex;   ///< bumped by the producer on every publish
+  std::atomic<uint32_t> waiting;             ///< consumer asleep, or about to be
+  // followed by ring_bytes of data
+};
+static_assert(sizeof(ShmRing) == 192, "ShmRing layout changed");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ShmRing needs address-free atomics");
+
+/**
+ * @brief One end of a shared-memory link.
+ *
+ * Send() never blocks and costs one futex syscall only when the peer is
+ * asleep; Receive() sleeps in the kernel while the ring is empty.
+ */
+class ShmLink {
+public:
+  static constexpr size_t kDefaultRingBytes = 256 << 10;
+
+  ShmLink() = default;
+  ~ShmLink() { Close(); }
+
+  ShmLink(const ShmLink &) = delete;
+  ShmLink &operator=(const ShmLink &) = delete;
+
+  //! Simulator side: create /dev/shm/@p name anew, false (with a message on stderr) on failure
+  bool Create(const std::string &name, size_t ring_bytes = kDefaultRingBytes);
+
+  //! PX4 side, also used by the benchmarks: map a link made by Create()
+  bool Attach(const std::string &name);
+
+  //! Unmap, and remove the file if this end created it
+  void Close();
+
+  //! Queue one frame for the peer, false if the ring is full. Thread safe.
+  bool Send(const uint8_t *frame, size_t len);
+
+  /**
+   * @brief Copy the next frame from the peer into @p buf, sleeping for up to
+   * @p timeout while there is none. Single consumer.
+   * @return frame length, 0 on timeout or after Wake()
+   */
+  size_t Receive(uint8_t *buf, size_t size, std::chrono::milliseconds timeout);
+
+  //! Let a Receive() sleeping on this end return early, e.g. on shutdown
+  void Wake();
+
+  bool IsOpen() const { return map_ != nullptr; }
+  bool PeerAttached() const { return header_ && header_->peer_pid.load(std::memory_order_relaxed) != 0; }
+  const std::string &Path() const { return path_; }
+
+private:
+  bool Map(int fd, size_t size);
+  static uint8_t *Data(ShmRing *ring) { return reinterpret_cast<uint8_t *>(ring + 1); }
+
+  std::string path_;
+  bool owner_{false};
+  uint8_t *map_{nullptr};
+  size_t map_size_{0};
+  size_t ring_bytes_{0};
+  ShmLinkHeader *header_{nullptr};
+  ShmRing *tx_{nullptr};
+  ShmRing *rx_{nullptr};
+  std::mutex tx_mutex_;  ///< keeps the ring single producer
+};
@@ -0,0 +1,118 @@
+/**
+ * @brief Fixed-capacity single-producer/single-consumer ring buffer
+ * @file spsc_ring.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/**
+ * @brief Lock-free ring of preallocated slots between exactly one producer
+ * thread and exactly one consumer thread.
+ *
+ * Both sides work in place: the producer fills the slot returned by Back()
+ * and publishes it with Push(), the consumer reads the slot returned by
+ * Front() and releases it with Pop(). No allocation happens after Reset().
+ */
+template <typename T>
+class SpscRing {
+public:
+  SpscRing() = default;
+  explicit SpscRing(size_t capacity) { Reset(capacity); }
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  /**
+   * @brief (Re)allocate the slots, rounding the capacity up to a power of two.
+   * Not thread safe, must be called before producer and consumer start.
+   */
+  void Reset(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots_.reset(new T[size]);
+    mask_ = size - 1;
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+    cached_head_ = 0;
+    cached_tail_ = 0;
+  }
+
+  size_t Capacity() const { return slots_ ? mask_ + 1 : 0; }
+
+  //! Producer side: free slot to write into, nullptr if the ring is full
+  T *Back() {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) {
+        return nullptr;
+      }
+    }
+    return &slots_[tail & mask_];
+  }
+
+  //! Producer side: publish the slot previously returned by Back()
+  void Push() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  //! Consumer side: oldest published slot, nullptr if the ring is empty
+  T *Front() {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return nullptr;
+      }
+    }
+    return &slots_[head & mask_];
+  }
+
+  //! Consumer side: release the slot previously returned by Front()
+  void Pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  bool Empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+  }
+
+  size_t Size() const {
+    return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+  }
+
+private:
+  static constexpr size_t kCacheLine = 64;
+
+  std::unique_ptr<T[]> slots_;
+  size_t mask_{0};
+
+  // Consumer owned, kept on separate cache lines from the producer side
+  std::atomic<size_t> head_{0};
+  size_t cached_tail_{0};
+  char pad_head_[kCacheLine];
+
+  // Producer owned
+  std::atomic<size_t> tail_{0};
+  size_t cached_head_{0};
+  char pad_tail_[kCacheLine];
+};
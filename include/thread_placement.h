@@ -0,0 +1,60 @@
+/**
+ * @brief CPU affinity, real-time priority and memory locking for the MAVLink I/O threads
+ * @file thread_placement.h
+ */
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief Where and how a worker thread should run.
+ *
+ * The default leaves the thread as created: any CPU, SCHED_OTHER.
+ */
+struct ThreadPlacement {
+  std::vector<int> cpus;  ///< allowed CPUs, empty to keep the inherited affinity
+  int priority{0};        ///< SCHED_FIFO priority 1..99, 0 to keep SCHED_OTHER
+
+  bool Empty() const { return cpus.empty() && priority == 0; }
+};
+
+//! Parse a CPU list such as "2,4-6", false if malformed
+bool ParseCpuList(const std::string &list, std::vector<int> *cpus);
+
+//! Inverse of ParseCpuList(), with ranges collapsed
+std::string FormatCpuList(const std::vector<int> &cpus);
+
+/**
+ * @brief Override @p placement from PX4_SIM_<role>_CPUS and
+ * PX4_SIM_<role>_PRIORITY where set, e.g. PX4_SIM_RECEIVER_CPUS=3.
+ * @return false (with a message on stderr) for a malformed value
+ */
+bool ThreadPlacementFromEnv(const std::string &role, ThreadPlacement *placement);
+
+/**
+ * @brief Apply @p placement to the calling thread and log the affinity and
+ * scheduling it actually ended up with. Failures, e.g. missing
+ * CAP_SYS_NICE, are logged and otherwise ignored.
+ */
+void ApplyThreadPlacement(const char *thrd_name, const ThreadPlacement &placement);
+
+/**
+ * @brief mlockall() the process once, so that page faults do not stall the
+ * I/O threads. Later calls return the first result.
+ */
+bool LockProcessMemory();
@@ -23,11 +23,13 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <random>
+#include <unordered_map>
 
 #include <gz/plugin/Register.hh>
 #include <gz/sensors/Sensor.hh>
 #include <gz/sim/components/AirPressureSensor.hh>
 #include <gz/sim/components/Magnetometer.hh>
+#include <gz/sim/components/Model.hh>
 #include <gz/sim/components/Imu.hh>
 #include <gz/sim/components/Pose.hh>
 #include <gz/transport/Discovery.hh>
@@ -48,6 +50,10 @@ GazeboMavlinkInterface::GazeboMavlinkInterface() :
 }
 
 GazeboMavlinkInterface::~GazeboMavlinkInterface() {
+  stop_resolver_ = true;
+  if (hostname_resolver_thread_.joinable()) {
+    hostname_resolver_thread_.join();
+  }
   mavlink_interface_->close();
 }
 
@@ -55,6 +61,7 @@ void GazeboMavlinkInterface::Configure(const gz::sim::Entity &_entity,
       const std::shared_ptr<const sdf::Element> &_sdf,
       gz::sim::EntityComponentManager &_ecm,
       gz::sim::EventManager &_em) {
+  const auto configure_start = std::chrono::steady_clock::now();
 
   namespace_.clear();
   if (_sdf->HasElement("robotNamespace")) {
@@ -81,12 +88,12 @@ void GazeboMavlinkInterface::Configure(const gz::sim::Entity &_entity,
   gazebo::getSdfParam<std::string>(_sdf, "cmdVelSubTopic", cmd_vel_sub_topic_, cmd_vel_sub_topic_);
   gazebo::getSdfParam<std::string>(_sdf, "baroSubTopic", baro_sub_topic_, baro_sub_topic_);
 
-  // Set motor and servo input_reference_ from inputs.control
-  motor_input_reference_.resize(n_out_max);
-  servo_input_reference_.resize(n_out_max);
+  // Set motor and servo input_reference_ from inputs.control, sized once so
+  // that the update loop never allocates
+  motor_input_reference_.setZero(n_motors);
 
-  // Parse the MulticopterMotorModel plugins to get the motor velocity scalings
-  ParseMulticopterMotorModelPlugins(model_.SourceFilePath(_ecm));
+  // maxRotVelocity of the MulticopterMotorModel plugins gives the motor velocity scalings
+  LoadMotorVelocityScalings(_ecm);
 
   bool use_tcp = false;
   if (_sdf->HasElement("use_tcp"))
@@ -101,7 +108,42 @@ void GazeboMavlinkInterface::Configure(const gz::sim::Entity &_entity,
     tcp_client_mode = _sdf->Get<bool>("tcp_client_mode");
     mavlink_interface_->SetUseTcpClientMode(tcp_client_mode);
   }
-  gzmsg << "Connecting to PX4 HITL using " << (use_tcp ? (tcp_client_mode ? "TCP (client mode)" : "TCP (server mode)") : "UDP") << std::endl;
+
+  // Serial takes precedence over UDP/TCP, for boards connected directly over USB or UART
+  bool use_serial = false;
+  if (_sdf->HasElement("use_serial"))
+  {
+    use_serial = _sdf->Get<bool>("use_serial");
+    mavlink_interface_->SetUseSerial(use_serial);
+  }
+  if (_sdf->HasElement("serial_device"))
+  {
+    mavlink_interface_->SetDevice(_sdf->Get<std::string>("serial_device"));
+  }
+  if (_sdf->HasElement("serial_baudrate"))
+  {
+    mavlink_interface_->SetBaudrate(_sdf->Get<int>("serial_baudrate"));
+  }
+
+  // Shared memory for a PX4 SITL on the same host, used unless serial is set
+  bool use_shm = false;
+  if (_sdf->HasElement("use_shm"))
+  {
+    use_shm = _sdf->Get<bool>("use_shm") && !use_serial;
+    mavlink_interface_->SetUseShm(use_shm);
+  }
+  if (_sdf->HasElement("shm_name"))
+  {
+    mavlink_interface_->SetShmName(_sdf->Get<std::string>("shm_name"));
+  }
+
+  if (use_serial) {
+    gzmsg << "Connecting to PX4 HITL using serial" << std::endl;
+  } else if (use_shm) {
+    gzmsg << "Connecting to PX4 SITL using shared memory" << std::endl;
+  } else {
+    gzmsg << "Connecting to PX4 HITL using " << (use_tcp ? (tcp_client_mode ? "TCP (client mode)" : "TCP (server mode)") : "UDP") << std::endl;
+  }
 
   if (_sdf->HasElement("enable_lockstep"))
   {
@@ -110,21 +152,55 @@ void GazeboMavlinkInterface::Configure(const gz::sim::Entity &_entity,
   }
   gzmsg << "Lockstep is " << (enable_lockstep_ ? "enabled" : "disabled") << std::endl;
 
+  // How long a lockstep step waits for PX4 (0, the default, waits forever), and how much of
+  // that is spent spinning before the sim thread blocks
+  if (_sdf->HasElement("lockstep_timeout_ms")) {
+    mavlink_interface_->SetLockstepTimeout(
+      std::chrono::milliseconds(_sdf->Get<int>("lockstep_timeout_ms")));
+  }
+  if (_sdf->HasElement("lockstep_spin_us")) {
+    mavlink_interface_->SetLockstepSpin(
+      std::chrono::microseconds(_sdf->Get<int>("lockstep_spin_us")));
+  }
+
+  // With lockstep_barrier, all vehicles in lockstep wait for their PX4
+  // together, so a world step takes as long as the slowest one rather than
+  // the sum of them; by default each vehicle waits on its own
+  bool lockstep_barrier = false;
+  gazebo::getSdfParam<bool>(_sdf, "lockstep_barrier", lockstep_barrier, lockstep_barrier);
+  mavlink_interface_->SetLockstepBarrier(lockstep_barrier, model_name_);
+
   // When running in lockstep, we can run the simulation slower or faster than
-  // realtime. The speed can be set using the env variable PX4_SIM_SPEED_FACTOR.
+  // realtime. The speed can be set using the env variable PX4_SIM_SPEED_FACTOR
+  // or speed_factor in the SDF; without either lockstep runs as fast as PX4
+  // answers. as_fast_as_possible turns the pacing off for batch runs.
   if (enable_lockstep_)
   {
+    bool paced = gazebo::getSdfParam<double>(_sdf, "speed_factor", speed_factor_, speed_factor_);
     const char *speed_factor_str = std::getenv("PX4_SIM_SPEED_FACTOR");
     if (speed_factor_str)
     {
       speed_factor_ = std::atof(speed_factor_str);
-      if (!std::isfinite(speed_factor_) || speed_factor_ <= 0.0)
-      {
-        gzerr << "Invalid speed factor '" << speed_factor_str << "', aborting" << std::endl;
-        abort();
-      }
+      paced = true;
+    }
+    if (!std::isfinite(speed_factor_) || speed_factor_ <= 0.0)
+    {
+      gzerr << "Invalid speed factor '" << speed_factor_ << "', aborting" << std::endl;
+      abort();
     }
     gzmsg << "Speed factor set to: " << speed_factor_ << std::endl;
+
+    bool as_fast_as_possible = false;
+    gazebo::getSdfParam<bool>(_sdf, "as_fast_as_possible", as_fast_as_possible, as_fast_as_possible);
+    if (paced && !as_fast_as_possible) {
+      rtf_pacer_.SetTarget(speed_factor_);
+      if (_sdf->HasElement("pacing_spin_us")) {
+        rtf_pacer_.SetSpin(std::chrono::microseconds(_sdf->Get<int>("pacing_spin_us")));
+      }
+      gzmsg << "Pacing lockstep to a real-time factor of " << speed_factor_ << std::endl;
+    } else {
+      gzmsg << "Lockstep runs as fast as possible" << std::endl;
+    }
   }
 
   // Listen to Ctrl+C / SIGINT.
@@ -137,10 +213,70 @@ void GazeboMavlinkInterface::Configure(const gz::sim::Entity &_entity,
 
   auto vehicle_scope_prefix = world_name + model_name;
 
-  // Publish to servo control
-  auto servo_control_topic = model_name + "/servo_";
-  for (int i = 0; i < servo_input_reference_.size(); i++) {
-    servo_control_pub_[i] = node.Advertise<gz::msgs::Double>(servo_control_topic + std::to_string(i));
+  // Servo channels are the actuator outputs listed in servo_channels, in order
+  std::string servo_channels;
+  gazebo::getSdfParam<std::string>(_sdf, "servo_channels", servo_channels, servo_channels);
+  std::istringstream servo_channels_stream(servo_channels);
+  int servo_channel;
+  n_servos_ = 0;
+  while (servo_channels_stream >> servo_channel) {
+    if (servo_channel < 0 || servo_channel >= static_cast<int>(n_out_max) || n_servos_ >= n_out_max) {
+      gzerr << "[gazebo_mavlink_interface] Ignoring invalid servo channel " << servo_channel << std::endl;
+      continue;
+    }
+    servo_input_index_[n_servos_++] = servo_channel;
+  }
+  servo_input_reference_.setZero(n_servos_);
+  // NaN compares unequal, so the first update is always published
+  std::fill(std::begin(servo_last_published_), std::end(servo_last_published_),
+    std::numeric_limits<double>::quiet_NaN());
+
+  double servo_keepalive_period = 1.0;
+  gazebo::getSdfParam<double>(_sdf, "servo_keepalive_period", servo_keepalive_period, servo_keepalive_period);
+  servo_keepalive_period_ = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<double>(servo_keepalive_period));
+
+  // Publish to servo control, either batched on one topic or one topic per servo
+  std::string servoControlPubTopic;
+  gazebo::getSdfParam<std::string>(_sdf, "servoControlPubTopic", servoControlPubTopic, servoControlPubTopic);
+  if (!servoControlPubTopic.empty()) {
+    servo_batch_pub_ = node.Advertise<gz::msgs::Actuators>(namespace_ + "/" + servoControlPubTopic);
+    servo_position_message_.mutable_position()->Resize(n_servos_,
+      std::numeric_limits<double>::quiet_NaN());
+  } else {
+    auto servo_control_topic = model_name + "/servo_";
+    for (unsigned i = 0; i < n_servos_; i++) {
+      servo_control_pub_[i] = node.Advertise<gz::msgs::Double>(servo_control_topic + std::to_string(i));
+    }
+  }
+
+  // Per-stage latency of the lockstep cycle, see LatencyTracer
+  bool latency_tracing = false;
+  gazebo::getSdfParam<bool>(_sdf, "latency_tracing", latency_tracing, latency_tracing);
+  if (latency_tracing) {
+    mavlink_interface_->SetLatencyTracing(true);
+
+    double latency_publish_period = 1.0;
+    gazebo::getSdfParam<double>(_sdf, "latency_publish_period", latency_publish_period, latency_publish_period);
+    latency_pub_period_ = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(latency_publish_period));
+
+    std::string latencyPubTopic = "mavlink/latency";
+    gazebo::getSdfParam<std::string>(_sdf, "latencyPubTopic", latencyPubTopic, latencyPubTopic);
+    latency_pub_ = node.Advertise<gz::msgs::Param>(namespace_ + "/" + latencyPubTopic);
+    gzmsg << "Publishing MAVLink latency histograms on " << namespace_ + "/" + latencyPubTopic << std::endl;
+  }
+
+  // Link-health counters (traffic per msgid, drops, errors, reconnects), 0 disables them
+  double link_stats_publish_period = 1.0;
+  gazebo::getSdfParam<double>(_sdf, "link_stats_publish_period", link_stats_publish_period, link_stats_publish_period);
+  if (link_stats_publish_period > 0.0) {
+    link_stats_pub_period_ = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(link_stats_publish_period));
+
+    std::string linkStatsPubTopic = "mavlink/link_stats";
+    gazebo::getSdfParam<std::string>(_sdf, "linkStatsPubTopic", linkStatsPubTopic, linkStatsPubTopic);
+    link_stats_pub_ = node.Advertise<gz::msgs::Param>(namespace_ + "/" + linkStatsPubTopic);
   }
 
   // Publish to cmd vel (for rover control)
@@ -163,9 +299,52 @@ void GazeboMavlinkInterface::Configure(const gz::sim::Entity &_entity,
     std::cerr << "[gazebo_mavlink_interface] Please specify a commandPubTopic. It could not be found in the sdf." << std::endl;
   }
 
-  // Subscribe to messages of sensors.
-  auto imu_topic = vehicle_scope_prefix + imu_sub_topic_;
-  node.Subscribe(imu_topic, &GazeboMavlinkInterface::ImuCallback, this);
+  gazebo::getSdfParam<bool>(_sdf, "read_state_from_ecm", read_state_from_ecm_, read_state_from_ecm_);
+
+  // Sensor rates [Hz] on sim time, 0 runs a sensor on every physics step.
+  // imu_rate is the rate of HIL_SENSOR and so of the lockstep cycle, the
+  // slower sensors ride along in the HIL_SENSOR of the tick they fall due.
+  // Set before the first subscription, the callbacks read the schedule.
+  const std::pair<const char *, SimSensor> rate_params[] = {
+    {"imu_rate", SimSensor::imu},
+    {"baro_rate", SimSensor::baro},
+    {"mag_rate", SimSensor::mag},
+    {"airspeed_rate", SimSensor::airspeed},
+    {"gps_rate", SimSensor::gps},
+    {"pose_rate", SimSensor::state_quaternion},
+  };
+  for (const auto &param : rate_params) {
+    // Without a NavSat sensor GPS is derived from the ECM, at 10 Hz unless told otherwise
+    double rate = (param.second == SimSensor::gps && read_state_from_ecm_) ? kDefaultEcmGpsRate : 0.0;
+    if (gazebo::getSdfParam<double>(_sdf, param.first, rate, rate)) {
+      gzmsg << "Sensor rate " << param.first << " set to: " << rate << " Hz" << std::endl;
+    }
+    sensor_scheduler_.SetRate(param.second, rate);
+  }
+
+  // The IMU either comes from a gz-sensors IMU over transport, or with
+  // builtin_imu from the velocities and pose of imu_link (default: the
+  // canonical link), so that the world needs no IMU sensor at all
+  gazebo::getSdfParam<bool>(_sdf, "builtin_imu", builtin_imu_, builtin_imu_);
+  if (builtin_imu_) {
+    gazebo::getSdfParam<std::string>(_sdf, "imu_link", link_name_, link_name_);
+    imu_link_ = gz::sim::Link(link_name_.empty() ? model_.CanonicalLink(_ecm) : model_.LinkByName(_ecm, link_name_));
+    if (!imu_link_.Valid(_ecm)) {
+      gzerr << "[gazebo_mavlink_interface] No link '" << link_name_ << "' for the built-in IMU, aborting" << std::endl;
+      abort();
+    }
+    imu_link_.EnableVelocityChecks(_ecm, true);
+    imu_link_.EnableAccelerationChecks(_ecm, true);
+    const auto gravity = gz::sim::World(gz::sim::worldEntity(_ecm)).Gravity(_ecm);
+    if (gravity) {
+      gravity_W_ = *gravity;
+    }
+    gzmsg << "Built-in IMU on link '" << imu_link_.Name(_ecm).value_or("") << "'" << std::endl;
+  } else {
+    // Subscribe to messages of sensors.
+    auto imu_topic = vehicle_scope_prefix + imu_sub_topic_;
+    node.Subscribe(imu_topic, &GazeboMavlinkInterface::ImuCallback, this);
+  }
 
   auto baro_topic = vehicle_scope_prefix + baro_sub_topic_;
   node.Subscribe(baro_topic, &GazeboMavlinkInterface::BarometerCallback, this);
@@ -173,17 +352,31 @@ void GazeboMavlinkInterface::Configure(const gz::sim::Entity &_entity,
   auto mag_topic = vehicle_scope_prefix + mag_sub_topic_;
   node.Subscribe(mag_topic, &GazeboMavlinkInterface::MagnetometerCallback, this);
 
-  auto gps_topic = vehicle_scope_prefix + gps_sub_topic_;
-  node.Subscribe(gps_topic, &GazeboMavlinkInterface::GpsCallback, this);
+  // Pose and GPS either come straight from the ECM in PostUpdate, or from
+  // the pose publisher and NavSat sensor over gz-transport
+  if (read_state_from_ecm_) {
+    state_link_ = gz::sim::Link(model_.CanonicalLink(_ecm));
+    state_link_.EnableVelocityChecks(_ecm, true);
 
-  // Subscribe to entity pose info message
-  auto pose_topic = world_name + pose_sub_topic_;
-  node.Subscribe(pose_topic, &GazeboMavlinkInterface::PoseCallback, this);
-
-  // This doesn't seem to be used anywhere but we leave it here
-  // for potential compatibility
-  if (_sdf->HasElement("imu_rate")) {
-    imu_update_interval_ = 1 / _sdf->Get<int>("imu_rate");
+    if (!gz::sim::sphericalCoordinates(entity_, _ecm)) {
+      gzwarn << "[gazebo_mavlink_interface] World has no spherical coordinates, HIL_GPS will not be sent" << std::endl;
+    }
+    gzmsg << "Reading vehicle state from the ECM" << std::endl;
+  } else {
+    auto gps_topic = vehicle_scope_prefix + gps_sub_topic_;
+    node.Subscribe(gps_topic, &GazeboMavlinkInterface::GpsCallback, this);
+
+    // Subscribe to entity pose info message. The model scoped topic (published
+    // by the PosePublisher system) avoids deserializing every pose in the world.
+    bool use_model_pose_topic = false;
+    gazebo::getSdfParam<bool>(_sdf, "use_model_pose_topic", use_model_pose_topic, use_model_pose_topic);
+    if (use_model_pose_topic) {
+      auto pose_topic = model_name + "/pose";
+      node.Subscribe(pose_topic, &GazeboMavlinkInterface::ModelPoseCallback, this);
+    } else {
+      auto pose_topic = world_name + pose_sub_topic_;
+      node.Subscribe(pose_topic, &GazeboMavlinkInterface::PoseCallback, this);
+    }
   }
 
   if (_sdf->HasElement("mavlink_hostname")) {
@@ -218,48 +411,181 @@ void GazeboMavlinkInterface::Configure(const gz::sim::Entity &_entity,
     mavlink_interface_->SetMavlinkTcpPort(mavlink_tcp_port);
   }
 
-  mavlink_status_t* chan_state = mavlink_get_channel_status(MAVLINK_COMM_0);
+  // Number of preallocated receive slots, rounded up to a power of two
+  if (_sdf->HasElement("recv_buffer_size")) {
+    int recv_buffer_size = _sdf->Get<int>("recv_buffer_size");
+    if (recv_buffer_size > 0) {
+      mavlink_interface_->SetRecvBufferSize(recv_buffer_size);
+    } else {
+      gzerr << "[gazebo_mavlink_interface] Invalid recv_buffer_size " << recv_buffer_size
+        << ", using default " << kDefaultRecvBufferSize << std::endl;
+    }
+  }
+
+  // Drain all pending UDP datagrams with one recvmmsg call and parse whole frames
+  if (_sdf->HasElement("batched_receive")) {
+    mavlink_interface_->SetBatchedReceive(_sdf->Get<bool>("batched_receive"));
+  }
+
+  // Serve this link from the process-wide reactor instead of two dedicated threads
+  if (_sdf->HasElement("io_threads")) {
+    const int io_threads = _sdf->Get<int>("io_threads");
+    mavlink_interface_->SetIoThreads(std::max(io_threads, 0));
+    gzmsg << "Shared I/O reactor threads set to: " << io_threads << std::endl;
+  }
+
+  // Latency-critical HITL rigs: a receiver that spins on a non-blocking socket
+  // (pin it with receiver_cpus), socket buffer sizes, and kernel receive
+  // timestamps so that latency tracing excludes the receiver's wake-up
+  bool busy_poll = false;
+  gazebo::getSdfParam<bool>(_sdf, "busy_poll", busy_poll, busy_poll);
+  int busy_poll_us = kDefaultBusyPoll.count();
+  gazebo::getSdfParam<int>(_sdf, "busy_poll_us", busy_poll_us, busy_poll_us);
+  mavlink_interface_->SetBusyPoll(busy_poll, std::chrono::microseconds(std::max(busy_poll_us, 0)));
+
+  int socket_rcvbuf = 0;
+  int socket_sndbuf = 0;
+  gazebo::getSdfParam<int>(_sdf, "socket_rcvbuf", socket_rcvbuf, socket_rcvbuf);
+  gazebo::getSdfParam<int>(_sdf, "socket_sndbuf", socket_sndbuf, socket_sndbuf);
+  mavlink_interface_->SetSocketBuffers(std::max(socket_rcvbuf, 0), std::max(socket_sndbuf, 0));
+
+  bool kernel_timestamps = false;
+  gazebo::getSdfParam<bool>(_sdf, "kernel_timestamps", kernel_timestamps, kernel_timestamps);
+  mavlink_interface_->SetKernelTimestamps(kernel_timestamps);
+
+  // Keep the I/O threads off the physics core: <role>_cpus and <role>_priority
+  // in the SDF, overridden by PX4_SIM_<ROLE>_CPUS and PX4_SIM_<ROLE>_PRIORITY
+  const std::pair<const char *, void (MavlinkInterface::*)(const ThreadPlacement &)> roles[] = {
+    {"receiver", &MavlinkInterface::SetReceiverPlacement},
+    {"sender", &MavlinkInterface::SetSenderPlacement},
+    {"io", &MavlinkInterface::SetReactorPlacement},
+  };
+  for (const auto &role : roles) {
+    ThreadPlacement placement;
+    const std::string name = role.first;
+    if (_sdf->HasElement(name + "_cpus") &&
+        !ParseCpuList(_sdf->Get<std::string>(name + "_cpus"), &placement.cpus)) {
+      gzerr << "Invalid " << name << "_cpus '" << _sdf->Get<std::string>(name + "_cpus") << "', aborting" << std::endl;
+      abort();
+    }
+    if (_sdf->HasElement(name + "_priority")) {
+      placement.priority = _sdf->Get<int>(name + "_priority");
+      if (placement.priority < 0 || placement.priority > 99) {
+        gzerr << "Invalid " << name << "_priority " << placement.priority << ", expected 0..99, aborting" << std::endl;
+        abort();
+      }
+    }
+    if (!ThreadPlacementFromEnv(name, &placement)) {
+      gzerr << "Invalid " << name << " thread placement in the environment, aborting" << std::endl;
+      abort();
+    }
+    if (!placement.Empty()) {
+      gzmsg << "Requested " << name << " threads on CPUs "
+            << (placement.cpus.empty() ? "any" : FormatCpuList(placement.cpus)) << " with "
+            << (placement.priority > 0 ? "SCHED_FIFO priority " + std::to_string(placement.priority) : "SCHED_OTHER")
+            << std::endl;
+    }
+    (mavlink_interface_.get()->*role.second)(placement);
+  }
+
+  bool lock_memory = false;
+  gazebo::getSdfParam<bool>(_sdf, "lock_memory", lock_memory, lock_memory);
+  if (const char *lock_memory_str = std::getenv("PX4_SIM_LOCK_MEMORY")) {
+    lock_memory = std::atoi(lock_memory_str) != 0;
+  }
+  mavlink_interface_->SetLockMemory(lock_memory);
+
+  // Record the link to a file, or replay the PX4 side of such a recording
+  // instead of connecting to PX4 at all
+  std::string record_file;
+  gazebo::getSdfParam<std::string>(_sdf, "record_file", record_file, record_file);
+  if (!record_file.empty()) {
+    mavlink_interface_->SetRecordFile(record_file);
+    gzmsg << "Recording the MAVLink link to " << record_file << std::endl;
+  }
+  std::string replay_file;
+  gazebo::getSdfParam<std::string>(_sdf, "replay_file", replay_file, replay_file);
+  if (!replay_file.empty()) {
+    mavlink_interface_->SetReplayFile(replay_file);
+    gzmsg << "Replaying PX4 actuator controls from " << replay_file << std::endl;
+  }
 
-  // set the Mavlink protocol version to use on the link
+  // set the Mavlink protocol version to use on the link, the channel state is
+  // per vehicle so several instances can run in one server
   if (protocol_version_ == 2.0) {
-    chan_state->flags &= ~(MAVLINK_STATUS_FLAG_OUT_MAVLINK1);
+    mavlink_interface_->SetProtocolVersion(2);
     gzmsg << "Using MAVLink protocol v2.0" << std::endl;
   }
   else if (protocol_version_ == 1.0) {
-    chan_state->flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+    mavlink_interface_->SetProtocolVersion(1);
     gzmsg << "Using MAVLink protocol v1.0" << std::endl;
   }
   else {
     gzerr << "Unkown protocol version! Using v" << protocol_version_ << "by default " << std::endl;
   }
 
-  std::default_random_engine rnd_gen_;
+  // Sensor noise, one generator per sensor since the callbacks run on
+  // different transport threads. A fixed noise_seed makes runs repeatable.
+  gazebo::getSdfParam<double>(_sdf, "baro_noise_stddev", baro_noise_stddev_, baro_noise_stddev_);
+  gazebo::getSdfParam<double>(_sdf, "mag_noise_stddev", mag_noise_stddev_, mag_noise_stddev_);
+  gazebo::getSdfParam<gz::math::Vector3d>(_sdf, "accel_noise_stddev", accel_noise_stddev_, accel_noise_stddev_);
+  gazebo::getSdfParam<gz::math::Vector3d>(_sdf, "gyro_noise_stddev", gyro_noise_stddev_, gyro_noise_stddev_);
+
+  uint64_t noise_seed = std::random_device{}();
+  if (_sdf->HasElement("noise_seed")) {
+    noise_seed = _sdf->Get<uint64_t>("noise_seed");
+    gzmsg << "Sensor noise seed set to: " << noise_seed << std::endl;
+  }
+  baro_noise_.Seed(noise_seed);
+  mag_noise_.Seed(noise_seed + 1);
+  imu_noise_.Seed(noise_seed + 2);
 
-  if (hostptr_ || mavlink_hostname_str_.empty()) {
+  // With a host name, ResolveWorker() loads the link once it is resolved
+  if (mavlink_hostname_str_.empty()) {
     gzmsg << "--> load mavlink_interface_" << std::endl;
     mavlink_interface_->Load();
     mavlink_loaded_ = true;
   }
+
+  gzmsg << "Configured " << model_name_ << " in "
+        << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - configure_start).count()
+        << " ms" << std::endl;
 }
 
 void GazeboMavlinkInterface::PreUpdate(const gz::sim::UpdateInfo &_info,
   gz::sim::EntityComponentManager &_ecm) {
 
-  // Always run at 250 Hz. At 500 Hz, the skip factor should be 2, at 1000 Hz 4.
-  if (!(previous_imu_seq_++ % update_skip_factor_ == 0)) {
+  if (!mavlink_loaded_) {
+    // mavlink not loaded, exit
     return;
   }
 
-  if (!mavlink_loaded_) {
-    // mavlink not loaded, exit\
+  if (enable_lockstep_ && !_info.paused) {
+    rtf_pacer_.Pace(_info.simTime);
+    double achieved;
+    if (rtf_pacer_.WindowDone(&achieved)) {
+      gzmsg << "Real-time factor " << achieved << " (target "
+            << (rtf_pacer_.Enabled() ? std::to_string(rtf_pacer_.Target()) : std::string("as fast as possible"))
+            << ")" << std::endl;
+    }
+  }
+
+  // Slow sensors stay pending until a HIL_SENSOR carries a fresh sample of
+  // them. The exchange with PX4 only runs on IMU ticks, so lockstep never
+  // waits for an answer to a HIL_SENSOR that was not sent.
+  sensor_pending_mask_ |= sensor_scheduler_.DueMask(_info.simTime,
+    SensorBit(SimSensor::baro) | SensorBit(SimSensor::mag) | SensorBit(SimSensor::airspeed));
+  if (!sensor_scheduler_.Due(SimSensor::imu, _info.simTime)) {
     return;
   }
 
   double dt;
 
+  mavlink_interface_->SetSimTime(
+    std::chrono::duration_cast<std::chrono::microseconds>(_info.simTime).count());
   mavlink_interface_->ReadMAVLinkMessages();
 
-  // Always send Gyro and Accel data at full rate (= sim update rate)
+  // Gyro and Accel data go out on every IMU tick (imu_rate, default sim update rate)
   SendSensorMessages(_info);
 
   handle_actuator_controls(_info);
@@ -269,200 +595,305 @@ void GazeboMavlinkInterface::PreUpdate(const gz::sim::UpdateInfo &_info,
       PublishCmdVelocities(cmd_vel_thrust_, cmd_vel_torque_);
     } else {
       PublishMotorVelocities(_ecm, motor_input_reference_);
-      PublishServoVelocities(servo_input_reference_);
+      PublishServoVelocities(_info, servo_input_reference_);
     }
   }
+
+  PublishLatencyStats(_info);
+  PublishLinkStats(_info);
 }
 
-void GazeboMavlinkInterface::PostUpdate(const gz::sim::UpdateInfo &_info,
-    const gz::sim::EntityComponentManager &_ecm) {
+void GazeboMavlinkInterface::PublishLatencyStats(const gz::sim::UpdateInfo &_info) {
+  const LatencyTracer *tracer = mavlink_interface_->GetLatencyTracer();
+  if (!tracer || !latency_pub_.Valid() || _info.simTime - last_latency_pub_time_ < latency_pub_period_) {
+    return;
+  }
+  last_latency_pub_time_ = _info.simTime;
+
+  // Cumulative since start, one "<stage>/<statistic>" entry per value in microseconds
+  gz::msgs::Param msg;
+  auto add = [&msg](const std::string &key, double value) {
+    gz::msgs::Any any;
+    any.set_type(gz::msgs::Any::DOUBLE);
+    any.set_double_value(value);
+    (*msg.mutable_params())[key] = any;
+  };
+  for (size_t i = 0; i < LatencyTracer::kNumStages; i++) {
+    const LatencyStage stage = static_cast<LatencyStage>(i);
+    const LatencyHistogram &hist = tracer->Stage(stage);
+    const std::string name = LatencyTracer::StageName(stage);
+    add(name + "/count", hist.Count());
+    add(name + "/mean_us", hist.Mean() * 1e-3);
+    add(name + "/p50_us", hist.Percentile(0.50) * 1e-3);
+    add(name + "/p90_us", hist.Percentile(0.90) * 1e-3);
+    add(name + "/p99_us", hist.Percentile(0.99) * 1e-3);
+    add(name + "/max_us", hist.Max() * 1e-3);
+  }
+  latency_pub_.Publish(msg);
 }
 
-void GazeboMavlinkInterface::PoseCallback(const gz::msgs::Pose_V &_msg){
-  for (int p = 0; p < _msg.pose_size(); p++) {
-    if (_msg.pose(p).name() == model_name_) {
-      gz::msgs::Vector3d pose_position = _msg.pose(p).position();
-      gz::msgs::Quaternion pose_orientation = _msg.pose(p).orientation();
+void GazeboMavlinkInterface::PublishLinkStats(const gz::sim::UpdateInfo &_info) {
+  if (!link_stats_pub_.Valid() || _info.simTime - last_link_stats_pub_time_ < link_stats_pub_period_) {
+    return;
+  }
+  last_link_stats_pub_time_ = _info.simTime;
+
+  // Cumulative since Load(), "rx|tx/<msgid>/<counter>" per message type seen
+  // plus link-wide "rx|tx|link/<counter>" entries
+  gz::msgs::Param msg;
+  auto add = [&msg](const std::string &key, double value) {
+    gz::msgs::Any any;
+    any.set_type(gz::msgs::Any::DOUBLE);
+    any.set_double_value(value);
+    (*msg.mutable_params())[key] = any;
+  };
+  auto add_counters = [&add](const std::string &prefix, const LinkStats::Counters &counters) {
+    const uint64_t msgs = counters.msgs.load(std::memory_order_relaxed);
+    const uint64_t drops = counters.drops.load(std::memory_order_relaxed);
+    if (msgs == 0 && drops == 0) {
+      return;
+    }
+    add(prefix + "/msgs", msgs);
+    add(prefix + "/bytes", counters.bytes.load(std::memory_order_relaxed));
+    add(prefix + "/drops", drops);
+  };
+
+  const LinkStats &stats = mavlink_interface_->GetLinkStats();
+  for (uint32_t slot = 0; slot <= LinkStats::kTrackedMsgIds; slot++) {
+    const std::string id = (slot == LinkStats::kOtherMsgIds) ? std::string("other") : std::to_string(slot);
+    add_counters("rx/" + id, stats.Rx(slot));
+    add_counters("tx/" + id, stats.Tx(slot));
+  }
+  for (const auto &lane : mavlink_interface_->GetSendLaneStats()) {
+    add("tx/" + std::to_string(lane.msgid) + "/queue_high_water", lane.high_water);
+  }
 
-      // orientation transform
-      gz::math::Quaterniond q_gr = gz::math::Quaterniond(
-                    pose_orientation.w(),
-                    pose_orientation.x(),
-                    pose_orientation.y(),
-                    pose_orientation.z());
+  add("rx/filtered", mavlink_interface_->GetRecvFiltered());
+  add("rx/parse_errors", stats.GetParseErrors());
+  add("rx/crc_failures", stats.GetCrcFailures());
+  add("rx/errors", stats.GetReceiveErrors());
+  add("rx/queue_high_water", stats.GetReceiveHighWater());
+  add("tx/errors", stats.GetSendErrors());
+  const uint32_t connections = mavlink_interface_->GetConnections();
+  add("link/connections", connections);
+  add("link/reconnects", connections > 0 ? connections - 1 : 0);
+  add("link/disconnects", stats.GetDisconnects());
+  link_stats_pub_.Publish(msg);
+}
 
-      gz::math::Quaterniond q_nb;
-      RotateQuaternion(q_nb, q_gr);
+void GazeboMavlinkInterface::PostUpdate(const gz::sim::UpdateInfo &_info,
+    const gz::sim::EntityComponentManager &_ecm) {
+  if (_info.paused || !mavlink_loaded_) {
+    return;
+  }
 
-      // send pose info
-      mavlink_hil_state_quaternion_t hil_state_quat;
+  if (builtin_imu_) {
+    UpdateBuiltinImu(_info, _ecm);
+  }
 
-      hil_state_quat.attitude_quaternion[0] = q_nb.W();
-      hil_state_quat.attitude_quaternion[1] = q_nb.X();
-      hil_state_quat.attitude_quaternion[2] = q_nb.Y();
-      hil_state_quat.attitude_quaternion[3] = q_nb.Z();
+  if (!read_state_from_ecm_) {
+    return;
+  }
 
-      hil_state_quat.lat = pose_position.x() * 1e3;
-      hil_state_quat.lon = pose_position.y() * 1e3;
-      hil_state_quat.alt = pose_position.z() * 1e3;
+  // Ground truth of the step that was just simulated, no transport hop
+  if (sensor_scheduler_.Due(SimSensor::state_quaternion, _info.simTime)) {
+    SendPoseMessage(gz::sim::worldPose(entity_, _ecm));
+  }
 
-      mavlink_message_t msg;
-      mavlink_msg_hil_state_quaternion_encode_chan(254, 25, MAVLINK_COMM_0, &msg, &hil_state_quat);
-      // Override default global mavlink channel status with instance specific status
-      mavlink_interface_->FinalizeOutgoingMessage(&msg, 254, 25,
-        MAVLINK_MSG_ID_HIL_STATE_QUATERNION_MIN_LEN,
-        MAVLINK_MSG_ID_HIL_STATE_QUATERNION_LEN,
-        MAVLINK_MSG_ID_HIL_STATE_QUATERNION_CRC);
-      mavlink_interface_->PushSendMessage(&msg);
+  if (sensor_scheduler_.Due(SimSensor::gps, _info.simTime)) {
+    const auto lat_lon_alt = gz::sim::sphericalCoordinates(entity_, _ecm);
+    const auto velocity = state_link_.WorldLinearVelocity(_ecm);
+    if (lat_lon_alt && velocity) {
+      const uint64_t time_usec = std::chrono::duration_cast<std::chrono::microseconds>(_info.simTime).count();
+      SendGpsMessage(time_usec, lat_lon_alt->X(), lat_lon_alt->Y(), lat_lon_alt->Z(), *velocity);
     }
   }
 
+  mavlink_interface_->FlushSendMessages();
+}
+
+void GazeboMavlinkInterface::UpdateBuiltinImu(const gz::sim::UpdateInfo &_info,
+    const gz::sim::EntityComponentManager &_ecm) {
+  const auto pose = imu_link_.WorldPose(_ecm);
+  const auto velocity = imu_link_.WorldLinearVelocity(_ecm);
+  const auto angular_velocity = imu_link_.WorldAngularVelocity(_ecm);
+  if (!pose || !velocity || !angular_velocity) {
+    return;
+  }
+
+  // Physics fills the acceleration component; finite differences of the
+  // velocity otherwise, e.g. on the first step after a reset
+  auto acceleration = imu_link_.WorldLinearAcceleration(_ecm);
+  if (!acceleration) {
+    const double dt = std::chrono::duration<double>(_info.simTime - last_imu_time_).count();
+    acceleration = (imu_prev_valid_ && dt > 0.0) ? (*velocity - velocity_prev_W_) / dt : gz::math::Vector3d::Zero;
+  }
+  velocity_prev_W_ = *velocity;
+  last_imu_time_ = _info.simTime;
+  imu_prev_valid_ = true;
+
+  // Specific force and angular rate in the link frame (FLU), as the IMU sensor reports them
+  const gz::math::Vector3d accel = pose->Rot().RotateVectorReverse(*acceleration - gravity_W_);
+  const gz::math::Vector3d gyro = pose->Rot().RotateVectorReverse(*angular_velocity);
+  const ImuSample sample {
+    {accel.X(), accel.Y(), accel.Z()},
+    {gyro.X(), gyro.Y(), gyro.Z()},
+  };
+  imu_sample_.Store(sample);
+}
+
+//! Sim time a transport message was stamped with
+static std::chrono::steady_clock::duration StampTime(const gz::msgs::Time &_stamp) {
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::seconds(_stamp.sec()) + std::chrono::nanoseconds(_stamp.nsec()));
+}
+
+void GazeboMavlinkInterface::PoseCallback(const gz::msgs::Pose_V &_msg){
+  if (!sensor_scheduler_.Due(SimSensor::state_quaternion, StampTime(_msg.header().stamp()))) {
+    return;
+  }
+  const int index = pose_lookup_.Find(_msg, model_name_, entity_);
+  if (index >= 0) {
+    SendPoseMessage(gz::msgs::Convert(_msg.pose(index)));
+  }
+}
+
+void GazeboMavlinkInterface::ModelPoseCallback(const gz::msgs::Pose &_msg){
+  // The model scoped topic also carries the poses of the model's links
+  if (_msg.name() == model_name_ &&
+      sensor_scheduler_.Due(SimSensor::state_quaternion, StampTime(_msg.header().stamp()))) {
+    SendPoseMessage(gz::msgs::Convert(_msg));
+  }
+}
 
+void GazeboMavlinkInterface::SendPoseMessage(const gz::math::Pose3d &_pose)
+{
+  const gz::math::Vector3d &pose_position = _pose.Pos();
 
+  // orientation transform
+  gz::math::Quaterniond q_nb;
+  RotateQuaternion(q_nb, _pose.Rot());
+
+  // send pose info
+  mavlink_hil_state_quaternion_t hil_state_quat;
+
+  hil_state_quat.attitude_quaternion[0] = q_nb.W();
+  hil_state_quat.attitude_quaternion[1] = q_nb.X();
+  hil_state_quat.attitude_quaternion[2] = q_nb.Y();
+  hil_state_quat.attitude_quaternion[3] = q_nb.Z();
+
+  hil_state_quat.lat = pose_position.X() * 1e3;
+  hil_state_quat.lon = pose_position.Y() * 1e3;
+  hil_state_quat.alt = pose_position.Z() * 1e3;
+
+  mavlink_interface_->PushSendMessage<MAVLINK_MSG_ID_HIL_STATE_QUATERNION>(hil_state_quat);
 }
 
 void GazeboMavlinkInterface::ImuCallback(const gz::msgs::IMU &_msg) {
-  const std::lock_guard<std::mutex> lock(last_imu_message_mutex_);
-  last_imu_message_ = _msg;
+  // Only the six values used, no copy of the message
+  const ImuSample sample {
+    {_msg.linear_acceleration().x(), _msg.linear_acceleration().y(), _msg.linear_acceleration().z()},
+    {_msg.angular_velocity().x(), _msg.angular_velocity().y(), _msg.angular_velocity().z()},
+  };
+  imu_sample_.Store(sample);
 }
 
 void GazeboMavlinkInterface::BarometerCallback(const gz::msgs::FluidPressure &_msg) {
-  SensorData::Barometer baro_data;
-
-  const float absolute_pressure = AddSimpleNoise((float) _msg.pressure(), 0, 1.5);
-  const float lapse_rate = 0.0065f; // reduction in temperature with altitude (Kelvin/m)
-  const float pressure_msl = 101325.0f; // pressure at MSL
-  const float temperature_msl = 288.0f; // temperature at MSL (Kelvin)
-
-  // Calculate local temperature:
-  // absolute_pressure = pressure_msl / pressure_ratio
-  // =>
-  const float pressure_ratio = pressure_msl / absolute_pressure;
-  // pressure_ratio = powf(temperature_msl / temperature_local, 5.256f)
-  // =>
-  // temperature_local = temperature_msl / powf(pressure_ratio, 1/5.256f)
-  const float temperature_local = temperature_msl / powf(pressure_ratio, 0.19025875);
-
-  // Calculate altitude from pressure:
-  // temperature_local = temperature_msl - lapse_rate * alt_msl;
-  // =>
-  const float alt_msl = (temperature_msl - temperature_local) / lapse_rate;
-
-  //gzmsg << "[BarometerCallback] temperature_local: " << temperature_local << " abs_press: " << absolute_pressure << std::endl;
-
-  baro_data.temperature = temperature_local - 273.15f;
-  baro_data.abs_pressure = absolute_pressure / 100.0f;
-  baro_data.pressure_alt = alt_msl;
-  mavlink_interface_->UpdateBarometer(baro_data);
+  const float absolute_pressure = baro_noise_.Apply((float) _msg.pressure(), 0, baro_noise_stddev_);
+  mavlink_interface_->UpdateBarometer(BarometerFromPressure(absolute_pressure));
 }
 
 void GazeboMavlinkInterface::MagnetometerCallback(const gz::msgs::Magnetometer &_msg) {
   SensorData::Magnetometer mag_data;
   mag_data.mag_b = Eigen::Vector3d(
-    AddSimpleNoise(_msg.field_tesla().x(), 0, 0.0001),
-    AddSimpleNoise(_msg.field_tesla().y(), 0, 0.0001),
-    AddSimpleNoise(_msg.field_tesla().z(), 0, 0.0001)
+    mag_noise_.Apply(_msg.field_tesla().x(), 0, mag_noise_stddev_),
+    mag_noise_.Apply(_msg.field_tesla().y(), 0, mag_noise_stddev_),
+    mag_noise_.Apply(_msg.field_tesla().z(), 0, mag_noise_stddev_)
   );
   mavlink_interface_->UpdateMag(mag_data);
 }
 
 //void GazeboMavlinkInterface::GpsCallback(const sensor_msgs::msgs::SITLGps &_msg) {
 void GazeboMavlinkInterface::GpsCallback(const gz::msgs::NavSat &_msg) {
-    // fill HIL GPS Mavlink msg
-  //std::cerr << "GpsCallback" << std::endl;
+  // A reference, a copy of the header would allocate even for skipped samples
+  const auto &header = _msg.header();
+  if (!sensor_scheduler_.Due(SimSensor::gps, StampTime(header.stamp()))) {
+    return;
+  }
+  const uint64_t time_usec = static_cast<uint64_t>((header.stamp().sec() * 1000000) + (header.stamp().nsec() / 1000));
+  const gz::math::Vector3d velocity_enu(_msg.velocity_east(), _msg.velocity_north(), _msg.velocity_up());
+
+  //gzmsg << "[GpsCallback] alt: " << _msg.altitude() << std::endl;
+
+  SendGpsMessage(time_usec, _msg.latitude_deg(), _msg.longitude_deg(), _msg.altitude(), velocity_enu);
+}
+
+void GazeboMavlinkInterface::SendGpsMessage(uint64_t _time_usec, double _lat_deg, double _lon_deg,
+    double _alt, const gz::math::Vector3d &_velocity_enu)
+{
+  // fill HIL GPS Mavlink msg
   mavlink_hil_gps_t hil_gps_msg;
-  const auto header = _msg.header();
-  hil_gps_msg.time_usec = static_cast<uint64_t>((header.stamp().sec() * 1000000) + (header.stamp().nsec() / 1000));
+  hil_gps_msg.time_usec = _time_usec;
   hil_gps_msg.fix_type = 3;
-  hil_gps_msg.lat = static_cast<int32_t>(_msg.latitude_deg() * 1e7);
-  hil_gps_msg.lon = static_cast<int32_t>(_msg.longitude_deg() * 1e7);
-  hil_gps_msg.alt = static_cast<int32_t>(_msg.altitude() * 1000.0);
+  hil_gps_msg.lat = static_cast<int32_t>(_lat_deg * 1e7);
+  hil_gps_msg.lon = static_cast<int32_t>(_lon_deg * 1e7);
+  hil_gps_msg.alt = static_cast<int32_t>(_alt * 1000.0);
   hil_gps_msg.eph = 100;
   hil_gps_msg.epv = 100;
-  Eigen::Vector3d v(_msg.velocity_north(), _msg.velocity_east(), -_msg.velocity_up());
-  hil_gps_msg.vel = static_cast<uint16_t>(v.norm() * 100.0);
-  hil_gps_msg.vn = static_cast<int16_t>(_msg.velocity_north() * 100.0);
-  hil_gps_msg.ve = static_cast<int16_t>(_msg.velocity_east() * 100.0);
-  hil_gps_msg.vd = static_cast<int16_t>(-_msg.velocity_up() * 100.0);
+  hil_gps_msg.vel = static_cast<uint16_t>(_velocity_enu.Length() * 100.0);
+  hil_gps_msg.vn = static_cast<int16_t>(_velocity_enu.Y() * 100.0);
+  hil_gps_msg.ve = static_cast<int16_t>(_velocity_enu.X() * 100.0);
+  hil_gps_msg.vd = static_cast<int16_t>(-_velocity_enu.Z() * 100.0);
   // MAVLINK_HIL_GPS_T CoG is [0, 360]. math::Angle::Normalize() is [-pi, pi].
-  gz::math::Angle cog(atan2(_msg.velocity_east(), _msg.velocity_north()));
+  gz::math::Angle cog(atan2(_velocity_enu.X(), _velocity_enu.Y()));
   cog.Normalize();
   hil_gps_msg.cog = static_cast<uint16_t>(gazebo::GetDegrees360(cog) * 100.0);
   hil_gps_msg.satellites_visible = 10;
   hil_gps_msg.id = 0; // Workaround for mavlink zero trimming feature
 
-  //gzmsg << "[GpsCallback] alt: " << _msg.altitude() << std::endl;
-
   // send HIL_GPS Mavlink msg
-  mavlink_message_t msg;
-  mavlink_msg_hil_gps_encode_chan(254, 25, MAVLINK_COMM_0, &msg, &hil_gps_msg);
-  // Override default global mavlink channel status with instance specific status
-  mavlink_interface_->FinalizeOutgoingMessage(&msg, 254, 25,
-    MAVLINK_MSG_ID_HIL_GPS_MIN_LEN,
-    MAVLINK_MSG_ID_HIL_GPS_LEN,
-    MAVLINK_MSG_ID_HIL_GPS_CRC);
-  mavlink_interface_->PushSendMessage(&msg);
+  mavlink_interface_->PushSendMessage<MAVLINK_MSG_ID_HIL_GPS>(hil_gps_msg);
 }
 
 void GazeboMavlinkInterface::SendSensorMessages(const gz::sim::UpdateInfo &_info) {
-  const std::lock_guard<std::mutex> lock(last_imu_message_mutex_);
-  const gz::msgs::IMU last_imu_message = last_imu_message_;
-  last_imu_message_mutex_.unlock();
-
+  const ImuSample imu = imu_sample_.Load();
 
   // send always accel and gyro data (not dependent of the bitmask)
   // required so to keep the timestamps on sync and the lockstep can
   // work properly
-  // gz::math::Vector3d accel_b = q_FLU_to_FRD.RotateVector(gz::math::Vector3d(
-  //   AddSimpleNoise(last_imu_message.linear_acceleration().x(), 0, 0.006),
-  //   AddSimpleNoise(last_imu_message.linear_acceleration().y(), 0, 0.006),
-  //   AddSimpleNoise(last_imu_message.linear_acceleration().z(), 0, 0.030)));
-
-  // gz::math::Vector3d gyro_b = q_FLU_to_FRD.RotateVector(gz::math::Vector3d(
-  //   AddSimpleNoise(last_imu_message.angular_velocity().x(), 0, 0.001),
-  //   AddSimpleNoise(last_imu_message.angular_velocity().y(), 0, 0.001),
-  //   AddSimpleNoise(last_imu_message.angular_velocity().z(), 0, 0.001)));
-
   gz::math::Vector3d accel_b = q_FLU_to_FRD.RotateVector(gz::math::Vector3d(
-    last_imu_message.linear_acceleration().x(),
-    last_imu_message.linear_acceleration().y(),
-    last_imu_message.linear_acceleration().z()));
+    imu_noise_.Apply(imu.accel[0], 0, accel_noise_stddev_.X()),
+    imu_noise_.Apply(imu.accel[1], 0, accel_noise_stddev_.Y()),
+    imu_noise_.Apply(imu.accel[2], 0, accel_noise_stddev_.Z())));
 
   gz::math::Vector3d gyro_b = q_FLU_to_FRD.RotateVector(gz::math::Vector3d(
-    last_imu_message.angular_velocity().x(),
-    last_imu_message.angular_velocity().y(),
-    last_imu_message.angular_velocity().z()));
+    imu_noise_.Apply(imu.gyro[0], 0, gyro_noise_stddev_.X()),
+    imu_noise_.Apply(imu.gyro[1], 0, gyro_noise_stddev_.Y()),
+    imu_noise_.Apply(imu.gyro[2], 0, gyro_noise_stddev_.Z())));
 
   uint64_t time_usec = std::chrono::duration_cast<std::chrono::duration<uint64_t>>(_info.simTime * 1e6).count();
   SensorData::Imu imu_data;
   imu_data.accel_b = Eigen::Vector3d(accel_b.X(), accel_b.Y(), accel_b.Z());
   imu_data.gyro_b = Eigen::Vector3d(gyro_b.X(), gyro_b.Y(), gyro_b.Z());
   mavlink_interface_->UpdateIMU(imu_data);
-  mavlink_interface_->SendSensorMessages(time_usec);
+  sensor_pending_mask_ &= ~mavlink_interface_->SendSensorMessages(time_usec, sensor_pending_mask_);
 }
 
 void GazeboMavlinkInterface::handle_actuator_controls(const gz::sim::UpdateInfo &_info) {
-  bool armed = mavlink_interface_->GetArmedState();
-
   last_actuator_time_ = _info.simTime;
 
-  Eigen::VectorXd actuator_controls = mavlink_interface_->GetActuatorControls();
-  if (actuator_controls.size() < n_out_max) {
-    return; //TODO: Handle this properly
+  const ActuatorFrame &frame = mavlink_interface_->GetActuatorFrame();
+  if (!frame.valid) {
+    return;
   }
 
   // Read Input References for motors
-  if (motor_input_reference_.size() == n_out_max) {
-    motor_input_reference_.resize(n_motors);
-    std::cerr << "resizing motor_input_reference to " << n_motors << std::endl;
+  for (int i = 0; i < motor_input_reference_.size(); i++) {
+    motor_input_reference_[i] = frame.armed ? frame.controls[i] : 0.0;
   }
 
-  for (int i = 0; i < motor_input_reference_.size(); i++) {
-    if (armed) {
-      motor_input_reference_[i] = actuator_controls[i];
-    } else {
-      motor_input_reference_[i] = 0;
-    }
+  for (unsigned i = 0; i < n_servos_; i++) {
+    servo_input_reference_[i] = frame.controls[servo_input_index_[i]];
   }
 
   received_first_actuator_ = mavlink_interface_->GetReceivedFirstActuator();
@@ -494,12 +925,36 @@ void GazeboMavlinkInterface::PublishMotorVelocities(
   motor_velocity_pub_.Publish(motor_velocity_message_);
 }
 
-void GazeboMavlinkInterface::PublishServoVelocities(const Eigen::VectorXd &_vels)
+void GazeboMavlinkInterface::PublishServoVelocities(const gz::sim::UpdateInfo &_info,
+    const Eigen::VectorXd &_vels)
 {
+  // Unchanged positions are only re-sent once per keep-alive period
+  const bool keepalive = (_info.simTime - last_servo_pub_time_ >= servo_keepalive_period_);
+  if (keepalive) {
+    last_servo_pub_time_ = _info.simTime;
+  }
+
+  if (servo_batch_pub_.Valid()) {
+    bool changed = keepalive;
+    for (int i = 0; i < _vels.size(); i++) {
+      if (servo_position_message_.position(i) != _vels(i)) {
+        servo_position_message_.set_position(i, _vels(i));
+        changed = true;
+      }
+    }
+    if (changed) {
+      servo_batch_pub_.Publish(servo_position_message_);
+    }
+    return;
+  }
+
   for (int i = 0; i < _vels.size(); i++) {
-    gz::msgs::Double servo_input;
-    servo_input.set_data(_vels(i));
-    servo_control_pub_[i].Publish(servo_input);
+    if (keepalive || servo_last_published_[i] != _vels(i)) {
+      gz::msgs::Double servo_input;
+      servo_input.set_data(_vels(i));
+      servo_control_pub_[i].Publish(servo_input);
+      servo_last_published_[i] = _vels(i);
+    }
   }
 }
 
@@ -518,16 +973,26 @@ bool GazeboMavlinkInterface::resolveHostName()
 {
   if (!mavlink_hostname_str_.empty()) {
     gzmsg << "Try to resolve hostname: '"  << mavlink_hostname_str_ << "'" << std::endl;
-    hostptr_ = gethostbyname(mavlink_hostname_str_.c_str());
-    if (hostptr_ && hostptr_->h_length && hostptr_->h_addrtype == AF_INET) {
-      struct in_addr **addr_l = (struct in_addr **)hostptr_->h_addr_list;
-      char *addr_str = inet_ntoa(*addr_l[0]);
-      std::string ip_addr = std::string(addr_str);
-      mavlink_interface_->SetMavlinkAddr(ip_addr);
-      gzmsg << "Host name '" << mavlink_hostname_str_ << "' resolved to IP: " << ip_addr << std::endl;
-      return true;
-    }
-    return false;
+    // IPv4 or IPv6, whichever the resolver prefers for this host
+    struct addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    struct addrinfo *result = nullptr;
+    const int err = getaddrinfo(mavlink_hostname_str_.c_str(), nullptr, &hints, &result);
+    if (err != 0) {
+      gzwarn << "Cannot resolve '" << mavlink_hostname_str_ << "': " << gai_strerror(err) << std::endl;
+      return false;
+    }
+    char addr_str[NI_MAXHOST] = {0};
+    const int name_err = getnameinfo(result->ai_addr, result->ai_addrlen, addr_str, sizeof(addr_str),
+        nullptr, 0, NI_NUMERICHOST);
+    freeaddrinfo(result);
+    if (name_err != 0) {
+      return false;
+    }
+    std::string ip_addr = std::string(addr_str);
+    mavlink_interface_->SetMavlinkAddr(ip_addr);
+    gzmsg << "Host name '" << mavlink_hostname_str_ << "' resolved to IP: " << ip_addr << std::endl;
+    return true;
   } else {
     // Assume resolved in case hostname is not given at all
     return true;
@@ -538,19 +1003,21 @@ bool GazeboMavlinkInterface::resolveHostName()
 void GazeboMavlinkInterface::ResolveWorker()
 {
   gzmsg << "[ResolveWorker] Start Resolving hostname" << std::endl;
+  // The host (e.g. a PX4 container) may only just be coming up, retry soon
+  // and back off to once a second
+  std::chrono::milliseconds retry{kResolveRetryMin};
   while (!resolveHostName()) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    std::this_thread::sleep_for(retry);
+    retry = std::min(2 * retry, kResolveRetryMax);
+    if (gotSigInt_ || stop_resolver_) {
+      return;
+    }
   }
   gzmsg << "[ResolveWorker] --> load mavlink_interface_" << std::endl;
   mavlink_interface_->Load();
   mavlink_loaded_ = true;
 }
 
-float GazeboMavlinkInterface::AddSimpleNoise(float value, float mean, float stddev) {
-  std::normal_distribution<float> dist(mean, stddev);
-  return value + dist(rnd_gen_);
-}
-
 void GazeboMavlinkInterface::RotateQuaternion(gz::math::Quaterniond &q_FRD_to_NED,
     const gz::math::Quaterniond q_FLU_to_ENU)
 {
@@ -570,47 +1037,84 @@ void GazeboMavlinkInterface::RotateQuaternion(gz::math::Quaterniond &q_FRD_to_NE
 	q_FRD_to_NED = q_ENU_to_NED * q_FLU_to_ENU * q_FLU_to_FRD.Inverse();
 }
 
-void GazeboMavlinkInterface::ParseMulticopterMotorModelPlugins(const std::string &sdfFilePath)
+//! (motorNumber, maxRotVelocity) of the MulticopterMotorModel plugins of a model
+using MotorVelocityScalings = std::vector<std::pair<int, double>>;
+
+static void CollectMotorVelocityScalings(const sdf::Model &_model, MotorVelocityScalings *_scalings)
 {
-  // Load the SDF file
-  sdf::Root root;
-  sdf::Errors errors = root.Load(sdfFilePath);
-  if (!errors.empty())
+  for (const sdf::Plugin &plugin : _model.Plugins())
   {
-    for (const auto &error : errors)
+    if (plugin.Name() == "gz::sim::systems::MulticopterMotorModel" &&
+        plugin.Element()->HasElement("motorNumber") && plugin.Element()->HasElement("maxRotVelocity"))
     {
-      gzerr << "[gazebo_mavlink_interface] Error: " << error.Message() << std::endl;
+      _scalings->emplace_back(plugin.Element()->Get<int>("motorNumber"),
+                              plugin.Element()->Get<double>("maxRotVelocity"));
     }
-    return;
   }
-
-  // Load the model
-  const sdf::Model *model = root.Model();
-  if (!model)
+  for (uint64_t i = 0; i < _model.ModelCount(); i++)
   {
-    gzerr << "[gazebo_mavlink_interface] No models found in SDF file." << std::endl;
-    return;
+    CollectMotorVelocityScalings(*_model.ModelByIndex(i), _scalings);
   }
+}
 
-  // Iterate through all plugins in the model
-  for (const sdf::Plugin plugin : model->Plugins())
-  {
-    // Check if the plugin is a MulticopterMotorModel
-    if (plugin.Name() == "gz::sim::systems::MulticopterMotorModel") {
-      if (plugin.Element()->HasElement("motorNumber"))
+// Fallback for models without a ModelSdf component, per source file so
+// that the file is parsed once
+static std::mutex motor_scalings_cache_mtx;
+static std::unordered_map<std::string, MotorVelocityScalings> motor_scalings_cache;
+
+void GazeboMavlinkInterface::LoadMotorVelocityScalings(const gz::sim::EntityComponentManager &_ecm)
+{
+  const auto start = std::chrono::steady_clock::now();
+
+  MotorVelocityScalings scalings;
+  const char *origin = nullptr;
+
+  // The SDF this model was created from, with spawn-time changes, so it
+  // always takes precedence over the file
+  const auto *model_sdf = _ecm.Component<gz::sim::components::ModelSdf>(entity_);
+  if (model_sdf) {
+    CollectMotorVelocityScalings(model_sdf->Data(), &scalings);
+    origin = "model SDF";
+  } else {
+    const std::string source = model_.SourceFilePath(_ecm);
+    if (source.empty()) {
+      gzerr << "[gazebo_mavlink_interface] No SDF for model " << model_name_
+            << ", motor velocity scalings left at their defaults" << std::endl;
+      return;
+    }
+
+    const std::lock_guard<std::mutex> lock(motor_scalings_cache_mtx);
+    auto it = motor_scalings_cache.find(source);
+    if (it != motor_scalings_cache.end()) {
+      scalings = it->second;
+      origin = "cached model file";
+    } else {
+      sdf::Root root;
+      const sdf::Errors errors = root.Load(source);
+      for (const auto &error : errors)
       {
-        const int motorNumber = plugin.Element()->Get<int>("motorNumber");
-        if (motorNumber >= n_out_max)
-        {
-          gzerr << "[gazebo_mavlink_interface] Motor number " << motorNumber
-            << " exceeds maximum number of motors " << n_out_max << std::endl;
-          continue;
-        }
-        if (plugin.Element()->HasElement("motorNumber"))
-        {
-          motor_vel_scalings_[motorNumber] = plugin.Element()->Get<double>("maxRotVelocity");
-        }
+        gzerr << "[gazebo_mavlink_interface] Error: " << error.Message() << std::endl;
+      }
+      if (errors.empty() && root.Model()) {
+        CollectMotorVelocityScalings(*root.Model(), &scalings);
       }
+      motor_scalings_cache.emplace(source, scalings);
+      origin = "model file";
     }
   }
+
+  for (const auto &scaling : scalings)
+  {
+    if (scaling.first < 0 || scaling.first >= static_cast<int>(n_out_max))
+    {
+      gzerr << "[gazebo_mavlink_interface] Motor number " << scaling.first
+        << " exceeds maximum number of motors " << n_out_max << std::endl;
+      continue;
+    }
+    motor_vel_scalings_[scaling.first] = scaling.second;
+  }
+
+  gzmsg << "Motor velocity scalings of " << scalings.size() << " motors from " << origin << " in "
+        << std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()
+        << " us" << std::endl;
 }
@@ -0,0 +1,213 @@
+#include "io_reactor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+std::mutex IoReactor::instance_mtx_;
+std::weak_ptr<IoReactor> IoReactor::instance_;
+
+std::shared_ptr<IoReactor> IoReactor::Acquire(size_t num_threads, const ThreadPlacement &placement) {
+  const std::lock_guard<std::mutex> lock(instance_mtx_);
+
+  std::shared_ptr<IoReactor> reactor = instance_.lock();
+  if (reactor) {
+    if (num_threads != reactor->NumThreads()) {
+      std::cerr << "IoReactor already running with " << reactor->NumThreads()
+                << " threads, ignoring request for " << num_threads << std::endl;
+    }
+    return reactor;
+  }
+
+  reactor.reset(new IoReactor(std::max<size_t>(num_threads, 1), placement));
+  instance_ = reactor;
+  return reactor;
+}
+
+IoReactor::IoReactor(size_t num_threads, const ThreadPlacement &placement) :
+  placement_(placement)
+{
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    std::cerr << "epoll_create1 failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ < 0) {
+    std::cerr << "eventfd failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+
+  // Level triggered and never read: once signalled it wakes every thread
+  struct epoll_event ev {};
+  ev.events = EPOLLIN;
+  ev.data.u64 = kWakeId;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) < 0) {
+    std::cerr << "epoll_ctl failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+
+  std::cout << "Starting shared MAVLink I/O reactor with " << num_threads << " threads" << std::endl;
+
+  threads_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; i++) {
+    threads_.emplace_back([this, i] () {
+      Worker(i);
+    });
+  }
+}
+
+IoReactor::~IoReactor() {
+  stop_ = true;
+  const uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) < 0) {
+    std::cerr << "IoReactor wake-up failed: " << strerror(errno) << std::endl;
+  }
+
+  for (auto &thread : threads_) {
+    if (thread.get_id() == std::this_thread::get_id()) {
+      thread.detach();
+    } else if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  ::close(wake_fd_);
+  ::close(epoll_fd_);
+}
+
+uint64_t IoReactor::Register(int fd, uint32_t events, Handler handler) {
+  auto reg = std::make_shared<Registration>();
+  reg->fd = fd;
+  reg->events = events;
+  reg->handler = std::move(handler);
+
+  uint64_t id;
+  {
+    const std::lock_guard<std::mutex> lock(regs_mtx_);
+    id = next_id_++;
+    regs_.emplace(id, reg);
+  }
+
+  struct epoll_event ev {};
+  ev.events = events | EPOLLONESHOT;
+  ev.data.u64 = id;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    std::cerr << "IoReactor: watching fd " << fd << " failed: " << strerror(errno) << std::endl;
+    const std::lock_guard<std::mutex> lock(regs_mtx_);
+    regs_.erase(id);
+    return 0;
+  }
+
+  return id;
+}
+
+void IoReactor::Unregister(uint64_t id) {
+  std::shared_ptr<Registration> reg;
+  {
+    const std::lock_guard<std::mutex> lock(regs_mtx_);
+    auto it = regs_.find(id);
+    if (it == regs_.end()) {
+      return;
+    }
+    reg = it->second;
+    regs_.erase(it);
+  }
+
+  // Waits for a handler that is already running on another thread, which
+  // would otherwise re-arm the descriptor after it has been removed
+  const std::lock_guard<std::mutex> lock(reg->mtx);
+  reg->active = false;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, reg->fd, nullptr);
+}
+
+void IoReactor::Arm(uint64_t id, uint32_t events) {
+  std::shared_ptr<Registration> reg;
+  {
+    const std::lock_guard<std::mutex> lock(regs_mtx_);
+    auto it = regs_.find(id);
+    if (it == regs_.end()) {
+      return;
+    }
+    reg = it->second;
+  }
+
+  // After a running handler has re-armed it, so the extra events are not overwritten
+  const std::lock_guard<std::mutex> lock(reg->mtx);
+  if (!reg->active) {
+    return;
+  }
+  struct epoll_event ev {};
+  ev.events = reg->events | events | EPOLLONESHOT;
+  ev.data.u64 = id;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, reg->fd, &ev) < 0) {
+    std::cerr << "IoReactor: arming fd " << reg->fd << " failed: " << strerror(errno) << std::endl;
+  }
+}
+
+void IoReactor::Worker(size_t index) {
+  char thrd_name[64] = {0};
+  sprintf(thrd_name, "MAV_IO_%zu", index);
+  pthread_setname_np(pthread_self(), thrd_name);
+  ApplyThreadPlacement(thrd_name, placement_);
+
+  struct epoll_event events[kMaxEvents];
+
+  while (!stop_) {
+    const int n = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "[" << thrd_name << "] epoll_wait error: " << strerror(errno) << std::endl;
+      break;
+    }
+
+    for (int i = 0; i < n && !stop_; i++) {
+      if (events[i].data.u64 != kWakeId) {
+        Dispatch(events[i].data.u64, events[i].events);
+      }
+    }
+  }
+}
+
+void IoReactor::Dispatch(uint64_t id, uint32_t events) {
+  std::shared_ptr<Registration> reg;
+  {
+    const std::lock_guard<std::mutex> lock(regs_mtx_);
+    auto it = regs_.find(id);
+    if (it == regs_.end()) {
+      return;
+    }
+    reg = it->second;
+  }
+
+  const std::lock_guard<std::mutex> lock(reg->mtx);
+  if (!reg->active) {
+    return;
+  }
+
+  if (!reg->handler(events)) {
+    reg->active = false;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, reg->fd, nullptr);
+    const std::lock_guard<std::mutex> regs_lock(regs_mtx_);
+    regs_.erase(id);
+    return;
+  }
+
+  // Re-arm the one-shot descriptor for the next event
+  struct epoll_event ev {};
+  ev.events = reg->events | EPOLLONESHOT;
+  ev.data.u64 = id;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, reg->fd, &ev) < 0) {
+    std::cerr << "IoReactor: re-arming fd " << reg->fd << " failed: " << strerror(errno) << std::endl;
+  }
+}
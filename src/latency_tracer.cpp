@@ -0,0 +1,214 @@
+#include "latency_tracer.h"
+
+#include <algorithm>
+#include <development/mavlink.h>
+#include <iomanip>
+
+/*******************************************************
+ * LatencyHistogram
+ */
+
+unsigned LatencyHistogram::BucketIndex(uint64_t value) {
+  if (value < kSubBuckets) {
+    return static_cast<unsigned>(value);
+  }
+  const uint64_t max_value = (uint64_t(1) << kMaxMagnitude) - 1;
+  if (value > max_value) {
+    value = max_value;
+  }
+  const unsigned msb = 63 - __builtin_clzll(value);
+  const unsigned shift = msb - kSubBucketBits;
+  const unsigned sub = static_cast<unsigned>(value >> shift) - kSubBuckets;
+  return kSubBuckets + shift * kSubBuckets + sub;
+}
+
+int64_t LatencyHistogram::BucketUpperBound(unsigned index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  const unsigned shift = (index - kSubBuckets) / kSubBuckets;
+  const unsigned sub = (index - kSubBuckets) % kSubBuckets;
+  const int64_t lower = static_cast<int64_t>(kSubBuckets + sub) << shift;
+  return lower + (int64_t(1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(int64_t ns) {
+  if (ns < 0) {
+    ns = 0;
+  }
+  counts_[BucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(ns, std::memory_order_relaxed);
+
+  int64_t max = max_.load(std::memory_order_relaxed);
+  while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+  }
+}
+
+double LatencyHistogram::Mean() const {
+  const uint64_t count = Count();
+  return count ? static_cast<double>(sum_.load(std::memory_order_relaxed)) / count : 0.0;
+}
+
+int64_t LatencyHistogram::Percentile(double q) const {
+  const uint64_t count = Count();
+  if (count == 0) {
+    return 0;
+  }
+  const uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(q * count + 0.5));
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < kBuckets; i++) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen >= target) {
+      return std::min(BucketUpperBound(i), Max());
+    }
+  }
+  return Max();
+}
+
+void LatencyHistogram::Add(const LatencyHistogram &other) {
+  for (unsigned i = 0; i < kBuckets; i++) {
+    counts_[i].fetch_add(other.counts_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+  count_.fetch_add(other.Count(), std::memory_order_relaxed);
+  sum_.fetch_add(other.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+  const int64_t other_max = other.Max();
+  int64_t max = max_.load(std::memory_order_relaxed);
+  while (other_max > max && !max_.compare_exchange_weak(max, other_max, std::memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::Reset() {
+  for (auto &c : counts_) {
+    c.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+/*******************************************************
+ * LatencyTracer
+ */
+
+bool LatencyTracer::SensorSeq(const MsgBuffer &buffer, uint8_t *seq) {
+  uint32_t msgid;
+  if (buffer.data[0] == MAVLINK_STX && buffer.len >= MAVLINK_NUM_HEADER_BYTES) {
+    msgid = buffer.data[7] | (buffer.data[8] << 8) | (buffer.data[9] << 16);
+    *seq = buffer.data[4];
+  } else if (buffer.data[0] == MAVLINK_STX_MAVLINK1 && buffer.len >= 6) {
+    msgid = buffer.data[5];
+    *seq = buffer.data[2];
+  } else {
+    return false;
+  }
+  return msgid == MAVLINK_MSG_ID_HIL_SENSOR;
+}
+
+const char *LatencyTracer::StageName(LatencyStage stage) {
+  switch (stage) {
+  case LatencyStage::sensor_queue:
+    return "sensor_queue";
+  case LatencyStage::sensor_send:
+    return "sensor_send";
+  case LatencyStage::px4_round_trip:
+    return "px4_round_trip";
+  case LatencyStage::rx_wakeup:
+    return "rx_wakeup";
+  case LatencyStage::actuator_queue:
+    return "actuator_queue";
+  case LatencyStage::actuator_apply:
+    return "actuator_apply";
+  case LatencyStage::step_total:
+    return "step_total";
+  default:
+    return "unknown";
+  }
+}
+
+void LatencyTracer::SensorEmitted(uint8_t seq, int64_t now) {
+  sensor_emit_ns_[seq].store(now, std::memory_order_relaxed);
+}
+
+void LatencyTracer::SensorDequeued(uint8_t seq, int64_t now) {
+  const int64_t emitted = sensor_emit_ns_[seq].load(std::memory_order_relaxed);
+  if (emitted > 0) {
+    Hist(LatencyStage::sensor_queue).Record(now - emitted);
+  }
+  sensor_dequeue_ns_[seq].store(now, std::memory_order_relaxed);
+}
+
+void LatencyTracer::SensorSent(uint8_t seq, int64_t now) {
+  const int64_t dequeued = sensor_dequeue_ns_[seq].load(std::memory_order_relaxed);
+  if (dequeued > 0) {
+    Hist(LatencyStage::sensor_send).Record(now - dequeued);
+  }
+  last_sent_emit_ns_.store(sensor_emit_ns_[seq].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  last_sent_ns_.store(now, std::memory_order_relaxed);
+}
+
+void LatencyTracer::ActuatorReceived(int64_t rx_stamp) {
+  const int64_t sent = last_sent_ns_.load(std::memory_order_relaxed);
+  if (sent > 0) {
+    Hist(LatencyStage::px4_round_trip).Record(rx_stamp - sent);
+  }
+
+  int64_t *slot = actuator_rx_stamps_.Back();
+  if (slot) {
+    *slot = rx_stamp;
+    actuator_rx_stamps_.Push();
+  }
+}
+
+void LatencyTracer::ActuatorDequeued(int64_t now) {
+  const int64_t *rx_stamp = actuator_rx_stamps_.Front();
+  if (rx_stamp) {
+    Hist(LatencyStage::actuator_queue).Record(now - *rx_stamp);
+    actuator_rx_stamps_.Pop();
+  }
+  actuator_dequeue_ns_ = now;
+}
+
+void LatencyTracer::ActuatorApplied(int64_t now) {
+  if (actuator_dequeue_ns_ > 0) {
+    Hist(LatencyStage::actuator_apply).Record(now - actuator_dequeue_ns_);
+  }
+  const int64_t emitted = last_sent_emit_ns_.load(std::memory_order_relaxed);
+  if (emitted > 0) {
+    Hist(LatencyStage::step_total).Record(now - emitted);
+  }
+}
+
+bool LatencyTracer::Empty() const {
+  for (const auto &hist : stages_) {
+    if (hist.Count() > 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void LatencyTracer::Dump(std::ostream &os) const {
+  os << "MAVLink latency [us]       count      mean       p50       p90       p99       max" << std::endl;
+  for (size_t i = 0; i < kNumStages; i++) {
+    const LatencyHistogram &hist = stages_[i];
+    if (hist.Count() == 0) {
+      continue;
+    }
+    os << "  " << std::left << std::setw(18) << StageName(static_cast<LatencyStage>(i)) << std::right
+       << std::setw(12) << hist.Count() << std::fixed << std::setprecision(1)
+       << std::setw(10) << hist.Mean() * 1e-3
+       << std::setw(10) << hist.Percentile(0.50) * 1e-3
+       << std::setw(10) << hist.Percentile(0.90) * 1e-3
+       << std::setw(10) << hist.Percentile(0.99) * 1e-3
+       << std::setw(10) << hist.Max() * 1e-3 << std::endl;
+  }
+  os << std::defaultfloat;
+}
+
+void LatencyTracer::Reset() {
+  for (auto &hist : stages_) {
+    hist.Reset();
+  }
+}
@@ -0,0 +1,212 @@
+#include "link_recorder.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr size_t kMinCapacity = 4096;
+
+static size_t AlignedEntrySize(size_t len) {
+  const size_t size = sizeof(LinkRecordEntry) + len;
+  return (size + kLinkRecordAlign - 1) & ~(kLinkRecordAlign - 1);
+}
+
+/*******************************************************
+ * LinkRecorder
+ */
+
+bool LinkRecorder::Open(const std::string &path, size_t capacity) {
+  Close();
+
+  const std::lock_guard<std::mutex> lock(mutex_);
+  path_ = path;
+  capacity = std::max(capacity, kMinCapacity);
+
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    std::cerr << "LinkRecorder: cannot create " << path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  if (ftruncate(fd_, capacity) != 0) {
+    std::cerr << "LinkRecorder: cannot size " << path << ": " << strerror(errno) << std::endl;
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  void *map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    std::cerr << "LinkRecorder: cannot map " << path << ": " << strerror(errno) << std::endl;
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  map_ = static_cast<uint8_t *>(map);
+  capacity_ = capacity;
+
+  LinkRecordFileHeader header {};
+  memcpy(header.magic, kLinkRecordMagic, sizeof(header.magic));
+  header.version = kLinkRecordVersion;
+  header.entry_align = kLinkRecordAlign;
+  memcpy(map_, &header, sizeof(header));
+
+  used_ = sizeof(LinkRecordFileHeader);
+  entries_ = 0;
+  failed_ = false;
+  return true;
+}
+
+bool LinkRecorder::Grow(size_t min_capacity) {
+  size_t capacity = capacity_;
+  while (capacity < min_capacity) {
+    capacity *= 2;
+  }
+  if (ftruncate(fd_, capacity) != 0) {
+    return false;
+  }
+  void *map = mremap(map_, capacity_, capacity, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  map_ = static_cast<uint8_t *>(map);
+  capacity_ = capacity;
+  return true;
+}
+
+void LinkRecorder::Append(LinkDirection direction, uint64_t sim_time_usec, const uint8_t *frame, size_t len) {
+  struct timespec ts {};
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (!map_ || failed_) {
+    return;
+  }
+
+  const size_t size = AlignedEntrySize(len);
+  if (used_ + size > capacity_ && !Grow(used_ + size)) {
+    std::cerr << "LinkRecorder: cannot grow " << path_ << ": " << strerror(errno)
+              << ", recording stopped after " << entries_ << " frames" << std::endl;
+    failed_ = true;
+    return;
+  }
+
+  LinkRecordEntry entry {};
+  entry.sim_time_usec = sim_time_usec;
+  entry.wall_time_ns = static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  entry.len = static_cast<uint16_t>(len);
+  entry.direction = direction;
+
+  uint8_t *dst = map_ + used_;
+  memcpy(dst, &entry, sizeof(entry));
+  memcpy(dst + sizeof(entry), frame, len);
+  used_ += size;
+  entries_++;
+
+  // Publish the entry only once it's complete, readers stop at data_bytes
+  auto *header = reinterpret_cast<LinkRecordFileHeader *>(map_);
+  __atomic_store_n(&header->data_bytes, used_ - sizeof(LinkRecordFileHeader), __ATOMIC_RELEASE);
+}
+
+void LinkRecorder::Close() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  if (map_) {
+    munmap(map_, capacity_);
+    map_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    if (ftruncate(fd_, used_) != 0) {
+      std::cerr << "LinkRecorder: cannot trim " << path_ << ": " << strerror(errno) << std::endl;
+    }
+    ::close(fd_);
+    fd_ = -1;
+  }
+  capacity_ = 0;
+}
+
+/*******************************************************
+ * LinkReplayer
+ */
+
+bool LinkReplayer::Open(const std::string &path) {
+  Close();
+  path_ = path;
+
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "LinkReplayer: cannot open " << path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(LinkRecordFileHeader)) {
+    std::cerr << "LinkReplayer: " << path << " is not a link recording" << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    std::cerr << "LinkReplayer: cannot map " << path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  map_ = static_cast<const uint8_t *>(map);
+  map_size_ = st.st_size;
+  madvise(map, map_size_, MADV_SEQUENTIAL);
+
+  LinkRecordFileHeader header;
+  memcpy(&header, map_, sizeof(header));
+  if (memcmp(header.magic, kLinkRecordMagic, sizeof(header.magic)) != 0 ||
+      header.version != kLinkRecordVersion || header.entry_align != kLinkRecordAlign) {
+    std::cerr << "LinkReplayer: " << path << " is not a version " << kLinkRecordVersion
+              << " link recording" << std::endl;
+    Close();
+    return false;
+  }
+
+  offset_ = sizeof(LinkRecordFileHeader);
+  end_ = offset_ + std::min<uint64_t>(header.data_bytes, map_size_ - offset_);
+  consumed_ = 0;
+  return true;
+}
+
+void LinkReplayer::Close() {
+  if (map_) {
+    munmap(const_cast<uint8_t *>(map_), map_size_);
+    map_ = nullptr;
+  }
+  map_size_ = offset_ = end_ = 0;
+}
+
+bool LinkReplayer::Peek(LinkRecordEntry *entry, const uint8_t **frame) const {
+  if (offset_ + sizeof(LinkRecordEntry) > end_) {
+    return false;
+  }
+  memcpy(entry, map_ + offset_, sizeof(*entry));
+  if (offset_ + AlignedEntrySize(entry->len) > end_) {
+    return false;
+  }
+  *frame = map_ + offset_ + sizeof(LinkRecordEntry);
+  return true;
+}
+
+bool LinkReplayer::AtEnd() const {
+  LinkRecordEntry entry;
+  const uint8_t *frame;
+  return !Peek(&entry, &frame);
+}
+
+void LinkReplayer::Advance() {
+  LinkRecordEntry entry;
+  const uint8_t *frame;
+  if (Peek(&entry, &frame)) {
+    offset_ += AlignedEntrySize(entry.len);
+    consumed_++;
+  } else {
+    offset_ = end_;
+  }
+}
@@ -0,0 +1,167 @@
+#include "lockstep_barrier.h"
+
+#include <algorithm>
+#include <iostream>
+
+std::mutex LockstepBarrier::instance_mtx_;
+std::weak_ptr<LockstepBarrier> LockstepBarrier::instance_;
+
+std::shared_ptr<LockstepBarrier> LockstepBarrier::Acquire() {
+  const std::lock_guard<std::mutex> lock(instance_mtx_);
+
+  std::shared_ptr<LockstepBarrier> barrier = instance_.lock();
+  if (!barrier) {
+    barrier.reset(new LockstepBarrier());
+    instance_ = barrier;
+  }
+  return barrier;
+}
+
+LockstepMemberState LockstepBarrier::Member::State() {
+  const std::lock_guard<std::mutex> lock(state_mtx);
+  return state ? state() : LockstepMemberState::idle;
+}
+
+uint64_t LockstepBarrier::Join(const std::string &name, StateFn state, std::chrono::microseconds timeout) {
+  auto member = std::make_shared<Member>();
+  member->name = name;
+  member->timeout = timeout;
+  member->state = std::move(state);
+
+  const std::lock_guard<std::mutex> lock(members_mtx_);
+  member->id = next_id_++;
+  members_.push_back(member);
+  return member->id;
+}
+
+void LockstepBarrier::Leave(uint64_t id) {
+  std::shared_ptr<Member> member;
+  {
+    const std::lock_guard<std::mutex> lock(members_mtx_);
+    auto it = std::find_if(members_.begin(), members_.end(),
+      [id](const std::shared_ptr<Member> &m) { return m->id == id; });
+    if (it == members_.end()) {
+      return;
+    }
+    member = *it;
+    members_.erase(it);
+
+    const LockstepLagStats &stats = member->stats;
+    if (stats.steps > 0) {
+      std::cout << "Lockstep barrier: " << member->name << " lagged mean "
+                << 1e3 * stats.total_lag / stats.steps << " ms, max "
+                << 1e3 * stats.max_lag << " ms, slowest in " << stats.slowest << " of "
+                << stats.steps << " steps, " << stats.timeouts << " timeouts" << std::endl;
+    }
+  }
+
+  // A wait in progress may still hold the member, from now on it is idle
+  const std::lock_guard<std::mutex> lock(member->state_mtx);
+  member->state = nullptr;
+}
+
+LockstepLagStats LockstepBarrier::Stats(uint64_t id) {
+  const std::lock_guard<std::mutex> lock(members_mtx_);
+  for (const auto &m : members_) {
+    if (m->id == id) {
+      return m->stats;
+    }
+  }
+  return LockstepLagStats{};
+}
+
+std::chrono::steady_clock::time_point LockstepBarrier::Arrive(uint64_t step) {
+  if (stepped_ && step == step_) {
+    return deadline_;
+  }
+  stepped_ = true;
+  step_ = step;
+
+  const auto start = std::chrono::steady_clock::now();
+  std::chrono::microseconds timeout{0};
+  bool forever = false;
+  {
+    const std::lock_guard<std::mutex> lock(members_mtx_);
+    step_members_.assign(members_.begin(), members_.end());
+  }
+  // Only members with an unanswered HIL_SENSOR take part in the step
+  step_members_.erase(std::remove_if(step_members_.begin(), step_members_.end(),
+    [](const std::shared_ptr<Member> &m) { return m->State() == LockstepMemberState::idle; }),
+    step_members_.end());
+  for (const auto &m : step_members_) {
+    forever |= (m->timeout.count() <= 0);
+    timeout = std::max(timeout, m->timeout);
+  }
+  deadline_ = forever ? std::chrono::steady_clock::time_point::max() : start + timeout;
+
+  // Lag of each member behind start, negative while it is still pending
+  std::vector<double> &lag = step_lag_;
+  lag.assign(step_members_.size(), -1.0);
+  size_t pending = step_members_.size();
+  const auto done = [](const std::shared_ptr<Member> &m) {
+    return m->State() != LockstepMemberState::pending;
+  };
+  const auto any_done = [&]() {
+    for (size_t i = 0; i < step_members_.size(); i++) {
+      if (lag[i] < 0.0 && done(step_members_[i])) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  while (true) {
+    const auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < step_members_.size(); i++) {
+      if (lag[i] < 0.0 && done(step_members_[i])) {
+        lag[i] = std::chrono::duration<double>(now - start).count();
+        pending--;
+      }
+    }
+    if (pending == 0 || now >= deadline_) {
+      break;
+    }
+
+    std::unique_lock<std::mutex> wait_lock(wait_mtx_);
+    waiting_.store(true);
+    // Pairs with the fence in Notify(), as in MavlinkInterface::WaitForRecvMessage()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    wait_cv_.wait_until(wait_lock, deadline_, any_done);
+    waiting_.store(false);
+  }
+
+  const double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  {
+    // Members that left meanwhile are updated too, nobody reads them anymore
+    const std::lock_guard<std::mutex> lock(members_mtx_);
+    size_t slowest = step_members_.size();
+    double slowest_lag = 0.0;
+    for (size_t i = 0; i < step_members_.size(); i++) {
+      LockstepLagStats &stats = step_members_[i]->stats;
+      const bool timed_out = (lag[i] < 0.0);
+      const double member_lag = timed_out ? waited : lag[i];
+      stats.steps++;
+      stats.timeouts += timed_out;
+      stats.last_lag = member_lag;
+      stats.total_lag += member_lag;
+      stats.max_lag = std::max(stats.max_lag, member_lag);
+      if (member_lag > slowest_lag) {
+        slowest = i;
+        slowest_lag = member_lag;
+      }
+    }
+    if (slowest < step_members_.size()) {
+      step_members_[slowest]->stats.slowest++;
+    }
+  }
+  step_members_.clear();
+  return deadline_;
+}
+
+void LockstepBarrier::Notify() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiting_.load(std::memory_order_relaxed)) {
+    const std::lock_guard<std::mutex> lock(wait_mtx_);
+    wait_cv_.notify_one();
+  }
+}
@@ -1,5 +1,89 @@
 #include "mavlink_interface.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/net_tstamp.h>
+#include <linux/serial.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+
+static void SetNonBlocking(int fd) {
+  const int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    std::cerr << "fcntl O_NONBLOCK failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+}
+
+static void SetBlocking(int fd) {
+  const int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+    std::cerr << "fcntl ~O_NONBLOCK failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+}
+
+//! Fill @p addr from an IPv4 or IPv6 literal, returns its length or 0 if @p host is neither
+static socklen_t ParseSockAddr(const std::string &host, int port, sockaddr_storage *addr) {
+  memset(addr, 0, sizeof(*addr));
+  auto *in = reinterpret_cast<sockaddr_in *>(addr);
+  if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) == 1) {
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    return sizeof(sockaddr_in);
+  }
+  auto *in6 = reinterpret_cast<sockaddr_in6 *>(addr);
+  if (inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    return sizeof(sockaddr_in6);
+  }
+  return 0;
+}
+
+//! The wildcard address of @p family
+static socklen_t SockAddrAny(int family, int port, sockaddr_storage *addr) {
+  memset(addr, 0, sizeof(*addr));
+  if (family == AF_INET6) {
+    auto *in6 = reinterpret_cast<sockaddr_in6 *>(addr);
+    in6->sin6_family = AF_INET6;
+    in6->sin6_addr = in6addr_any;
+    in6->sin6_port = htons(port);
+    return sizeof(sockaddr_in6);
+  }
+  auto *in = reinterpret_cast<sockaddr_in *>(addr);
+  in->sin_family = AF_INET;
+  in->sin_addr.s_addr = htonl(INADDR_ANY);
+  in->sin_port = htons(port);
+  return sizeof(sockaddr_in);
+}
+
+//! Pending error of a socket, e.g. the outcome of a non-blocking connect()
+static int SocketError(int fd) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+    return errno;
+  }
+  return err;
+}
+
 MavlinkInterface::MavlinkInterface() {
+  tx_batch_.resize(kSendBatchSize);
+  // close() may run on a link that was never loaded, e.g. in the benchmarks
+  for (auto &pfd : fds_) {
+    pfd = { -1, 0, 0 };
+  }
+
+  RegisterMessageHandler(MAVLINK_MSG_ID_HEARTBEAT, [this](const mavlink_message_t *msg) {
+    handle_heartbeat(msg);
+  });
+  RegisterMessageHandler(MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS, [this](const mavlink_message_t *msg) {
+    handle_actuator_controls(msg);
+  });
 }
 
 MavlinkInterface::~MavlinkInterface() {
@@ -8,79 +92,117 @@ MavlinkInterface::~MavlinkInterface() {
 
 void MavlinkInterface::Load()
 {
-  mavlink_addr_ = htonl(INADDR_ANY);
-  if (mavlink_addr_str_ != "INADDR_ANY") {
-    mavlink_addr_ = inet_addr(mavlink_addr_str_.c_str());
-    if (mavlink_addr_ == INADDR_NONE) {
-      std::cerr << "Invalid mavlink_addr: " << mavlink_addr_str_ << ", aborting" << std::endl;
+  // An IPv4 or IPv6 literal, the plugin resolves host names beforehand
+  const bool any_addr = (mavlink_addr_str_ == "INADDR_ANY");
+  sockaddr_storage mavlink_addr {};
+  if (!any_addr && ParseSockAddr(mavlink_addr_str_, 0, &mavlink_addr) == 0) {
+    std::cerr << "Invalid mavlink_addr: " << mavlink_addr_str_ << ", aborting" << std::endl;
+    abort();
+  }
+  socket_family_ = any_addr ? AF_INET : mavlink_addr.ss_family;
+  const auto make_addr = [&](int port, sockaddr_storage *addr) {
+    return any_addr ? SockAddrAny(socket_family_, port, addr) : ParseSockAddr(mavlink_addr_str_, port, addr);
+  };
+
+  close_conn_ = false;
+  connection_lost_ = false;
+  connected_ = false;
+  connecting_fd_ = -1;
+  connect_retry_ = kConnectRetryMin;
+  next_connect_time_ = std::chrono::steady_clock::time_point{};
+
+  // Outgoing sequence numbers restart with every connection
+  encoder_.Reset(use_mavlink1_);
+
+  if (latency_tracing_) {
+    latency_tracer_.reset(new LatencyTracer(recv_buffer_size_));
+  }
+
+  if (!record_file_.empty()) {
+    recorder_.reset(new LinkRecorder());
+    if (!recorder_->Open(record_file_)) {
+      std::cerr << "Cannot record the MAVLink link to " << record_file_ << ", aborting" << std::endl;
       abort();
     }
+    std::cout << "Recording the MAVLink link to " << record_file_ << std::endl;
   }
 
-  // initialize sender status to zero
-  memset((char *)&sender_m_status_, 0, sizeof(sender_m_status_));
-
-  memset((char *)&remote_simulator_addr_, 0, sizeof(remote_simulator_addr_));
-  remote_simulator_addr_.sin_family = AF_INET;
-  remote_simulator_addr_len_ = sizeof(remote_simulator_addr_);
-
-  memset((char *)&local_simulator_addr_, 0, sizeof(local_simulator_addr_));
-  local_simulator_addr_.sin_family = AF_INET;
-  local_simulator_addr_len_ = sizeof(local_simulator_addr_);
-
-  if (use_tcp_) {
+  if (lock_memory_) {
+    LockProcessMemory();
+  }
 
-      if ((simulator_socket_fd_ = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        std::cerr << "Creating TCP socket failed: " << strerror(errno) << ", aborting" << std::endl;
-        abort();
-      }
+  if (busy_poll_ && !use_serial_ && !use_shm_) {
+    if (io_threads_ > 0) {
+      std::cerr << "busy_poll needs a receiver thread of its own, ignoring io_threads" << std::endl;
+      io_threads_ = 0;
+    }
+    if (receiver_placement_.cpus.empty()) {
+      std::cerr << "busy_poll without receiver_cpus, the receiver spins on whichever core it lands" << std::endl;
+    }
+    std::cout << "Busy-polling the MAVLink socket" << std::endl;
+  }
 
-      int yes = 1;
-      int result = setsockopt(simulator_socket_fd_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
-      if (result != 0) {
-        std::cerr << "setsockopt failed: " << strerror(errno) << ", aborting" << std::endl;
-        abort();
-      }
+  actuator_received_ = 0;
+  actuator_consumed_ = 0;
+  lockstep_armed_ = false;
+  if (enable_lockstep_ && use_lockstep_barrier_ && replay_file_.empty()) {
+    lockstep_barrier_ = LockstepBarrier::Acquire();
+    lockstep_barrier_id_ = lockstep_barrier_->Join(lockstep_barrier_name_,
+      [this]() { return LockstepState(); }, lockstep_timeout_);
+  }
 
-      struct linger nolinger {};
-      nolinger.l_onoff = 1;
-      nolinger.l_linger = 0;
+  if (!replay_file_.empty()) {
+    // No socket and no I/O threads, ReadMAVLinkMessages() reads the recording
+    replayer_.reset(new LinkReplayer());
+    if (!replayer_->Open(replay_file_)) {
+      std::cerr << "Cannot replay " << replay_file_ << ", aborting" << std::endl;
+      abort();
+    }
+    replay_finished_ = false;
+    std::cout << "Replaying the PX4 side of the link from " << replay_file_ << std::endl;
+    receiver_buffer_.Reset(recv_buffer_size_);
+    return;
+  }
 
-      result = setsockopt(simulator_socket_fd_, SOL_SOCKET, SO_LINGER, &nolinger, sizeof(nolinger));
-      if (result != 0) {
-        std::cerr << "setsockopt failed: " << strerror(errno) << ", aborting" << std::endl;
-        abort();
-      }
+  if (use_serial_) {
+    memset(fds_, 0, sizeof(fds_));
+    fds_[CONNECTION_FD].fd = -1;
+    receiver_buffer_.Reset(recv_buffer_size_);
+    open();
+    return;
+  }
 
-      // The socket reuse is necessary for reconnecting to the same address
-      // if the socket does not close but gets stuck in TIME_WAIT. This can happen
-      // if the server is suddenly closed, for example, if the robot is deleted in gazebo.
-      int socket_reuse = 1;
-      result = setsockopt(simulator_socket_fd_, SOL_SOCKET, SO_REUSEADDR, &socket_reuse, sizeof(socket_reuse));
-      if (result != 0) {
-        std::cerr << "setsockopt failed: " << strerror(errno) << ", aborting" << std::endl;
-        abort();
-      }
+  for (auto &pfd : fds_) {
+    pfd = { -1, 0, 0 };
+  }
 
-      // Same as above but for a given port
-      result = setsockopt(simulator_socket_fd_, SOL_SOCKET, SO_REUSEPORT, &socket_reuse, sizeof(socket_reuse));
-      if (result != 0) {
-        std::cerr << "setsockopt failed: " << strerror(errno) << ", aborting" << std::endl;
-        abort();
-      }
+  if (use_shm_) {
+    if (shm_name_.empty()) {
+      shm_name_ = "px4_mavlink_" + std::to_string(mavlink_tcp_port_);
+    }
+    shm_.reset(new ShmLink());
+    if (!shm_->Create(shm_name_)) {
+      std::cerr << "Cannot create the shared-memory link " << shm_name_ << ", aborting" << std::endl;
+      abort();
+    }
+    std::cout << "Waiting for PX4 on shared-memory link " << shm_->Path() << std::endl;
+    receiver_buffer_.Reset(recv_buffer_size_);
+    receiver_thread_ = std::thread([this] () {
+      ShmReceiveWorker();
+    });
+    return;
+  }
 
+  if (use_tcp_) {
     if (tcp_client_mode_) {
-      // TCP client mode
-      local_simulator_addr_.sin_addr.s_addr = htonl(INADDR_ANY);
-      local_simulator_addr_.sin_port = htons(0);
-      remote_simulator_addr_.sin_addr.s_addr = mavlink_addr_;
-      remote_simulator_addr_.sin_port = htons(mavlink_tcp_port_);
-      memset(fds_, 0, sizeof(fds_));
+      // TCP client mode, the receiving side connects and reconnects
+      remote_simulator_addr_len_ = make_addr(mavlink_tcp_port_, &remote_simulator_addr_);
     } else {
       // TCP server mode
-      local_simulator_addr_.sin_addr.s_addr = mavlink_addr_;
-      local_simulator_addr_.sin_port = htons(mavlink_tcp_port_);
+      local_simulator_addr_len_ = make_addr(mavlink_tcp_port_, &local_simulator_addr_);
+      remote_simulator_addr_len_ = sizeof(remote_simulator_addr_);
 
+      simulator_socket_fd_ = CreateTcpSocket();
       if (bind(simulator_socket_fd_, (struct sockaddr *)&local_simulator_addr_, local_simulator_addr_len_) < 0) {
         std::cerr << "bind failed: " << strerror(errno) << ", aborting" << std::endl;
         abort();
@@ -92,20 +214,19 @@ void MavlinkInterface::Load()
         abort();
       }
 
-      memset(fds_, 0, sizeof(fds_));
+      // Readiness is polled for, accept() itself must never block
+      SetNonBlocking(simulator_socket_fd_);
       fds_[LISTEN_FD].fd = simulator_socket_fd_;
       fds_[LISTEN_FD].events = POLLIN; // only listens for new connections on tcp
     }
   } else {
     // When connecting to HITL, we specify the port where the mavlink traffic originates from.
-    remote_simulator_addr_.sin_addr.s_addr = mavlink_addr_;
-    remote_simulator_addr_.sin_port = htons(mavlink_udp_remote_port_);
-    local_simulator_addr_.sin_addr.s_addr = htonl(INADDR_ANY);
-    local_simulator_addr_.sin_port = htons(mavlink_udp_local_port_);
+    remote_simulator_addr_len_ = make_addr(mavlink_udp_remote_port_, &remote_simulator_addr_);
+    local_simulator_addr_len_ = SockAddrAny(socket_family_, mavlink_udp_local_port_, &local_simulator_addr_);
 
     std::cout << "Creating UDP socket for HITL input on local port : " << mavlink_udp_local_port_ << " and remote port " << mavlink_udp_remote_port_ << std::endl;
 
-    if ((simulator_socket_fd_ = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    if ((simulator_socket_fd_ = socket(socket_family_, SOCK_DGRAM, 0)) < 0) {
       std::cerr << "Creating UDP socket failed: " << strerror(errno) << ", aborting" << std::endl;
       abort();
     }
@@ -114,13 +235,33 @@ void MavlinkInterface::Load()
       std::cerr << "bind failed: " << strerror(errno) << ", aborting" << std::endl;
       abort();
     }
+    ConfigureSocket(simulator_socket_fd_);
+    if (busy_poll_) {
+      SetNonBlocking(simulator_socket_fd_);
+    }
 
-    memset(fds_, 0, sizeof(fds_));
     fds_[CONNECTION_FD].fd = simulator_socket_fd_;
     fds_[CONNECTION_FD].events = POLLIN | POLLOUT; // read/write
 
   }
 
+  if (batched_receive_ && !use_tcp_) {
+    // Each recvmmsg slot gets an equal share of buf_
+    const size_t slot_size = sizeof(buf_) / kRecvBatchSize;
+    for (unsigned i = 0; i < kRecvBatchSize; i++) {
+      recv_iovecs_[i].iov_base = buf_ + i * slot_size;
+      recv_iovecs_[i].iov_len = slot_size;
+    }
+  }
+
+  // Preallocate the receive ring before the receiver thread starts producing
+  receiver_buffer_.Reset(recv_buffer_size_);
+
+  if (io_threads_ > 0) {
+    StartReactorIo();
+    return;
+  }
+
   // Start mavlink message receiver thread
   receiver_thread_ = std::thread([this] () {
     ReceiveWorker();
@@ -136,151 +277,484 @@ void MavlinkInterface::Load()
  * Receive buffer handling
  */
 
-std::shared_ptr<mavlink_message_t> MavlinkInterface::PopRecvMessage() {
-  std::shared_ptr<mavlink_message_t> msg(nullptr);
-  const std::lock_guard<std::mutex> guard(receiver_buff_mtx_);
-  if (!receiver_buffer_.empty()) {
-    msg = receiver_buffer_.front();
-    receiver_buffer_.pop();
-  }
-  return msg;
-}
-
 void MavlinkInterface::ReceiveWorker() {
   char thrd_name[64] = {0};
   sprintf(thrd_name, "MAV_Recver_%d", gettid());
   pthread_setname_np(pthread_self(), thrd_name);
+  ApplyThreadPlacement(thrd_name, receiver_placement_);
 
   std::cout << "[" << thrd_name << "] starts" << std::endl;
 
-  // Wait for connection:
-  if ((fds_[CONNECTION_FD].fd <= 0) && use_tcp_) {
-    // Client mode
+  if (use_tcp_) {
     std::cout << "[" << thrd_name << "] Wait for TCP connection.." << std::endl;
-    while (fds_[CONNECTION_FD].fd <= 0) {
-        if (!tcp_client_mode_) acceptConnections();
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  } else {
+    std::cout << "[" << thrd_name << "] Start receiving..." << std::endl;
+  }
+
+  while(!close_conn_ && !gotSigInt_) {
+    if (use_tcp_ && !connected_) {
+      WaitForConnection(thrd_name);
+      continue;
+    }
+    const bool received = ReceiveOnce(thrd_name);
+    if (connection_lost_) {
+      DropConnection(thrd_name);
+    } else if (busy_poll_ && !received) {
+      SpinPause();
     }
-    std::cout << "[" << thrd_name << "] TCP connection detected" << std::endl;
   }
+  std::cout << "The thread [" << thrd_name << "] was shutdown." << std::endl;
 
-  std::cout << "[" << thrd_name << "] Start receiving..." << std::endl;
+}
 
-  while(!close_conn_ && !gotSigInt_) {
-    int ret = recvfrom(fds_[CONNECTION_FD].fd, buf_, sizeof(buf_), 0, (struct sockaddr *)&remote_simulator_addr_, &remote_simulator_addr_len_);
-    if (ret < 0) {
-      std::cerr << "[" << thrd_name << "] recvfrom error: " << strerror(errno) << std::endl;
-      if (errno == ECONNRESET) {
-        close_conn_ = true;
+void MavlinkInterface::ShmReceiveWorker() {
+  char thrd_name[64] = {0};
+  sprintf(thrd_name, "MAV_ShmRecv_%d", gettid());
+  pthread_setname_np(pthread_self(), thrd_name);
+  ApplyThreadPlacement(thrd_name, receiver_placement_);
+
+  bool attached = false;
+  while (!close_conn_ && !gotSigInt_) {
+    // One frame per record, no framing state carried across records
+    const size_t len = shm_->Receive(buf_, sizeof(buf_), kShmReceiveTimeout);
+    if (latency_tracer_) {
+      rx_stamp_ns_ = LatencyTracer::Now();
+    }
+    if (attached != shm_->PeerAttached()) {
+      attached = !attached;
+      std::cout << "[" << thrd_name << "] PX4 " << (attached ? "attached to " : "detached from ")
+                << shm_->Path() << std::endl;
+    }
+    if (len > 0) {
+      ParseDatagram(buf_, len, thrd_name);
+    }
+  }
+  std::cout << "The thread [" << thrd_name << "] was shutdown." << std::endl;
+}
+
+bool MavlinkInterface::ReceiveOnce(const char *thrd_name) {
+  if (batched_receive_ && !use_tcp_) {
+    return ReceiveDatagramBatch(thrd_name) > 0;
+  }
+
+  remote_simulator_addr_len_ = sizeof(remote_simulator_addr_);
+  int ret;
+  const bool stamped = kernel_timestamps_ && latency_tracer_;
+  struct msghdr hdr {};
+  struct iovec iov {buf_, sizeof(buf_)};
+  if (stamped) {
+    hdr.msg_name = &remote_simulator_addr_;
+    hdr.msg_namelen = remote_simulator_addr_len_;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = recv_control_[0];
+    hdr.msg_controllen = kRecvControlLen;
+    ret = recvmsg(fds_[CONNECTION_FD].fd, &hdr, 0);
+    remote_simulator_addr_len_ = hdr.msg_namelen;
+  } else {
+    ret = recvfrom(fds_[CONNECTION_FD].fd, buf_, sizeof(buf_), 0, (struct sockaddr *)&remote_simulator_addr_, &remote_simulator_addr_len_);
+  }
+  if (latency_tracer_) {
+    rx_stamp_ns_ = LatencyTracer::Now();
+    if (stamped && ret > 0) {
+      rx_stamp_ns_ = KernelRxStamp(&hdr, rx_stamp_ns_);
+    }
+  }
+  if (ret < 0) {
+    // Nothing left on a non-blocking socket (reactor mode)
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return false;
+    }
+    if (close_conn_ || gotSigInt_) {
+      return false;
+    }
+    const int err = errno;
+    link_stats_.ReceiveErrors();
+    uint64_t suppressed;
+    if (recv_error_log_.Allow(&suppressed)) {
+      std::cerr << "[" << thrd_name << "] recvfrom error: " << strerror(err)
+                << RateLimitedLog::Suppressed(suppressed) << std::endl;
+    }
+    if (use_tcp_ && (err == ECONNRESET || err == ENOTCONN || err == ETIMEDOUT)) {
+      ConnectionLost();
+    }
+    return false;
+  }
+
+  // the peer closed the connection orderly, only makes sense on tcp
+  if (use_tcp_ && ret == 0) {
+    if (!close_conn_ && !gotSigInt_) {
+      std::cerr << "[" << thrd_name << "] Connection closed by peer." << std::endl;
+      ConnectionLost();
+    }
+    return false;
+  }
+
+  // data received
+  ParseBytes(buf_, ret, thrd_name);
+  return true;
+}
+
+int MavlinkInterface::ReceiveDatagramBatch(const char *thrd_name) {
+  const bool stamped = kernel_timestamps_ && latency_tracer_;
+  for (unsigned i = 0; i < kRecvBatchSize; i++) {
+    recv_msgs_[i].msg_hdr.msg_name = &recv_addrs_[i];
+    recv_msgs_[i].msg_hdr.msg_namelen = sizeof(recv_addrs_[i]);
+    recv_msgs_[i].msg_hdr.msg_iov = &recv_iovecs_[i];
+    recv_msgs_[i].msg_hdr.msg_iovlen = 1;
+    recv_msgs_[i].msg_hdr.msg_control = stamped ? recv_control_[i] : nullptr;
+    recv_msgs_[i].msg_hdr.msg_controllen = stamped ? kRecvControlLen : 0;
+    recv_msgs_[i].msg_hdr.msg_flags = 0;
+  }
+
+  // Block for the first datagram, then drain whatever else is pending
+  int ret = recvmmsg(fds_[CONNECTION_FD].fd, recv_msgs_, kRecvBatchSize, MSG_WAITFORONE, nullptr);
+  if (latency_tracer_) {
+    rx_stamp_ns_ = LatencyTracer::Now();
+  }
+  if (ret < 0) {
+    uint64_t suppressed;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      link_stats_.ReceiveErrors();
+      if (recv_error_log_.Allow(&suppressed)) {
+        std::cerr << "[" << thrd_name << "] recvmmsg error: " << strerror(errno)
+                  << RateLimitedLog::Suppressed(suppressed) << std::endl;
       }
-      continue;
     }
+    return 0;
+  }
 
-    // client closed the connection orderly, only makes sense on tcp
-    if (use_tcp_ && ret == 0) {
-      std::cerr << "[" << thrd_name << "] Connection closed by client." << std::endl;
-      close_conn_ = true;
+  const int64_t now = rx_stamp_ns_;
+  for (int i = 0; i < ret; i++) {
+    if (stamped) {
+      rx_stamp_ns_ = KernelRxStamp(&recv_msgs_[i].msg_hdr, now);
+    }
+    uint64_t suppressed;
+    if ((recv_msgs_[i].msg_hdr.msg_flags & MSG_TRUNC) && recv_error_log_.Allow(&suppressed)) {
+      std::cerr << "[" << thrd_name << "] Truncated datagram of more than "
+                << recv_iovecs_[i].iov_len << " bytes" << RateLimitedLog::Suppressed(suppressed) << std::endl;
+    }
+    ParseDatagram(static_cast<const uint8_t *>(recv_iovecs_[i].iov_base), recv_msgs_[i].msg_len, thrd_name);
+  }
+
+  // Reply to the sender of the latest datagram, as recvfrom() does
+  if (ret > 0) {
+    remote_simulator_addr_ = recv_addrs_[ret - 1];
+    remote_simulator_addr_len_ = recv_msgs_[ret - 1].msg_hdr.msg_namelen;
+  }
+  return ret;
+}
+
+int64_t MavlinkInterface::KernelRxStamp(struct msghdr *hdr, int64_t now) const {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING) {
       continue;
     }
+    // struct scm_timestamping, the software stamp comes first. It is on
+    // CLOCK_REALTIME, so only its age carries over to the steady clock.
+    struct timespec stamps[3];
+    memcpy(stamps, CMSG_DATA(cmsg), sizeof(stamps));
+    if (stamps[0].tv_sec == 0 && stamps[0].tv_nsec == 0) {
+      break;
+    }
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    const int64_t age = (real.tv_sec - stamps[0].tv_sec) * 1000000000LL + (real.tv_nsec - stamps[0].tv_nsec);
+    if (latency_tracer_ && age > 0) {
+      latency_tracer_->RxWakeup(age);
+    }
+    return now - std::max<int64_t>(age, 0);
+  }
+  return now;
+}
 
-    // data received
-    int len = ret;
-    mavlink_status_t status;
-    mavlink_message_t message;
+void MavlinkInterface::ParseBytes(const uint8_t *data, size_t len, const char *thrd_name) {
+  mavlink_status_t status;
+
+  // Frames are parsed straight into the next free ring slot. When the ring
+  // is full the frame lands in a scratch message and is dropped, so the
+  // frames already queued (actuator controls included) are preserved.
+  mavlink_message_t *slot = receiver_buffer_.Back();
+
+  // mavlink_frame_char_buffer() clears m_status_.parse_error on every call
+  // and reports the errors of that byte in status.packet_rx_drop_count, so
+  // they are summed per byte rather than read from m_status_
+  uint64_t parse_errors = 0;
+  uint64_t crc_failures = 0;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    mavlink_message_t *message = slot ? slot : &recv_overflow_msg_;
+    auto msg_received = static_cast<Framing>(mavlink_frame_char_buffer(&m_buffer_, &m_status_, data[i], message, &status));
+    parse_errors += status.packet_rx_drop_count;
+    if (msg_received == Framing::bad_crc || msg_received == Framing::bad_signature) {
+      parse_errors++;
+      crc_failures++;
+      _mav_parse_error(&m_status_);
+      m_status_.msg_received = MAVLINK_FRAMING_INCOMPLETE;
+      m_status_.parse_state = MAVLINK_PARSE_STATE_IDLE;
+      if (data[i] == MAVLINK_STX) {
+        m_status_.parse_state = MAVLINK_PARSE_STATE_GOT_STX;
+        m_buffer_.len = 0;
+        mavlink_start_checksum(&m_buffer_);
+      }
+    }
 
-    for(int i = 0; i < len; i++)
-    {
-      auto msg_received = static_cast<Framing>(mavlink_frame_char_buffer(&m_buffer_, &m_status_, buf_[i], &message, &status));
-      if (msg_received == Framing::bad_crc || msg_received == Framing::bad_signature) {
-        _mav_parse_error(&m_status_);
-        m_status_.msg_received = MAVLINK_FRAMING_INCOMPLETE;
-        m_status_.parse_state = MAVLINK_PARSE_STATE_IDLE;
-        if (buf_[i] == MAVLINK_STX) {
-          m_status_.parse_state = MAVLINK_PARSE_STATE_GOT_STX;
-          m_buffer_.len = 0;
-          mavlink_start_checksum(&m_buffer_);
-        }
+    if (msg_received == Framing::ok) {
+      // The byte-wise parser has already copied the payload, but the slot is
+      // reused rather than queued. The recording still keeps the frame.
+      if (!HasMessageHandler(message->msgid)) {
+        RecordReceived(message, LinkDirection::unhandled);
+        recv_filtered_.fetch_add(1, std::memory_order_relaxed);
+        continue;
       }
+      slot = CommitRecvSlot(slot, message, thrd_name);
+    }
+  }
+  link_stats_.ParseErrors(parse_errors);
+  link_stats_.CrcFailures(crc_failures);
+}
 
-      if (msg_received != Framing::incomplete) {
-        auto msg = std::make_shared<mavlink_message_t>(message);
-        const std::lock_guard<std::mutex> guard(receiver_buff_mtx_);
-        if (receiver_buffer_.size() > kMaxRecvBufferSize) {
-          std::cerr << "[" << thrd_name << "] Messages buffer overflow!" << std::endl;
-          // clear the buffer
-          while (!receiver_buffer_.empty()) {
-            receiver_buffer_.pop();
-          }
-        }
-        receiver_buffer_.push(msg);
+void MavlinkInterface::ParseDatagram(const uint8_t *data, size_t len, const char *thrd_name) {
+  const uint8_t *end = data + len;
+  mavlink_message_t *slot = receiver_buffer_.Back();
+
+  while (data < end) {
+    mavlink_message_t *message = slot ? slot : &recv_overflow_msg_;
+    uint8_t framing;
+    // While recording, frames without a handler are decoded too, so that
+    // the log holds every frame PX4 sent
+    data = ScanMavlinkFrame(data, end, message, &m_status_, &framing, [this](uint32_t msgid) {
+      if (recorder_ || HasMessageHandler(msgid)) {
+        return true;
+      }
+      recv_filtered_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    });
+    if (static_cast<Framing>(framing) == Framing::ok) {
+      if (!HasMessageHandler(message->msgid)) {
+        RecordReceived(message, LinkDirection::unhandled);
+        recv_filtered_.fetch_add(1, std::memory_order_relaxed);
+        continue;
       }
+      slot = CommitRecvSlot(slot, message, thrd_name);
     }
   }
-  std::cout << "The thread [" << thrd_name << "] was shutdown." << std::endl;
+  FoldParseStatus();
+}
+
+void MavlinkInterface::FoldParseStatus() {
+  // Both are narrow counters in mavlink_status_t, emptied after every
+  // datagram. ScanMavlinkFrame() only ever adds to them.
+  if (m_status_.parse_error) {
+    link_stats_.ParseErrors(m_status_.parse_error);
+    m_status_.parse_error = 0;
+  }
+  if (m_status_.packet_rx_drop_count) {
+    link_stats_.CrcFailures(m_status_.packet_rx_drop_count);
+    m_status_.packet_rx_drop_count = 0;
+  }
+}
 
+mavlink_message_t *MavlinkInterface::CommitRecvSlot(mavlink_message_t *slot,
+    const mavlink_message_t *message, const char *thrd_name) {
+  if (slot) {
+    const bool actuator = (message->msgid == MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS);
+    if (latency_tracer_ && actuator) {
+      latency_tracer_->ActuatorReceived(rx_stamp_ns_);
+    }
+    receiver_buffer_.Push();
+    if (actuator) {
+      actuator_received_.fetch_add(1, std::memory_order_release);
+    }
+    link_stats_.Received(message->msgid, LinkStats::FrameLen(message));
+    link_stats_.ReceiveQueueDepth(receiver_buffer_.Size());
+    NotifyRecvWaiter();
+  } else {
+    RecordReceived(message, LinkDirection::unhandled);
+    recv_dropped_++;
+    link_stats_.ReceiveDropped(message->msgid);
+    uint64_t suppressed;
+    if (recv_overflow_log_.Allow(&suppressed)) {
+      std::cerr << "[" << thrd_name << "] Messages buffer overflow, dropped msgid " << message->msgid
+                << " (" << recv_dropped_ << " total)" << RateLimitedLog::Suppressed(suppressed) << std::endl;
+    }
+  }
+  return receiver_buffer_.Back();
 }
 
 /*******************************************************
  * Send buffer handling
  */
 
-void MavlinkInterface::PushSendMessage(std::shared_ptr<mavlink_message_t> msg) {
+void MavlinkInterface::PushSendFrame(uint32_t msgid, const uint8_t *frame, size_t len) {
   const std::lock_guard<std::mutex> guard(sender_buff_mtx_);
-  sender_buffer_.push(msg);
-  sender_cv_.notify_one();
 
-  if (sender_buffer_.size() > kMaxSendBufferSize) {
-    sender_buffer_.pop();
+  // Serialized once on the producer side, the sender only writes out bytes
+  if (send_scheduler_.Push(msgid, frame, len) == SendScheduler::PushResult::dropped) {
+    link_stats_.SendDropped(msgid);
     // Starts reporting buffer overflows only after the connection is established to FC
-    if (received_first_actuator_) {
-      std::cerr << "PushSendMessage - Messages buffer overflow!" << std::endl;
+    uint64_t suppressed;
+    if (received_first_actuator_ && send_overflow_log_.Allow(&suppressed)) {
+      std::cerr << "PushSendMessage - Messages buffer overflow, dropped msgid " << msgid
+                << RateLimitedLog::Suppressed(suppressed) << std::endl;
     }
   }
 }
 
-void MavlinkInterface::PushSendMessage(mavlink_message_t *msg) {
-    auto msg_shared = std::make_shared<mavlink_message_t>(*msg);
-    PushSendMessage(msg_shared);
+std::vector<SendScheduler::LaneStats> MavlinkInterface::GetSendLaneStats() {
+  const std::lock_guard<std::mutex> guard(sender_buff_mtx_);
+  return send_scheduler_.Stats();
 }
 
-void MavlinkInterface::SendWorker() {
-  char thrd_name[64] = {0};
-  sprintf(thrd_name, "MAV_Sender_%d", gettid());
-  pthread_setname_np(pthread_self(), thrd_name);
+void MavlinkInterface::FlushSendMessages() {
+  {
+    const std::lock_guard<std::mutex> guard(sender_buff_mtx_);
+    tx_flush_requested_ = true;
+    sender_cv_.notify_one();
+  }
 
-  if ((fds_[CONNECTION_FD].fd <= 0) && tcp_client_mode_) {
-    std::cout << "[" << thrd_name << "] Try to connect to PX4 TCP server.. " << std::endl;
-    while (!tryConnect()) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  if (replayer_) {
+    // Nobody to send to while replaying, the frames only go into the recording
+    size_t count;
+    while ((count = DrainSendQueue()) > 0) {
+      RecordSent(tx_batch_.data(), count);
     }
-    std::cout << "[" << thrd_name << "] Client connected to PX4 TCP server" << std::endl;
+  } else if (shm_) {
+    // A memcpy per frame, not worth a hand-off to another thread
+    size_t count;
+    while ((count = DrainSendQueue()) > 0) {
+      TraceSentBatch(tx_batch_.data(), count, false);
+      send_mavlink_buffers(tx_batch_.data(), count);
+      TraceSentBatch(tx_batch_.data(), count, true);
+    }
+  } else if (use_serial_) {
+    boost::asio::post(io_service_, [this]() {
+      do_write();
+    });
+  } else if (tx_wake_fd_ >= 0) {
+    WakeReactorSender();
+  }
+}
 
+size_t MavlinkInterface::DrainSendQueue() {
+  const std::lock_guard<std::mutex> guard(sender_buff_mtx_);
+  if (!tx_flush_requested_) {
+    return 0;
   }
 
-  while(!close_conn_ && !gotSigInt_) {
-    std::unique_lock<std::mutex> lock{sender_buff_mtx_};
-    sender_cv_.wait(lock, [&]()
-    {
-      return close_conn_ || gotSigInt_ || !sender_buffer_.empty();
-    });
+  // Take the whole step's worth of frames, HIL_SENSOR first
+  const size_t count = send_scheduler_.Drain(tx_batch_.data(), tx_batch_.size());
+  tx_flush_requested_ = !send_scheduler_.Empty();
+  return count;
+}
+
+void MavlinkInterface::TraceSentBatch(const MsgBuffer *buffers, size_t count, bool sent) {
+  if (!latency_tracer_) {
+    return;
+  }
+
+  const int64_t now = LatencyTracer::Now();
+  for (size_t i = 0; i < count; i++) {
+    uint8_t seq;
+    if (LatencyTracer::SensorSeq(buffers[i], &seq)) {
+      if (sent) {
+        latency_tracer_->SensorSent(seq, now);
+      } else {
+        latency_tracer_->SensorDequeued(seq, now);
+      }
+    }
+  }
+}
+
+void MavlinkInterface::RecordSent(const MsgBuffer *buffers, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    link_stats_.Sent(LinkStats::FrameMsgId(buffers[i].data, buffers[i].len), buffers[i].len);
+  }
+
+  if (!recorder_) {
+    return;
+  }
+
+  const uint64_t sim_time = sim_time_usec_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < count; i++) {
+    recorder_->Append(LinkDirection::sent, sim_time, buffers[i].data, buffers[i].len);
+  }
+}
+
+void MavlinkInterface::RecordReceived(const mavlink_message_t *message, LinkDirection direction) {
+  if (!recorder_) {
+    return;
+  }
 
-    if (sender_buffer_.empty())
+  // Parsed frames re-serialize to the bytes that arrived, signature included
+  uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+  const uint16_t len = mavlink_msg_to_send_buffer(frame, message);
+  recorder_->Append(direction, sim_time_usec_.load(std::memory_order_relaxed), frame, len);
+}
+
+void MavlinkInterface::ReplayRecordedMessages() {
+  // Everything PX4 sent up to the current step, as fast as the simulation
+  // asks for it. Received frames are stamped with the step whose
+  // ReadMAVLinkMessages() handled them, not with when they arrived, so each
+  // step gets exactly the controls it got when recording.
+  const uint64_t sim_time = sim_time_usec_.load(std::memory_order_relaxed);
+  received_actuator_ = false;
+
+  LinkRecordEntry entry;
+  const uint8_t *frame;
+  while (replayer_->Peek(&entry, &frame) && entry.sim_time_usec <= sim_time) {
+    replayer_->Advance();
+    if (entry.direction != LinkDirection::received) {
       continue;
+    }
 
-    auto msg = sender_buffer_.front();
-    if (msg) {
-      sender_buffer_.pop();
-      lock.unlock();
-      send_mavlink_message(msg.get());
-    } else {
-      lock.unlock();
+    mavlink_message_t msg;
+    uint8_t framing;
+    ScanMavlinkFrame(frame, frame + entry.len, &msg, &m_status_, &framing);
+    if (static_cast<Framing>(framing) != Framing::ok) {
+      continue;
+    }
+    RecordReceived(&msg, LinkDirection::received);
+    handle_message(&msg);
+  }
+
+  if (!replay_finished_ && replayer_->AtEnd()) {
+    replay_finished_ = true;
+    std::cout << "Replay of " << replayer_->Path() << " finished after " << replayer_->Consumed()
+              << " frames, holding the last actuator controls" << std::endl;
+  }
+}
+
+void MavlinkInterface::SendWorker() {
+  char thrd_name[64] = {0};
+  sprintf(thrd_name, "MAV_Sender_%d", gettid());
+  pthread_setname_np(pthread_self(), thrd_name);
+  ApplyThreadPlacement(thrd_name, sender_placement_);
+
+  while(!close_conn_ && !gotSigInt_) {
+    {
+      std::unique_lock<std::mutex> lock{sender_buff_mtx_};
+      sender_cv_.wait(lock, [&]()
+      {
+        return close_conn_ || gotSigInt_ || (tx_flush_requested_ && !send_scheduler_.Empty());
+      });
+    }
+
+    const size_t count = DrainSendQueue();
+    if (count > 0) {
+      TraceSentBatch(tx_batch_.data(), count, false);
+      send_mavlink_buffers(tx_batch_.data(), count);
+      TraceSentBatch(tx_batch_.data(), count, true);
     }
   }
 
   std::cout << "The thread [" << thrd_name << "] was shutdown." << std::endl;
 }
 
-void MavlinkInterface::SendSensorMessages(uint64_t time_usec) {
+uint32_t MavlinkInterface::SendSensorMessages(uint64_t time_usec, uint32_t due_mask) {
+  sim_time_usec_.store(time_usec, std::memory_order_relaxed);
+
   mavlink_hil_sensor_t sensor_msg;
   sensor_msg.fields_updated = 0;
   /* Workaround for mavlinkv2 zero-suppression bug
@@ -290,6 +764,7 @@ void MavlinkInterface::SendSensorMessages(uint64_t time_usec) {
   */
   sensor_msg.id = 0;
   sensor_msg.time_usec = time_usec;
+  uint32_t sent_mask = 0;
   if (imu_updated_) {
     sensor_msg.xacc = accel_b_[0];
     sensor_msg.yacc = accel_b_[1];
@@ -300,72 +775,68 @@ void MavlinkInterface::SendSensorMessages(uint64_t time_usec) {
     // std::cout <<gyro_b[2] << std::endl;
 
     sensor_msg.fields_updated = (uint16_t)SensorSource::ACCEL | (uint16_t)SensorSource::GYRO;
+    sent_mask |= SensorBit(SimSensor::imu);
 
     imu_updated_ = false;
   }
 
-  // Sensor mutes not used for imu
-  const std::lock_guard<std::mutex> lock(sensor_msg_mutex_);
-
-  // send only mag data
-  if (mag_updated_) {
-    sensor_msg.xmag = mag_b_[0];
-    sensor_msg.ymag = mag_b_[1];
-    sensor_msg.zmag = mag_b_[2];
-    sensor_msg.fields_updated = sensor_msg.fields_updated | (uint16_t)SensorSource::MAG;
-
-    mag_updated_ = false;
+  // Snapshots of the slow sensors, the callbacks publishing them never wait on us
+  uint32_t version;
+  if (due_mask & SensorBit(SimSensor::mag)) {
+    const MagSample mag = mag_sample_.Load(&version);
+    if (version != mag_sent_version_) {
+      sensor_msg.xmag = mag.x;
+      sensor_msg.ymag = mag.y;
+      sensor_msg.zmag = mag.z;
+      sensor_msg.fields_updated = sensor_msg.fields_updated | (uint16_t)SensorSource::MAG;
+      sent_mask |= SensorBit(SimSensor::mag);
+      mag_sent_version_ = version;
+    }
   }
 
-  // send only baro data
-  if (baro_updated_) {
-    sensor_msg.temperature = temperature_;
-    sensor_msg.abs_pressure = abs_pressure_;
-    sensor_msg.pressure_alt = pressure_alt_;
-    sensor_msg.fields_updated = sensor_msg.fields_updated | (uint16_t)SensorSource::BARO;
-
-    baro_updated_ = false;
+  if (due_mask & SensorBit(SimSensor::baro)) {
+    const SensorData::Barometer baro = baro_sample_.Load(&version);
+    if (version != baro_sent_version_) {
+      sensor_msg.temperature = baro.temperature;
+      sensor_msg.abs_pressure = baro.abs_pressure;
+      sensor_msg.pressure_alt = baro.pressure_alt;
+      sensor_msg.fields_updated = sensor_msg.fields_updated | (uint16_t)SensorSource::BARO;
+      sent_mask |= SensorBit(SimSensor::baro);
+      baro_sent_version_ = version;
+    }
   }
 
-  // send only diff pressure data
-  if (diff_press_updated_) {
-    sensor_msg.diff_pressure = diff_pressure_;
-    sensor_msg.fields_updated = sensor_msg.fields_updated | (uint16_t)SensorSource::DIFF_PRESS;
+  if (due_mask & SensorBit(SimSensor::airspeed)) {
+    const SensorData::Airspeed airspeed = airspeed_sample_.Load(&version);
+    if (version != airspeed_sent_version_) {
+      sensor_msg.diff_pressure = airspeed.diff_pressure;
+      sensor_msg.fields_updated = sensor_msg.fields_updated | (uint16_t)SensorSource::DIFF_PRESS;
+      sent_mask |= SensorBit(SimSensor::airspeed);
+      airspeed_sent_version_ = version;
+    }
+  }
 
-    diff_press_updated_ = false;
+  const uint8_t seq = PushSendMessage<MAVLINK_MSG_ID_HIL_SENSOR>(sensor_msg);
+  lockstep_armed_ = true;
+  if (latency_tracer_) {
+    latency_tracer_->SensorEmitted(seq, LatencyTracer::Now());
   }
-  sensor_msg_mutex_.unlock();
 
-  mavlink_message_t msg;
-  mavlink_msg_hil_sensor_encode_chan(254, 25, MAVLINK_COMM_0, &msg, &sensor_msg);
-  // Override default global mavlink channel status with instance specific status
-  FinalizeOutgoingMessage(&msg, 254, 25,
-    MAVLINK_MSG_ID_HIL_SENSOR_MIN_LEN,
-    MAVLINK_MSG_ID_HIL_SENSOR_LEN,
-    MAVLINK_MSG_ID_HIL_SENSOR_CRC);
-  auto msg_shared = std::make_shared<mavlink_message_t>(msg);
-  PushSendMessage(msg_shared);
+  // HIL_SENSOR closes the sim step, send out everything queued so far
+  FlushSendMessages();
+  return sent_mask;
 }
 
 void MavlinkInterface::UpdateBarometer(const SensorData::Barometer &data) {
-  const std::lock_guard<std::mutex> lock(sensor_msg_mutex_);
-  temperature_ = data.temperature;
-  abs_pressure_ = data.abs_pressure;
-  pressure_alt_ = data.pressure_alt;
-
-  baro_updated_ = true;
+  baro_sample_.Store(data);
 }
 
 void MavlinkInterface::UpdateAirspeed(const SensorData::Airspeed &data) {
-  const std::lock_guard<std::mutex> lock(sensor_msg_mutex_);
-  diff_pressure_ = data.diff_pressure;
-
-  diff_press_updated_ = true;
+  airspeed_sample_.Store(data);
 }
 
 void MavlinkInterface::UpdateIMU(const SensorData::Imu &data) {
-  // Imu is updated only before sending, so locking handled there
-  //   by last_imu_message_mutex_
+  // Imu is updated only right before sending, on the same thread
   accel_b_ = data.accel_b;
   gyro_b_ = data.gyro_b;
 
@@ -373,10 +844,7 @@ void MavlinkInterface::UpdateIMU(const SensorData::Imu &data) {
 }
 
 void MavlinkInterface::UpdateMag(const SensorData::Magnetometer &data) {
-  const std::lock_guard<std::mutex> lock(sensor_msg_mutex_);
-  mag_b_ = data.mag_b;
-
-  mag_updated_ = true;
+  mag_sample_.Store(MagSample{data.mag_b[0], data.mag_b[1], data.mag_b[2]});
 }
 
 void MavlinkInterface::ReadMAVLinkMessages()
@@ -385,9 +853,21 @@ void MavlinkInterface::ReadMAVLinkMessages()
     return;
   }
 
+  if (replayer_) {
+    ReplayRecordedMessages();
+    return;
+  }
+
   received_actuator_ = false;
 
-  if ((fds_[CONNECTION_FD].fd <= 0) && tcp_client_mode_) {
+  // A new PX4 connection restarts lockstep with its first actuator controls
+  const uint32_t connections = connections_.load();
+  if (connections != connections_seen_) {
+    connections_seen_ = connections;
+    received_first_actuator_ = false;
+  }
+
+  if (use_tcp_ && (!connected_ || connection_lost_) && IsRecvBuffEmpty()) {
     return;
   }
 
@@ -396,132 +876,941 @@ void MavlinkInterface::ReadMAVLinkMessages()
     return;
   }
 
-  do {
-    //std::cerr << "[MavlinkInterface] check message from msg buffer.. " << std::endl;
-    auto msg = PopRecvMessage();
+  // In lockstep, block until PX4 answers the last HIL_SENSOR with actuator
+  // controls. With the barrier, the first vehicle of the step has waited
+  // for all of them, and the shared deadline bounds what is left.
+  const bool wait_for_actuator = enable_lockstep_ && received_first_actuator_;
+  const auto wait_start = std::chrono::steady_clock::now();
+  auto deadline = (lockstep_timeout_.count() > 0) ? wait_start + lockstep_timeout_
+                                                  : std::chrono::steady_clock::time_point::max();
+  if (wait_for_actuator && lockstep_barrier_) {
+    deadline = lockstep_barrier_->Arrive(sim_time_usec_.load(std::memory_order_relaxed));
+  }
+  bool timed_out = false;
+
+  while (true) {
+    mavlink_message_t *msg = PeekRecvMessage();
     if (msg) {
-      //std::cout << "[MavlinkInterface] ReadMAVLinkMessages -> handle_message " << std::endl;
-      handle_message(msg.get());
+      if (msg->msgid == MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS) {
+        actuator_consumed_++;
+        if (latency_tracer_) {
+          latency_tracer_->ActuatorDequeued(LatencyTracer::Now());
+        }
+      }
+      // Recorded here rather than by the receiver, stamped with the step that uses it
+      RecordReceived(msg, LinkDirection::received);
+      handle_message(msg);
+      PopRecvMessage();
     }
-  } while( (!enable_lockstep_ && !IsRecvBuffEmpty()) ||
-           ( enable_lockstep_ && !received_actuator_ && received_first_actuator_) );
-
-}
 
-void MavlinkInterface::acceptConnections()
-{
-  if (fds_[CONNECTION_FD].fd > 0) {
-    return;
+    if (!wait_for_actuator) {
+      if (IsRecvBuffEmpty()) {
+        break;
+      }
+    } else if (received_actuator_) {
+      break;
+    } else if (!msg && !WaitForRecvMessage(deadline)) {
+      timed_out = !gotSigInt_ && !close_conn_ && !connection_lost_;
+      break;
+    }
   }
 
-  // accepting incoming connections on listen fd
-  int ret =
-    accept(fds_[LISTEN_FD].fd, (struct sockaddr *)&remote_simulator_addr_, &remote_simulator_addr_len_);
-
-  if (ret < 0) {
-    if (errno != EWOULDBLOCK) {
-      std::cerr << "accept error: " << strerror(errno) << std::endl;
+  if (wait_for_actuator) {
+    // The last HIL_SENSOR has been waited for, until the next one there is nothing to wait for
+    lockstep_armed_ = false;
+    const double wait = std::chrono::duration<double>(std::chrono::steady_clock::now() - wait_start).count();
+    lockstep_wait_stats_.steps++;
+    lockstep_wait_stats_.last_wait = wait;
+    lockstep_wait_stats_.total_wait += wait;
+    lockstep_wait_stats_.max_wait = std::max(lockstep_wait_stats_.max_wait, wait);
+    uint64_t suppressed;
+    if (timed_out) {
+      lockstep_wait_stats_.timeouts++;
+      if (lockstep_timeout_log_.Allow(&suppressed)) {
+        std::cerr << "Lockstep: no actuator controls from PX4 within "
+                  << std::chrono::duration<double, std::milli>(lockstep_timeout_).count()
+                  << " ms, stepping without them" << RateLimitedLog::Suppressed(suppressed) << std::endl;
+      }
     }
-    return;
   }
-
-  // assign socket to connection descriptor on success
-  fds_[CONNECTION_FD].fd = ret; // socket is replaced with latest connection
-  fds_[CONNECTION_FD].events = POLLIN;
 }
 
-bool MavlinkInterface::tryConnect()
+bool MavlinkInterface::WaitForRecvMessage(std::chrono::steady_clock::time_point deadline)
 {
-  if (fds_[CONNECTION_FD].fd > 0) {
-    return true;
+  // Optional busy phase, cheaper than a wake-up when PX4 answers quickly
+  if (lockstep_spin_.count() > 0) {
+    const auto spin_until = std::min(deadline, std::chrono::steady_clock::now() + lockstep_spin_);
+    while (std::chrono::steady_clock::now() < spin_until) {
+      if (!IsRecvBuffEmpty()) {
+        return true;
+      }
+      SpinPause();
+    }
   }
 
-  // Try connecting to px4 simulator TCP server
-  int ret = connect(simulator_socket_fd_, (struct sockaddr *)&remote_simulator_addr_, remote_simulator_addr_len_);
+  std::unique_lock<std::mutex> lock(recv_wait_mtx_);
+  recv_waiting_.store(true);
+  // Pairs with the fence in NotifyRecvWaiter(): either we see the new frame
+  // or the receiver sees recv_waiting_ and notifies under the mutex.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  recv_wait_cv_.wait_until(lock, deadline, [this]() {
+    return !IsRecvBuffEmpty() || gotSigInt_ || close_conn_ || connection_lost_;
+  });
+  recv_waiting_.store(false);
 
-  if (ret < 0) {
-    return false;
+  return !IsRecvBuffEmpty();
+}
+
+void MavlinkInterface::NotifyRecvWaiter()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (recv_waiting_.load(std::memory_order_relaxed)) {
+    const std::lock_guard<std::mutex> lock(recv_wait_mtx_);
+    recv_wait_cv_.notify_one();
+  }
+  if (lockstep_barrier_) {
+    lockstep_barrier_->Notify();
+  }
+}
+
+LockstepMemberState MavlinkInterface::LockstepState() const
+{
+  if (!received_first_actuator_ || gotSigInt_ || close_conn_ || connection_lost_) {
+    return LockstepMemberState::idle;
+  }
+  // A new connection restarts lockstep, ReadMAVLinkMessages() does not wait
+  if (connections_.load() != connections_seen_ || (use_tcp_ && !connected_)) {
+    return LockstepMemberState::idle;
+  }
+  // Vehicles whose IMU was not due sent no HIL_SENSOR, PX4 has nothing to answer
+  if (!lockstep_armed_) {
+    return LockstepMemberState::idle;
+  }
+  return actuator_received_.load(std::memory_order_acquire) > actuator_consumed_ ?
+    LockstepMemberState::ready : LockstepMemberState::pending;
+}
+
+void MavlinkInterface::acceptConnections(const char *thrd_name)
+{
+  if (connected_) {
+    return;
+  }
+
+  // accepting incoming connections on the non-blocking listen fd
+  remote_simulator_addr_len_ = sizeof(remote_simulator_addr_);
+  int ret =
+    accept(fds_[LISTEN_FD].fd, (struct sockaddr *)&remote_simulator_addr_, &remote_simulator_addr_len_);
+
+  if (ret < 0) {
+    if (errno != EWOULDBLOCK && errno != EAGAIN) {
+      std::cerr << "accept error: " << strerror(errno) << std::endl;
+    }
+    return;
+  }
+
+  int yes = 1;
+  if (setsockopt(ret, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) != 0) {
+    std::cerr << "setsockopt failed: " << strerror(errno) << std::endl;
   }
 
   // assign socket to connection descriptor on success
-  fds_[CONNECTION_FD].events = POLLIN | POLLOUT; // read/write
-  fds_[CONNECTION_FD].fd = simulator_socket_fd_;
+  SetConnection(ret, thrd_name);
+}
+
+void MavlinkInterface::ConfigureSocket(int fd)
+{
+  const auto set = [fd](int opt, int value, const char *name) {
+    if (setsockopt(fd, SOL_SOCKET, opt, &value, sizeof(value)) != 0) {
+      std::cerr << "setsockopt " << name << " failed: " << strerror(errno) << std::endl;
+      return false;
+    }
+    return true;
+  };
+  // The kernel doubles the request for its bookkeeping and caps it at the sysctl limit
+  const auto check = [fd](int opt, int requested, const char *name, const char *sysctl) {
+    int actual = 0;
+    socklen_t len = sizeof(actual);
+    if (getsockopt(fd, SOL_SOCKET, opt, &actual, &len) == 0 && actual / 2 < requested) {
+      std::cerr << name << " capped at " << actual / 2 << " bytes, raise " << sysctl << std::endl;
+    }
+  };
+
+  if (socket_rcvbuf_ > 0 && set(SO_RCVBUF, socket_rcvbuf_, "SO_RCVBUF")) {
+    check(SO_RCVBUF, socket_rcvbuf_, "SO_RCVBUF", "net.core.rmem_max");
+  }
+  if (socket_sndbuf_ > 0 && set(SO_SNDBUF, socket_sndbuf_, "SO_SNDBUF")) {
+    check(SO_SNDBUF, socket_sndbuf_, "SO_SNDBUF", "net.core.wmem_max");
+  }
+
+  if (busy_poll_) {
+#ifdef SO_BUSY_POLL
+    // Optional, the receiver spins in user space either way
+    const int usec = static_cast<int>(busy_poll_us_.count());
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) != 0) {
+      const int err = errno;
+      std::cerr << "SO_BUSY_POLL not applied: " << strerror(err)
+                << (err == EPERM ? ", needs CAP_NET_ADMIN or net.core.busy_read" : "") << std::endl;
+    }
+#endif
+  }
+
+  if (kernel_timestamps_) {
+    set(SO_TIMESTAMPING, SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE, "SO_TIMESTAMPING");
+  }
+}
+
+int MavlinkInterface::CreateTcpSocket()
+{
+  int fd;
+  if ((fd = socket(socket_family_, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    std::cerr << "Creating TCP socket failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+
+  int yes = 1;
+  int result = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  if (result != 0) {
+    std::cerr << "setsockopt failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+
+  struct linger nolinger {};
+  nolinger.l_onoff = 1;
+  nolinger.l_linger = 0;
+
+  result = setsockopt(fd, SOL_SOCKET, SO_LINGER, &nolinger, sizeof(nolinger));
+  if (result != 0) {
+    std::cerr << "setsockopt failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+
+  // The socket reuse is necessary for reconnecting to the same address
+  // if the socket does not close but gets stuck in TIME_WAIT. This can happen
+  // if the server is suddenly closed, for example, if the robot is deleted in gazebo.
+  int socket_reuse = 1;
+  result = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &socket_reuse, sizeof(socket_reuse));
+  if (result != 0) {
+    std::cerr << "setsockopt failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+
+  // Same as above but for a given port
+  result = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &socket_reuse, sizeof(socket_reuse));
+  if (result != 0) {
+    std::cerr << "setsockopt failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+
+  return fd;
+}
+
+/**
+ * One non-blocking step of the TCP connection state machine:
+ * server mode accepts a pending connection, client mode starts a connect()
+ * once the retry backoff has passed, or picks up the outcome of the one in
+ * progress. Called by whoever owns the connection, the receiver thread or
+ * the connect timer handler in reactor mode.
+ *
+ * @param[out] events what to wait for on the returned fd before the next step
+ * @return the listen socket or the connecting one to wait on, -1 when
+ * connected or backing off until next_connect_time_
+ */
+int MavlinkInterface::AdvanceConnection(short *events, const char *thrd_name)
+{
+  if (!tcp_client_mode_) {
+    acceptConnections(thrd_name);
+    if (connected_) {
+      return -1;
+    }
+    *events = POLLIN;
+    return fds_[LISTEN_FD].fd;
+  }
+
+  // PX4 not up yet (ECONNREFUSED) or gone again, try anew after the backoff
+  const auto retry_later = [&](int err) {
+    ::close(connecting_fd_);
+    connecting_fd_ = -1;
+    if (connect_retry_ == kConnectRetryMin) {
+      std::cout << "[" << thrd_name << "] Try to connect to PX4 TCP server.. (" << strerror(err) << ")" << std::endl;
+    }
+    next_connect_time_ = std::chrono::steady_clock::now() + connect_retry_;
+    connect_retry_ = std::min(2 * connect_retry_, kConnectRetryMax);
+  };
+
+  if (connecting_fd_ < 0) {
+    if (std::chrono::steady_clock::now() < next_connect_time_) {
+      return -1;
+    }
+    connecting_fd_ = CreateTcpSocket();
+    SetNonBlocking(connecting_fd_);
+    if (connect(connecting_fd_, (struct sockaddr *)&remote_simulator_addr_, remote_simulator_addr_len_) < 0 &&
+        errno != EINPROGRESS) {
+      retry_later(errno);
+      return -1;
+    }
+  }
+
+  // Writable once the handshake is over, SO_ERROR then tells how it went
+  struct pollfd pfd {connecting_fd_, POLLOUT, 0};
+  if (poll(&pfd, 1, 0) <= 0) {
+    *events = POLLOUT;
+    return connecting_fd_;
+  }
+
+  const int fd = connecting_fd_;
+  const int err = SocketError(fd);
+  if (err != 0) {
+    retry_later(err);
+    return -1;
+  }
+
+  connecting_fd_ = -1;
+  SetConnection(fd, thrd_name);
+  return -1;
+}
+
+void MavlinkInterface::SetConnection(int fd, const char *thrd_name)
+{
+  // Handlers in reactor mode must not block, the receiver thread does unless it busy-polls
+  if (io_threads_ > 0 || busy_poll_) {
+    SetNonBlocking(fd);
+  } else {
+    SetBlocking(fd);
+  }
+  ConfigureSocket(fd);
+
+  {
+    const std::lock_guard<std::mutex> lock(conn_mtx_);
+    fds_[CONNECTION_FD].fd = fd;
+    fds_[CONNECTION_FD].events = POLLIN | POLLOUT; // read/write
+    connection_lost_ = false;
+    connected_ = true;
+  }
+  connect_retry_ = kConnectRetryMin;
+  connections_++;
+
+  if (tcp_client_mode_) {
+    std::cout << "[" << thrd_name << "] Client connected to PX4 TCP server" << std::endl;
+  } else {
+    std::cout << "[" << thrd_name << "] TCP connection detected" << std::endl;
+  }
+}
+
+void MavlinkInterface::ConnectionLost()
+{
+  if (!connection_lost_.exchange(true)) {
+    link_stats_.Disconnected();
+  }
+  // Don't keep a lockstep wait going for a PX4 that is gone
+  NotifyRecvWaiter();
+}
+
+void MavlinkInterface::DropConnection(const char *thrd_name)
+{
+  {
+    const std::lock_guard<std::mutex> lock(conn_mtx_);
+    if (fds_[CONNECTION_FD].fd >= 0) {
+      ::close(fds_[CONNECTION_FD].fd);
+    }
+    fds_[CONNECTION_FD].fd = -1;
+    connected_ = false;
+    connection_lost_ = false;
+  }
 
+  // A frame cut off by the disconnect must not swallow the first one of the next connection
+  m_status_.parse_state = MAVLINK_PARSE_STATE_IDLE;
+  m_status_.msg_received = MAVLINK_FRAMING_INCOMPLETE;
+
+  // Reconnect right away, backing off only if that fails
+  next_connect_time_ = std::chrono::steady_clock::time_point{};
+  connect_retry_ = kConnectRetryMin;
+
+  if (tcp_client_mode_) {
+    std::cout << "[" << thrd_name << "] Connection to PX4 lost, reconnecting.." << std::endl;
+  } else {
+    std::cout << "[" << thrd_name << "] Connection to PX4 lost, waiting for a new one.." << std::endl;
+  }
+}
+
+void MavlinkInterface::WaitForConnection(const char *thrd_name)
+{
+  short events = 0;
+  const int fd = AdvanceConnection(&events, thrd_name);
+  if (connected_) {
+    return;
+  }
+
+  // Bounded waits, so that close() is noticed while PX4 is away
+  if (fd >= 0) {
+    struct pollfd pfd {fd, events, 0};
+    poll(&pfd, 1, kConnectPollTimeoutMs);
+  } else {
+    const auto backoff = next_connect_time_ - std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+        backoff, std::chrono::milliseconds(kConnectPollTimeoutMs)));
+  }
+}
+
+void MavlinkInterface::StartReactorIo()
+{
+  reactor_ = IoReactor::Acquire(io_threads_, reactor_placement_);
+  tx_backlog_.clear();
+  tx_blocked_ = false;
+
+  tx_wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (tx_wake_fd_ < 0) {
+    std::cerr << "Creating send eventfd failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+  tx_reg_ = reactor_->Register(tx_wake_fd_, EPOLLIN, [this](uint32_t) {
+    return OnSendWakeup();
+  });
+
+  if (!use_tcp_) {
+    SetNonBlocking(simulator_socket_fd_);
+    WatchConnection();
+    return;
+  }
+
+  // TCP: the connect timer handler runs the connection state machine. It is
+  // the only one to register and unregister the listen, connecting and
+  // connection sockets, and it closes a lost connection only after its
+  // registration is gone, so a recycled fd number never meets a stale one.
+  connect_timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (connect_timer_fd_ < 0) {
+    std::cerr << "Creating connect timer failed: " << strerror(errno) << ", aborting" << std::endl;
+    abort();
+  }
+  std::cout << "[MAV_IO] Wait for TCP connection.." << std::endl;
+  connect_reg_ = reactor_->Register(connect_timer_fd_, EPOLLIN, [this](uint32_t) {
+    return OnConnectTimer();
+  });
+  ArmConnectTimer(std::chrono::nanoseconds::zero());
+}
+
+void MavlinkInterface::ArmConnectTimer(std::chrono::nanoseconds delay)
+{
+  // One-shot; a zero it_value would disarm it instead
+  delay = std::max(delay, std::chrono::nanoseconds(1));
+  struct itimerspec timeout {};
+  timeout.it_value.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(delay).count();
+  timeout.it_value.tv_nsec = (delay % std::chrono::seconds(1)).count();
+  if (timerfd_settime(connect_timer_fd_, 0, &timeout, nullptr) < 0) {
+    std::cerr << "[MAV_IO] connect timer error: " << strerror(errno) << std::endl;
+  }
+}
+
+bool MavlinkInterface::OnConnectTimer()
+{
+  uint64_t expirations;
+  if (read(connect_timer_fd_, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+    std::cerr << "[MAV_IO] connect timer error: " << strerror(errno) << std::endl;
+  }
+  if (close_conn_ || gotSigInt_) {
+    return false;
+  }
+
+  if (connection_lost_) {
+    reactor_->Unregister(rx_reg_);
+    rx_reg_ = 0;
+    DropConnection("MAV_IO");
+  }
+  if (connected_) {
+    return true;
+  }
+
+  // Whatever woke us up has served its purpose
+  reactor_->Unregister(pending_reg_);
+  pending_reg_ = 0;
+
+  short events = 0;
+  const int fd = AdvanceConnection(&events, "MAV_IO");
+  if (connected_) {
+    WatchConnection();
+  } else if (fd >= 0) {
+    pending_reg_ = reactor_->Register(fd, (events & POLLIN) ? EPOLLIN : EPOLLOUT, [this](uint32_t) {
+      ArmConnectTimer(std::chrono::nanoseconds::zero());
+      return false;
+    });
+  } else {
+    ArmConnectTimer(next_connect_time_ - std::chrono::steady_clock::now());
+  }
   return true;
 }
 
+void MavlinkInterface::StopReactorIo()
+{
+  if (!reactor_) {
+    return;
+  }
+
+  // Connection state machine first, it may still register the others
+  reactor_->Unregister(connect_reg_);
+  reactor_->Unregister(pending_reg_);
+  reactor_->Unregister(rx_reg_);
+  reactor_->Unregister(tx_reg_);
+  connect_reg_ = pending_reg_ = rx_reg_ = tx_reg_ = 0;
+
+  if (tx_wake_fd_ >= 0) {
+    ::close(tx_wake_fd_);
+    tx_wake_fd_ = -1;
+  }
+  if (connect_timer_fd_ >= 0) {
+    ::close(connect_timer_fd_);
+    connect_timer_fd_ = -1;
+  }
+  if (connecting_fd_ >= 0) {
+    ::close(connecting_fd_);
+    connecting_fd_ = -1;
+  }
+
+  reactor_.reset();
+}
+
+void MavlinkInterface::WatchConnection()
+{
+  rx_reg_ = reactor_->Register(fds_[CONNECTION_FD].fd, EPOLLIN, [this](uint32_t) {
+    return OnConnectionReadable();
+  });
+}
+
+bool MavlinkInterface::OnConnectionReadable()
+{
+  // Bounded so that one busy link cannot monopolize a pool thread
+  for (unsigned i = 0; i < kReactorReadBudget && !close_conn_ && !gotSigInt_; i++) {
+    if (!ReceiveOnce("MAV_IO")) {
+      break;
+    }
+  }
+  // Woken up for room (EPOLLOUT) or not, a blocked send gets another try;
+  // an EPOLLIN wake-up consumes the EPOLLOUT it was armed with
+  if (tx_blocked_) {
+    WakeReactorSender();
+  }
+  if (connection_lost_) {
+    // The connect timer handler closes the socket and starts over
+    ArmConnectTimer(std::chrono::nanoseconds::zero());
+    return false;
+  }
+  return !close_conn_ && !gotSigInt_;
+}
+
+void MavlinkInterface::WakeReactorSender()
+{
+  const uint64_t one = 1;
+  uint64_t suppressed;
+  if (write(tx_wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN && send_error_log_.Allow(&suppressed)) {
+    std::cerr << "Reactor send wake-up failed: " << strerror(errno)
+              << RateLimitedLog::Suppressed(suppressed) << std::endl;
+  }
+}
+
+void MavlinkInterface::DeferSend(const MsgBuffer *buffers, size_t count)
+{
+  tx_backlog_.assign(buffers, buffers + count);
+  tx_backlog_connection_ = connections_.load();
+  tx_blocked_ = true;
+  reactor_->Arm(rx_reg_, EPOLLOUT);
+}
+
+bool MavlinkInterface::OnSendWakeup()
+{
+  uint64_t wakeups;
+  if (read(tx_wake_fd_, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+    std::cerr << "[MAV_IO] send eventfd error: " << strerror(errno) << std::endl;
+  }
+
+  // A full socket must not hold up the pool thread, which serves the other
+  // vehicles too. What it left over goes out first, the rest waits in the
+  // send queue meanwhile.
+  if (tx_blocked_) {
+    if (connections_.load() != tx_backlog_connection_) {
+      // Half a frame is no way to start a new connection
+      for (const MsgBuffer &buf : tx_backlog_) {
+        link_stats_.SendDropped(LinkStats::FrameMsgId(buf.data, buf.len));
+      }
+      tx_backlog_.clear();
+    }
+    bool blocked = false;
+    const size_t sent = WriteBuffers(tx_backlog_.data(), tx_backlog_.size(), &blocked);
+    TraceSentBatch(tx_backlog_.data(), sent, true);
+    if (blocked) {
+      tx_backlog_.erase(tx_backlog_.begin(), tx_backlog_.begin() + sent);
+      reactor_->Arm(rx_reg_, EPOLLOUT);
+      return !close_conn_ && !gotSigInt_;
+    }
+    for (size_t i = sent; i < tx_backlog_.size(); i++) {
+      link_stats_.SendDropped(LinkStats::FrameMsgId(tx_backlog_[i].data, tx_backlog_[i].len));
+    }
+    tx_backlog_.clear();
+    tx_blocked_ = false;
+  }
+
+  size_t count;
+  while ((count = DrainSendQueue()) > 0) {
+    TraceSentBatch(tx_batch_.data(), count, false);
+    bool blocked = false;
+    const size_t sent = WriteBuffers(tx_batch_.data(), count, &blocked);
+    TraceSentBatch(tx_batch_.data(), sent, true);
+    if (blocked) {
+      DeferSend(tx_batch_.data() + sent, count - sent);
+      break;
+    }
+  }
+  return !close_conn_ && !gotSigInt_;
+}
+
+/*******************************************************
+ * Serial transport
+ */
+
+void MavlinkInterface::open()
+{
+  try {
+    serial_dev_.open(device_);
+    serial_dev_.set_option(boost::asio::serial_port_base::baud_rate(baudrate_));
+    serial_dev_.set_option(boost::asio::serial_port_base::character_size(8));
+    serial_dev_.set_option(boost::asio::serial_port_base::parity(boost::asio::serial_port_base::parity::none));
+    serial_dev_.set_option(boost::asio::serial_port_base::stop_bits(boost::asio::serial_port_base::stop_bits::one));
+    serial_dev_.set_option(boost::asio::serial_port_base::flow_control(boost::asio::serial_port_base::flow_control::none));
+  }
+  catch (const boost::system::system_error &err) {
+    std::cerr << "Error opening serial device " << device_ << ": " << err.what() << ", aborting" << std::endl;
+    abort();
+  }
+
+  ConfigureSerialLowLatency();
+
+  std::cout << "Opened serial device " << device_ << " at " << baudrate_ << " baud" << std::endl;
+
+  io_service_.restart();
+  boost::asio::post(io_service_, [this]() {
+    do_read();
+  });
+
+  io_thread_ = std::thread([this] () {
+    pthread_setname_np(pthread_self(), "MAV_Serial");
+    ApplyThreadPlacement("MAV_Serial", receiver_placement_);
+    io_service_.run();
+    std::cout << "The thread [MAV_Serial] was shutdown." << std::endl;
+  });
+}
+
+void MavlinkInterface::ConfigureSerialLowLatency()
+{
+  const int fd = serial_dev_.native_handle();
+
+  // Raw mode on top of the options set by Asio: no line discipline, no
+  // echo, no signals and reads that return as soon as a byte is available
+  struct termios tio {};
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+      std::cerr << "Serial tcsetattr failed: " << strerror(errno) << std::endl;
+    }
+  } else {
+    std::cerr << "Serial tcgetattr failed: " << strerror(errno) << std::endl;
+  }
+
+  // Disable the UART driver's receive latency timer where supported (FTDI,
+  // 8250); CDC-ACM devices don't implement it, which is fine
+  struct serial_struct serial {};
+  if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &serial) != 0) {
+      std::cerr << "Serial ASYNC_LOW_LATENCY not applied: " << strerror(errno) << std::endl;
+    }
+  }
+
+  // Drop whatever the board sent before we started listening
+  tcflush(fd, TCIOFLUSH);
+}
+
+void MavlinkInterface::do_read()
+{
+  serial_dev_.async_read_some(boost::asio::buffer(rx_buf_),
+      [this](const boost::system::error_code& err, std::size_t bytes_t) {
+        parse_buffer(err, bytes_t);
+      });
+}
+
+void MavlinkInterface::parse_buffer(const boost::system::error_code& err, std::size_t bytes_t)
+{
+  if (err) {
+    if (err != boost::asio::error::operation_aborted) {
+      std::cerr << "[MAV_Serial] read error: " << err.message() << std::endl;
+      close_conn_ = true;
+      NotifyRecvWaiter();
+    }
+    return;
+  }
+
+  if (latency_tracer_) {
+    rx_stamp_ns_ = LatencyTracer::Now();
+  }
+  ParseBytes(rx_buf_.data(), bytes_t, "MAV_Serial");
+  do_read();
+}
+
+void MavlinkInterface::do_write()
+{
+  if (tx_in_progress_ || close_conn_ || gotSigInt_) {
+    return;
+  }
+
+  // The whole step goes out as one gathered write
+  const size_t count = DrainSendQueue();
+  if (count == 0) {
+    return;
+  }
+
+  TraceSentBatch(tx_batch_.data(), count, false);
+
+  tx_serial_buffers_.clear();
+  for (size_t i = 0; i < count; i++) {
+    tx_serial_buffers_.emplace_back(tx_batch_[i].dpos(), tx_batch_[i].nbytes());
+  }
+
+  tx_in_progress_ = true;
+  boost::asio::async_write(serial_dev_, tx_serial_buffers_,
+      [this, count](const boost::system::error_code& err, std::size_t) {
+        TraceSentBatch(tx_batch_.data(), count, true);
+        tx_in_progress_ = false;
+        if (err) {
+          uint64_t suppressed;
+          if (err != boost::asio::error::operation_aborted) {
+            link_stats_.SendErrors();
+            if (received_first_actuator_ && send_error_log_.Allow(&suppressed)) {
+              std::cerr << "[MAV_Serial] write error: " << err.message()
+                        << RateLimitedLog::Suppressed(suppressed) << std::endl;
+            }
+          }
+          return;
+        }
+        RecordSent(tx_batch_.data(), count);
+        // Frames queued while this write was in flight
+        do_write();
+      });
+}
+
+void MavlinkInterface::RegisterMessageHandler(uint32_t msgid, MessageHandler handler)
+{
+  if (msgid >= kMaxHandledMsgId) {
+    std::cerr << "Cannot handle msgid " << msgid << ", the handler table ends at "
+              << kMaxHandledMsgId << std::endl;
+    return;
+  }
+  if (msgid >= message_handlers_.size()) {
+    message_handlers_.resize(msgid + 1);
+  }
+  message_handlers_[msgid] = std::move(handler);
+}
+
 void MavlinkInterface::handle_message(mavlink_message_t *msg)
 {
-  switch (msg->msgid) {
-  case MAVLINK_MSG_ID_HEARTBEAT:
-    handle_heartbeat(msg);
-    break;
-  case MAVLINK_MSG_ID_HIL_ACTUATOR_CONTROLS:
-    handle_actuator_controls(msg);
-    break;
+  if (HasMessageHandler(msg->msgid)) {
+    message_handlers_[msg->msgid](msg);
   }
 }
 
-void MavlinkInterface::handle_heartbeat(mavlink_message_t *)
+void MavlinkInterface::handle_heartbeat(const mavlink_message_t *)
 {
   received_heartbeats_ = true;
 }
 
-void MavlinkInterface::handle_actuator_controls(mavlink_message_t *msg)
+void MavlinkInterface::handle_actuator_controls(const mavlink_message_t *msg)
 {
-  const std::lock_guard<std::mutex> lock(actuator_mutex_);
-
   mavlink_hil_actuator_controls_t controls;
   mavlink_msg_hil_actuator_controls_decode(msg, &controls);
 
-  armed_ = (controls.mode & MAV_MODE_FLAG_SAFETY_ARMED || controls.mode & MAV_MODE_FLAG_TEST_ENABLED);
-
+  const unsigned back = actuator_index_.load(std::memory_order_relaxed) ^ 1;
+  ActuatorFrame &frame = actuator_frames_[back];
+  frame.armed = (controls.mode & MAV_MODE_FLAG_SAFETY_ARMED || controls.mode & MAV_MODE_FLAG_TEST_ENABLED);
+  frame.time_usec = controls.time_usec;
   // set rotor and servo speeds, controller targets
-  input_reference_.resize(n_out_max);
-  for (int i = 0; i < input_reference_.size(); i++) {
-    input_is_motor_[i] = controls.flags & (1 << i);
-    input_reference_[i] = controls.controls[i];
+  frame.motor_flags = static_cast<uint16_t>(controls.flags);
+  for (unsigned i = 0; i < ActuatorFrame::kOutputs; i++) {
+    frame.controls[i] = controls.controls[i];
   }
+  frame.valid = true;
+  actuator_index_.store(back, std::memory_order_release);
+
   received_actuator_ = true;
   received_first_actuator_ = true;
+
+  if (latency_tracer_) {
+    latency_tracer_->ActuatorApplied(LatencyTracer::Now());
+  }
 }
 
 void MavlinkInterface::send_mavlink_message(const mavlink_message_t *message)
 {
   assert(message != nullptr);
 
-  if (gotSigInt_ || close_conn_) {
+  MsgBuffer buffer(message);
+  send_mavlink_buffers(&buffer, 1);
+}
+
+void MavlinkInterface::send_mavlink_buffers(MsgBuffer *buffers, size_t count)
+{
+  if (shm_) {
+    for (size_t i = 0; i < count; i++) {
+      if (!shm_->Send(buffers[i].dpos(), buffers[i].nbytes())) {
+        for (size_t j = i; j < count; j++) {
+          link_stats_.SendDropped(LinkStats::FrameMsgId(buffers[j].data, buffers[j].len));
+        }
+        // PX4 not attached or not keeping up; the ring holds many steps' worth
+        uint64_t suppressed;
+        if (received_first_actuator_ && send_overflow_log_.Allow(&suppressed)) {
+          std::cerr << "Shared-memory link full, dropped " << count - i << " frames"
+                    << RateLimitedLog::Suppressed(suppressed) << std::endl;
+        }
+        return;
+      }
+      RecordSent(&buffers[i], 1);
+    }
+    return;
+  }
+
+  if (tx_blocked_) {
+    for (size_t i = 0; i < count; i++) {
+      link_stats_.SendDropped(LinkStats::FrameMsgId(buffers[i].data, buffers[i].len));
+    }
     return;
   }
+  WriteBuffers(buffers, count, nullptr);
+}
 
-  uint8_t buffer[MAVLINK_MAX_PACKET_LEN];
-  int packetlen = mavlink_msg_to_send_buffer(buffer, message);
+size_t MavlinkInterface::WriteBuffers(MsgBuffer *buffers, size_t count, bool *blocked)
+{
+  const std::lock_guard<std::mutex> lock(conn_mtx_);
+  if (gotSigInt_ || close_conn_ || fds_[CONNECTION_FD].fd < 0 || connection_lost_) {
+    return 0;
+  }
+
+  size_t sent = 0;
+  while (sent < count) {
+    const size_t chunk = std::min(count - sent, static_cast<size_t>(kSendBatchSize));
+    ssize_t ret;
 
-  if (fds_[CONNECTION_FD].fd > 0) {
-    ssize_t len;
     if (use_tcp_) {
-      len = send(fds_[CONNECTION_FD].fd, buffer, packetlen, 0);
-    } else {
-      len = sendto(fds_[CONNECTION_FD].fd, buffer, packetlen, 0, (struct sockaddr *)&remote_simulator_addr_, remote_simulator_addr_len_);
-    }
-    if (len < 0) {
-      if (received_first_actuator_) {
-        std::cerr << "Failed sending mavlink message: " << strerror(errno) << std::endl;
-        if (errno == ECONNRESET || errno == EPIPE) {
-          if (use_tcp_) { // udp socket remains alive
-            std::cerr << "Closing connection." << std::endl;
-            close_conn_ = true;
+      // One gathered write for all frames, resuming at MsgBuffer::pos after a
+      // partial write. sendmsg() rather than writev() for MSG_NOSIGNAL: a PX4
+      // that went away must end in EPIPE and a reconnect, not in SIGPIPE.
+      for (size_t i = 0; i < chunk; i++) {
+        send_iovecs_[i].iov_base = buffers[sent + i].dpos();
+        send_iovecs_[i].iov_len = buffers[sent + i].nbytes();
+      }
+      struct msghdr hdr {};
+      hdr.msg_iov = send_iovecs_;
+      hdr.msg_iovlen = chunk;
+      ret = sendmsg(fds_[CONNECTION_FD].fd, &hdr, MSG_NOSIGNAL);
+      if (ret >= 0) {
+        size_t written = ret;
+        while (written > 0) {
+          MsgBuffer &buf = buffers[sent];
+          const size_t n = std::min(written, static_cast<size_t>(buf.nbytes()));
+          buf.pos += n;
+          written -= n;
+          if (buf.nbytes() == 0) {
+            RecordSent(&buf, 1);
+            sent++;
           }
         }
+        continue;
+      }
+    } else {
+      // One datagram per frame, all of them in a single sendmmsg
+      for (size_t i = 0; i < chunk; i++) {
+        send_iovecs_[i].iov_base = buffers[sent + i].dpos();
+        send_iovecs_[i].iov_len = buffers[sent + i].nbytes();
+        struct msghdr &hdr = send_msgs_[i].msg_hdr;
+        hdr.msg_name = &remote_simulator_addr_;
+        hdr.msg_namelen = remote_simulator_addr_len_;
+        hdr.msg_iov = &send_iovecs_[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = nullptr;
+        hdr.msg_controllen = 0;
+        hdr.msg_flags = 0;
+      }
+      ret = sendmmsg(fds_[CONNECTION_FD].fd, send_msgs_, chunk, 0);
+      if (ret > 0) {
+        RecordSent(buffers + sent, ret);
+        sent += ret;
+        continue;
       }
     }
+
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (blocked) {
+        // Reactor mode, the caller resumes at buffers[sent] once there is room
+        *blocked = true;
+        return sent;
+      }
+      // Non-blocking socket on the sender thread: wait briefly for room
+      // rather than dropping the rest of the batch, or half a frame on TCP
+      struct pollfd pfd {fds_[CONNECTION_FD].fd, POLLOUT, 0};
+      if (poll(&pfd, 1, kSendPollTimeoutMs) > 0) {
+        continue;
+      }
+    }
+
+    if (ret < 0) {
+      const int err = errno;
+      link_stats_.SendErrors();
+      uint64_t suppressed;
+      if (received_first_actuator_ && send_error_log_.Allow(&suppressed)) {
+        std::cerr << "Failed sending mavlink message: " << strerror(err)
+                  << RateLimitedLog::Suppressed(suppressed) << std::endl;
+      }
+      if (use_tcp_ && (err == ECONNRESET || err == EPIPE)) { // udp socket remains alive
+        // The receiving side owns the fd; shutting it down wakes it up to
+        // close it and reconnect
+        ConnectionLost();
+        shutdown(fds_[CONNECTION_FD].fd, SHUT_RDWR);
+      }
+    }
+    return sent;
   }
+  return sent;
 }
 
 void MavlinkInterface::close()
 {
-  // Shutdown receiver side
-  shutdown(fds_[CONNECTION_FD].fd, SHUT_RD);
+  if (use_serial_) {
+    // Closing on the I/O thread aborts the pending read, after which run() returns
+    boost::asio::post(io_service_, [this]() {
+      boost::system::error_code ec;
+      serial_dev_.close(ec);
+    });
+    if (io_thread_.joinable()) {
+      io_thread_.join();
+    }
+    boost::system::error_code ec;
+    serial_dev_.close(ec);
+  }
+
+  // Stops the connection state machine, then shuts down the receiver side
+  close_conn_ = true;
+  {
+    const std::lock_guard<std::mutex> lock(conn_mtx_);
+    shutdown(fds_[CONNECTION_FD].fd, SHUT_RD);
+  }
+
+  StopReactorIo();
+
+  if (shm_) {
+    shm_->Wake();
+  }
+
+  // Release a lockstep wait in progress
+  {
+    const std::lock_guard<std::mutex> lock(recv_wait_mtx_);
+    recv_wait_cv_.notify_all();
+  }
 
   if (receiver_thread_.joinable())
     receiver_thread_.join();
@@ -531,39 +1820,56 @@ void MavlinkInterface::close()
     sender_thread_.join();
   }
 
-  ::close(fds_[CONNECTION_FD].fd);
-  fds_[CONNECTION_FD] = { 0, 0, 0 };
-  fds_[CONNECTION_FD].fd = -1;
+  // No receiver is left to notify the barrier
+  if (lockstep_barrier_) {
+    lockstep_barrier_->Leave(lockstep_barrier_id_);
+    lockstep_barrier_.reset();
+    lockstep_barrier_id_ = 0;
+  }
+
+  for (auto &pfd : fds_) {
+    if (pfd.fd >= 0) {
+      ::close(pfd.fd);
+    }
+    pfd = { -1, 0, 0 };
+  }
+  if (connecting_fd_ >= 0) {
+    ::close(connecting_fd_);
+    connecting_fd_ = -1;
+  }
+  connected_ = false;
+  if (shm_) {
+    shm_->Close();
+    shm_.reset();
+  }
 
   received_first_actuator_ = false;
-}
 
+  if (lockstep_wait_stats_.steps > 0) {
+    std::cout << "Lockstep waited " << lockstep_wait_stats_.steps << " steps, mean "
+              << 1e3 * lockstep_wait_stats_.total_wait / lockstep_wait_stats_.steps << " ms, max "
+              << 1e3 * lockstep_wait_stats_.max_wait << " ms, "
+              << lockstep_wait_stats_.timeouts << " timeouts" << std::endl;
+    lockstep_wait_stats_ = LockstepWaitStats{};
+  }
 
+  if (latency_tracer_ && !latency_tracer_->Empty()) {
+    latency_tracer_->Dump(std::cout);
+    latency_tracer_->Reset();
+  }
 
-void MavlinkInterface::onSigInt() {
-  gotSigInt_ = true;
-  close();
+  // After the I/O threads are gone, nothing appends any more
+  if (recorder_) {
+    recorder_->Close();
+    std::cout << "Recorded " << recorder_->Entries() << " MAVLink frames to " << recorder_->Path() << std::endl;
+    recorder_.reset();
+  }
 }
 
-Eigen::VectorXd MavlinkInterface::GetActuatorControls() {
-  const std::lock_guard<std::mutex> lock(actuator_mutex_);
-  return input_reference_;
-}
 
-bool MavlinkInterface::IsInputMotorAtIndex(int index) {
-  const std::lock_guard<std::mutex> lock(actuator_mutex_);
-  return input_is_motor_[index];
-}
 
-bool MavlinkInterface::GetArmedState() {
-  const std::lock_guard<std::mutex> lock(actuator_mutex_);
-  return armed_;
+void MavlinkInterface::onSigInt() {
+  gotSigInt_ = true;
+  close();
 }
 
-// Mavlink helper function to finalize message without global channel status
-uint16_t MavlinkInterface::FinalizeOutgoingMessage(mavlink_message_t* msg, uint8_t system_id, uint8_t component_id, uint8_t min_length, uint8_t length, uint8_t crc_extra)
-{
-    const std::lock_guard<std::mutex> guard(mav_status_mutex_);
-    return mavlink_finalize_message_buffer(msg, system_id, component_id, &sender_m_status_,
-        min_length, length, crc_extra);
-}
@@ -0,0 +1,65 @@
+#include "rtf_pacer.h"
+
+#include <thread>
+
+#include "spin_pause.h"
+
+void RtfPacer::SetTarget(double rtf) {
+  target_ = rtf > 0.0 ? rtf : 0.0;
+  started_ = false;
+}
+
+void RtfPacer::Anchor(Clock::time_point wall, Duration sim_time) {
+  anchor_wall_ = wall;
+  anchor_sim_ = sim_time;
+}
+
+void RtfPacer::Pace(Duration sim_time) {
+  Clock::time_point now = Clock::now();
+
+  if (!started_ || sim_time < last_sim_) {
+    started_ = true;
+    Anchor(now, sim_time);
+    window_wall_ = now;
+    window_sim_ = sim_time;
+  }
+  last_sim_ = sim_time;
+
+  if (target_ > 0.0) {
+    const Clock::time_point deadline = anchor_wall_ + std::chrono::duration_cast<Duration>(
+      std::chrono::duration<double>(sim_time - anchor_sim_) / target_);
+
+    if (now < deadline) {
+      throttled_steps_++;
+      const Clock::time_point start = now;
+      if (deadline - now > spin_) {
+        std::this_thread::sleep_until(deadline - spin_);
+      }
+      while ((now = Clock::now()) < deadline) {
+        SpinPause();
+      }
+      throttled_time_ += now - start;
+    } else if (now - deadline > kMaxLag) {
+      // Too far behind to catch up without a burst of unpaced steps
+      Anchor(now, sim_time);
+    }
+  }
+
+  const Duration wall_elapsed = now - window_wall_;
+  if (wall_elapsed >= window_) {
+    achieved_ = std::chrono::duration<double>(sim_time - window_sim_).count() /
+                std::chrono::duration<double>(wall_elapsed).count();
+    window_wall_ = now;
+    window_sim_ = sim_time;
+    window_done_ = true;
+  }
+}
+
+bool RtfPacer::WindowDone(double *achieved) {
+  if (!window_done_) {
+    return false;
+  }
+  window_done_ = false;
+  *achieved = achieved_;
+  return true;
+}
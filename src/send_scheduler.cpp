@@ -0,0 +1,131 @@
+#include "send_scheduler.h"
+
+#include <algorithm>
+#include <cstring>
+
+SendScheduler::SendScheduler() {
+  lanes_.reserve(kMaxLanes);
+
+  // HIL_SENSOR advances PX4 lockstep: strict priority and a short FIFO so
+  // that no sensor update is coalesced away. Ground truth is latest-value.
+  AddLane(MAVLINK_MSG_ID_HIL_SENSOR, 0, 8);
+  AddLane(MAVLINK_MSG_ID_HIL_GPS, 1, 1);
+  AddLane(MAVLINK_MSG_ID_HIL_STATE_QUATERNION, 1, 1);
+}
+
+void SendScheduler::AddLane(uint32_t msgid, uint8_t priority, size_t depth) {
+  depth = std::max<size_t>(depth, 1);
+
+  Lane *lane = FindLane(msgid);
+  if (lane) {
+    pending_ -= lane->count;
+    lane->frames.assign(depth, MsgBuffer());
+    lane->head = 0;
+    lane->count = 0;
+    lane->priority = priority;
+  } else {
+    if (lanes_.size() >= kMaxLanes) {
+      return;
+    }
+    Lane new_lane;
+    new_lane.msgid = msgid;
+    new_lane.priority = priority;
+    new_lane.frames.resize(depth);
+    lanes_.push_back(std::move(new_lane));
+  }
+
+  std::stable_sort(lanes_.begin(), lanes_.end(), [](const Lane &a, const Lane &b) {
+    return a.priority < b.priority;
+  });
+}
+
+SendScheduler::Lane *SendScheduler::FindLane(uint32_t msgid) {
+  for (auto &lane : lanes_) {
+    if (lane.msgid == msgid) {
+      return &lane;
+    }
+  }
+  return nullptr;
+}
+
+SendScheduler::PushResult SendScheduler::Push(const mavlink_message_t *msg) {
+  PushResult result;
+  MsgBuffer *slot = NextSlot(msg->msgid, &result);
+  if (slot) {
+    slot->len = mavlink_msg_to_send_buffer(slot->data, msg);
+  }
+  return result;
+}
+
+SendScheduler::PushResult SendScheduler::Push(uint32_t msgid, const uint8_t *frame, size_t len) {
+  PushResult result;
+  MsgBuffer *slot = NextSlot(msgid, &result);
+  if (slot) {
+    memcpy(slot->data, frame, len);
+    slot->len = len;
+  }
+  return result;
+}
+
+MsgBuffer *SendScheduler::NextSlot(uint32_t msgid, PushResult *result) {
+  Lane *lane = FindLane(msgid);
+  if (!lane) {
+    if (lanes_.size() >= kMaxLanes) {
+      unrouted_dropped_++;
+      *result = PushResult::dropped;
+      return nullptr;
+    }
+    AddLane(msgid, kDefaultPriority, kDefaultDepth);
+    lane = FindLane(msgid);
+  }
+
+  const size_t depth = lane->frames.size();
+  *result = PushResult::queued;
+  lane->pushed++;
+
+  if (lane->count == depth) {
+    // Lane full: overwrite the oldest frame
+    lane->head = (lane->head + 1) % depth;
+    lane->count--;
+    pending_--;
+    if (depth == 1) {
+      lane->coalesced++;
+      *result = PushResult::coalesced;
+    } else {
+      lane->dropped++;
+      *result = PushResult::dropped;
+    }
+  }
+
+  MsgBuffer &slot = lane->frames[(lane->head + lane->count) % depth];
+  slot.pos = 0;
+  lane->count++;
+  lane->high_water = std::max(lane->high_water, lane->count);
+  pending_++;
+
+  return &slot;
+}
+
+size_t SendScheduler::Drain(MsgBuffer *out, size_t max) {
+  size_t n = 0;
+  for (auto &lane : lanes_) {
+    const size_t depth = lane.frames.size();
+    while (lane.count > 0 && n < max) {
+      out[n++] = lane.frames[lane.head];
+      lane.head = (lane.head + 1) % depth;
+      lane.count--;
+      pending_--;
+    }
+  }
+  return n;
+}
+
+std::vector<SendScheduler::LaneStats> SendScheduler::Stats() const {
+  std::vector<LaneStats> stats;
+  stats.reserve(lanes_.size());
+  for (const auto &lane : lanes_) {
+    stats.push_back({lane.msgid, lane.priority, lane.frames.size(), lane.count,
+        lane.high_water, lane.pushed, lane.coalesced, lane.dropped});
+  }
+  return stats;
+}
@@ -0,0 +1,235 @@
+#include "shm_link.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/futex.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static constexpr size_t kRecordAlign = 4;
+
+static size_t RecordSize(size_t len) {
+  return (sizeof(uint32_t) + len + kRecordAlign - 1) & ~(kRecordAlign - 1);
+}
+
+static size_t MapSize(size_t ring_bytes) {
+  return sizeof(ShmLinkHeader) + 2 * (sizeof(ShmRing) + ring_bytes);
+}
+
+static std::string ShmPath(const std::string &name) {
+  return "/dev/shm/" + (name.empty() || name[0] != '/' ? name : name.substr(1));
+}
+
+static void FutexWake(std::atomic<uint32_t> *word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static void FutexWait(std::atomic<uint32_t> *word, uint32_t value, std::chrono::milliseconds timeout) {
+  struct timespec ts {};
+  ts.tv_sec = timeout.count() / 1000;
+  ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+  // EAGAIN (value changed), EINTR and ETIMEDOUT all just send us back to the ring
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, value, &ts, nullptr, 0);
+}
+
+//! Copy @p len bytes to/from the ring data at byte count @p pos, wrapping at the end
+static void CopyIn(uint8_t *data, size_t ring_bytes, uint64_t pos, const void *src, size_t len) {
+  const size_t offset = pos & (ring_bytes - 1);
+  const size_t first = std::min(len, ring_bytes - offset);
+  memcpy(data + offset, src, first);
+  memcpy(data, static_cast<const uint8_t *>(src) + first, len - first);
+}
+
+static void CopyOut(const uint8_t *data, size_t ring_bytes, uint64_t pos, void *dst, size_t len) {
+  const size_t offset = pos & (ring_bytes - 1);
+  const size_t first = std::min(len, ring_bytes - offset);
+  memcpy(dst, data + offset, first);
+  memcpy(static_cast<uint8_t *>(dst) + first, data, len - first);
+}
+
+bool ShmLink::Create(const std::string &name, size_t ring_bytes) {
+  Close();
+  path_ = ShmPath(name);
+
+  size_t size = 4096;
+  while (size < ring_bytes) {
+    size <<= 1;
+  }
+  ring_bytes = size;
+
+  // A file left behind by a crashed run may still be mapped by an old PX4
+  unlink(path_.c_str());
+  const int fd = ::open(path_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    std::cerr << "ShmLink: cannot create " << path_ << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  if (ftruncate(fd, MapSize(ring_bytes)) != 0) {
+    std::cerr << "ShmLink: cannot size " << path_ << ": " << strerror(errno) << std::endl;
+    ::close(fd);
+    unlink(path_.c_str());
+    return false;
+  }
+  if (!Map(fd, MapSize(ring_bytes))) {
+    unlink(path_.c_str());
+    return false;
+  }
+  owner_ = true;
+  ring_bytes_ = ring_bytes;
+
+  // Fresh file, so everything is zero already; construct the atomics in place
+  header_ = new (map_) ShmLinkHeader();
+  memcpy(header_->magic, kShmLinkMagic, sizeof(header_->magic));
+  header_->ring_bytes = ring_bytes;
+  header_->creator_pid = getpid();
+  tx_ = new (map_ + sizeof(ShmLinkHeader)) ShmRing();
+  rx_ = new (map_ + sizeof(ShmLinkHeader) + sizeof(ShmRing) + ring_bytes) ShmRing();
+
+  // The version goes last, a peer attaching early sees an incomplete header as invalid
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->version = kShmLinkVersion;
+  return true;
+}
+
+bool ShmLink::Attach(const std::string &name) {
+  Close();
+  path_ = ShmPath(name);
+
+  const int fd = ::open(path_.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "ShmLink: cannot open " << path_ << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ShmLinkHeader)) {
+    std::cerr << "ShmLink: " << path_ << " is not a MAVLink shared-memory link" << std::endl;
+    ::close(fd);
+    return false;
+  }
+  if (!Map(fd, st.st_size)) {
+    return false;
+  }
+
+  header_ = reinterpret_cast<ShmLinkHeader *>(map_);
+  ring_bytes_ = header_->ring_bytes;
+  if (memcmp(header_->magic, kShmLinkMagic, sizeof(header_->magic)) != 0 ||
+      header_->version != kShmLinkVersion || (ring_bytes_ & (ring_bytes_ - 1)) != 0 ||
+      MapSize(ring_bytes_) > map_size_) {
+    std::cerr << "ShmLink: " << path_ << " is not a version " << kShmLinkVersion
+              << " MAVLink shared-memory link" << std::endl;
+    Close();
+    return false;
+  }
+
+  // Seen from this end the rings are swapped
+  rx_ = reinterpret_cast<ShmRing *>(map_ + sizeof(ShmLinkHeader));
+  tx_ = reinterpret_cast<ShmRing *>(map_ + sizeof(ShmLinkHeader) + sizeof(ShmRing) + ring_bytes_);
+  header_->peer_pid.store(getpid(), std::memory_order_relaxed);
+  return true;
+}
+
+bool ShmLink::Map(int fd, size_t size) {
+  void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    std::cerr << "ShmLink: cannot map " << path_ << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  map_ = static_cast<uint8_t *>(map);
+  map_size_ = size;
+  return true;
+}
+
+void ShmLink::Close() {
+  if (map_) {
+    if (!owner_ && header_) {
+      header_->peer_pid.store(0, std::memory_order_relaxed);
+    }
+    munmap(map_, map_size_);
+    map_ = nullptr;
+  }
+  if (owner_) {
+    unlink(path_.c_str());
+    owner_ = false;
+  }
+  header_ = nullptr;
+  tx_ = rx_ = nullptr;
+  map_size_ = ring_bytes_ = 0;
+}
+
+bool ShmLink::Send(const uint8_t *frame, size_t len) {
+  const std::lock_guard<std::mutex> lock(tx_mutex_);
+  if (!tx_) {
+    return false;
+  }
+
+  const uint64_t tail = tx_->tail.load(std::memory_order_relaxed);
+  const uint64_t head = tx_->head.load(std::memory_order_acquire);
+  const size_t size = RecordSize(len);
+  if (size > ring_bytes_ - (tail - head)) {
+    return false;
+  }
+
+  const uint32_t len32 = static_cast<uint32_t>(len);
+  uint8_t *data = Data(tx_);
+  CopyIn(data, ring_bytes_, tail, &len32, sizeof(len32));
+  CopyIn(data, ring_bytes_, tail + sizeof(len32), frame, len);
+  tx_->tail.store(tail + size, std::memory_order_release);
+
+  // Either the consumer sees the new tail, or we see it waiting (both seq_cst)
+  tx_->futex.fetch_add(1, std::memory_order_seq_cst);
+  if (tx_->waiting.load(std::memory_order_seq_cst)) {
+    FutexWake(&tx_->futex);
+  }
+  return true;
+}
+
+size_t ShmLink::Receive(uint8_t *buf, size_t size, std::chrono::milliseconds timeout) {
+  if (!rx_) {
+    return 0;
+  }
+
+  const uint64_t head = rx_->head.load(std::memory_order_relaxed);
+  uint64_t tail = rx_->tail.load(std::memory_order_acquire);
+  if (tail == head) {
+    rx_->waiting.store(1, std::memory_order_seq_cst);
+    const uint32_t seq = rx_->futex.load(std::memory_order_seq_cst);
+    tail = rx_->tail.load(std::memory_order_acquire);
+    if (tail == head) {
+      FutexWait(&rx_->futex, seq, timeout);
+      tail = rx_->tail.load(std::memory_order_acquire);
+    }
+    rx_->waiting.store(0, std::memory_order_relaxed);
+    if (tail == head) {
+      return 0;
+    }
+  }
+
+  const uint8_t *data = Data(rx_);
+  uint32_t len;
+  CopyOut(data, ring_bytes_, head, &len, sizeof(len));
+  if (RecordSize(len) > tail - head) {
+    std::cerr << "ShmLink: corrupt record in " << path_ << ", dropping the ring contents" << std::endl;
+    rx_->head.store(tail, std::memory_order_release);
+    return 0;
+  }
+  const size_t copied = std::min<size_t>(len, size);
+  CopyOut(data, ring_bytes_, head + sizeof(len), buf, copied);
+  rx_->head.store(head + RecordSize(len), std::memory_order_release);
+  return copied;
+}
+
+void ShmLink::Wake() {
+  if (rx_) {
+    rx_->futex.fetch_add(1, std::memory_order_seq_cst);
+    FutexWake(&rx_->futex);
+  }
+}
@@ -0,0 +1,166 @@
+#include "thread_placement.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+static bool ParseInt(const std::string &str, int min, int max, int *value) {
+  if (str.empty()) {
+    return false;
+  }
+  char *end = nullptr;
+  errno = 0;
+  const long parsed = strtol(str.c_str(), &end, 10);
+  if (errno != 0 || *end != '\0' || parsed < min || parsed > max) {
+    return false;
+  }
+  *value = static_cast<int>(parsed);
+  return true;
+}
+
+bool ParseCpuList(const std::string &list, std::vector<int> *cpus) {
+  std::vector<int> parsed;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    const size_t dash = item.find('-');
+    int first, last;
+    if (dash == std::string::npos) {
+      if (!ParseInt(item, 0, CPU_SETSIZE - 1, &first)) {
+        return false;
+      }
+      last = first;
+    } else if (!ParseInt(item.substr(0, dash), 0, CPU_SETSIZE - 1, &first) ||
+               !ParseInt(item.substr(dash + 1), first, CPU_SETSIZE - 1, &last)) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      parsed.push_back(cpu);
+    }
+  }
+  if (parsed.empty()) {
+    return false;
+  }
+
+  std::sort(parsed.begin(), parsed.end());
+  parsed.erase(std::unique(parsed.begin(), parsed.end()), parsed.end());
+  cpus->swap(parsed);
+  return true;
+}
+
+std::string FormatCpuList(const std::vector<int> &cpus) {
+  std::ostringstream out;
+  for (size_t i = 0; i < cpus.size(); i++) {
+    size_t last = i;
+    while (last + 1 < cpus.size() && cpus[last + 1] == cpus[last] + 1) {
+      last++;
+    }
+    out << (i > 0 ? "," : "") << cpus[i];
+    if (last > i) {
+      out << "-" << cpus[last];
+    }
+    i = last;
+  }
+  return out.str();
+}
+
+bool ThreadPlacementFromEnv(const std::string &role, ThreadPlacement *placement) {
+  std::string prefix = "PX4_SIM_" + role;
+  std::transform(prefix.begin(), prefix.end(), prefix.begin(), ::toupper);
+
+  const std::string cpus_var = prefix + "_CPUS";
+  if (const char *cpus = std::getenv(cpus_var.c_str())) {
+    if (!ParseCpuList(cpus, &placement->cpus)) {
+      std::cerr << "Invalid CPU list " << cpus_var << "='" << cpus << "'" << std::endl;
+      return false;
+    }
+  }
+
+  const std::string prio_var = prefix + "_PRIORITY";
+  if (const char *prio = std::getenv(prio_var.c_str())) {
+    if (!ParseInt(prio, 0, 99, &placement->priority)) {
+      std::cerr << "Invalid priority " << prio_var << "='" << prio << "', expected 0..99" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+void ApplyThreadPlacement(const char *thrd_name, const ThreadPlacement &placement) {
+  if (placement.Empty()) {
+    return;
+  }
+
+  if (!placement.cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : placement.cpus) {
+      CPU_SET(cpu, &set);
+    }
+    const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+      std::cerr << "[" << thrd_name << "] cannot pin to CPUs " << FormatCpuList(placement.cpus)
+                << ": " << strerror(err) << std::endl;
+    }
+  }
+
+  if (placement.priority > 0) {
+    struct sched_param param {};
+    param.sched_priority = placement.priority;
+    const int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err == EPERM) {
+      std::cerr << "[" << thrd_name << "] no permission for SCHED_FIFO priority " << placement.priority
+                << ", needs CAP_SYS_NICE or an rtprio limit of at least that (ulimit -r)" << std::endl;
+    } else if (err != 0) {
+      std::cerr << "[" << thrd_name << "] cannot set SCHED_FIFO priority " << placement.priority
+                << ": " << strerror(err) << std::endl;
+    }
+  }
+
+  // Report what the kernel granted, not what was asked for
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  int policy = SCHED_OTHER;
+  struct sched_param param {};
+  pthread_getschedparam(pthread_self(), &policy, &param);
+
+  std::cout << "[" << thrd_name << "] running on CPUs " << FormatCpuList(cpus) << " with ";
+  if (policy == SCHED_FIFO) {
+    std::cout << "SCHED_FIFO priority " << param.sched_priority << std::endl;
+  } else {
+    std::cout << "SCHED_OTHER" << std::endl;
+  }
+}
+
+bool LockProcessMemory() {
+  static std::once_flag once;
+  static bool locked = false;
+  std::call_once(once, [] () {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+      std::cout << "Locked the process memory" << std::endl;
+      locked = true;
+    } else if (errno == EPERM || errno == ENOMEM) {
+      std::cerr << "Cannot lock the process memory: " << strerror(errno)
+                << ", needs CAP_IPC_LOCK or a larger memlock limit (ulimit -l)" << std::endl;
+    } else {
+      std::cerr << "Cannot lock the process memory: " << strerror(errno) << std::endl;
+    }
+  });
+  return locked;
+}